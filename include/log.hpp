@@ -11,9 +11,13 @@
 #include <vector>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "mutex.hpp"
 #include "fsutil.hpp"
+#include "tmutil.hpp"
 
 #ifndef NULL
 #define NULL 0
@@ -22,6 +26,7 @@
 using namespace std;
 
 class XLog;
+class XLogQueue;
 class XLogManager;
 class XLogHandler;
 class XLogNullHandler;
@@ -35,6 +40,72 @@ enum LogLevel {
     NONE, FATAL, ERROR, WARNING, INFO, DEBUG
 };
 
+/********************************************************************************
+ * XLogQueue
+ ********************************************************************************/
+
+#define XLOG_MSG_LEN        512
+
+/**
+ * A log entry, formatted by the thread that logs it.
+ */
+struct XLogRecord {
+    XTime time;
+    LogLevel level;
+    const char* origin;     /**< Must be a static string, e.g. a literal */
+    const char* func;       /**< Same */
+    char msg[XLOG_MSG_LEN]; /**< Truncated if longer */
+};
+
+/**
+ * Bounded lock-free queue of log records, with many producers and a
+ * single consumer. Each cell has a sequence number, which tells whether
+ * the cell is free for the producer of a given position, or filled for
+ * the consumer. The records are written in place, without copy.
+ */
+class XLogQueue
+{
+public:
+    /**
+     * @param capacity   Number of records, rounded up to a power of 2.
+     */
+    XLogQueue(size_t capacity);
+    ~XLogQueue();
+
+    /**
+     * Reserve the next cell. Returns NULL if the queue is full.
+     * Otherwise, the record must be filled then committed.
+     */
+    XLogRecord* reserve(size_t* pos);
+    void commit(size_t pos);
+
+    /**
+     * Get the oldest record, or NULL if the queue is empty. Consumer only.
+     */
+    XLogRecord* front();
+    /**
+     * Release the oldest record. Consumer only.
+     */
+    void pop();
+
+private:
+    XLogQueue(const XLogQueue&);
+    XLogQueue& operator=(const XLogQueue&);
+
+    struct Cell {
+        volatile size_t seq;
+        XLogRecord rec;
+    };
+
+    Cell * cells;
+    size_t mask;
+    char pad0[64];
+    volatile size_t enqueue_pos;    // On their own cache lines, as the
+    char pad1[64];                  // producers and the consumer update
+    volatile size_t dequeue_pos;    // them concurrently
+    char pad2[64];
+};
+
 /********************************************************************************
  * XLog
  ********************************************************************************/
@@ -62,6 +133,12 @@ public:
      * all logs below this level will be ignored.
      */
     void setLevel(LogLevel level);
+    /**
+     * Whether the entries of a level are output. This is a plain read of
+     * the level, cheap enough to be done before building the arguments
+     * of a log call, see XLOG_DEBUG().
+     */
+    bool isEnabled(LogLevel level) const { return level <= curr_level; }
     /**
      * Add a log handler.
      */
@@ -98,6 +175,34 @@ public:
      * Flush all log entries.
      */
     void flush();
+
+    /**
+     * Log through a queue, drained to the handlers by a background thread,
+     * instead of writing from the thread logging. The messages are
+     * formatted, and time-stamped, by the thread logging them.
+     *
+     * @param capacity   Number of entries of the queue.
+     * @param block      When the queue is full, wait for room if true,
+     *                   otherwise drop the entry.
+     *
+     * @returns          0, or an error code if the thread cannot be started.
+     */
+    int startAsync(size_t capacity, bool block);
+    /**
+     * Write the entries left in the queue, and go back to logging
+     * synchronously.
+     */
+    void stopAsync();
+    /**
+     * Number of entries dropped because the queue was full.
+     */
+    uint64_t getDropped();
+    /**
+     * Stop the background threads of the handlers, e.g. before the code
+     * is unloaded. The handlers go on logging without them.
+     */
+    void stopHandlers();
+
 protected:
     /**
      * Generic log method.
@@ -107,11 +212,56 @@ protected:
 private:
     friend class XLogManager;
 
+    void enqueue(XLogQueue* q, const char* origin, const char* func, LogLevel level,
+                 const char* format, va_list& arglist);
+    void stopWriter();              // async_mutex must be held
+    static void* writerMain(void* arg);
+    void writer();
+    void writeBatch(XLogQueue* q);
+
     string logger_name;
-    LogLevel curr_level;
+    volatile LogLevel curr_level;   // Read without lock by isEnabled()
     set<XLogHandler*> log_handlers;
+    XMutex handlers_mutex;
+
+    XMutex async_mutex;             // Serializes startAsync() and stopAsync()
+    XLogQueue * volatile queue;     // NULL when logging synchronously
+    volatile int producers;         // Threads using the queue
+    bool block_when_full;
+    volatile uint64_t dropped;
+    pthread_t writer_thread;
+    volatile bool writer_stop;
+    volatile int writer_idle;
+    XMutex writer_mutex;
+    XCondition writer_cond;
 };
 
+/**
+ * Log front end for the frequent entries: the level is checked before the
+ * arguments are evaluated, so a disabled entry costs a load and a compare,
+ * not a call with the arguments marshalled.
+ *
+ *   XLOG_DEBUG(logger, MOD_NAME, func_name, "oid=%s", oid);
+ *
+ * Building with XLOG_NO_DEBUG defined removes the debug entries from the
+ * code altogether.
+ */
+#ifdef XLOG_NO_DEBUG
+#define XLOG_DEBUG(logger, origin, func, ...)       do { } while (0)
+#else
+#define XLOG_DEBUG(logger, origin, func, ...)                        \
+    do {                                                            \
+        if ((logger).isEnabled(DEBUG))                              \
+            (logger).debug(origin, func, __VA_ARGS__);              \
+    } while (0)
+#endif
+
+#define XLOG_INFO(logger, origin, func, ...)                         \
+    do {                                                            \
+        if ((logger).isEnabled(INFO))                               \
+            (logger).info(origin, func, __VA_ARGS__);               \
+    } while (0)
+
 /********************************************************************************
  * XLogManager
  ********************************************************************************/
@@ -186,10 +336,23 @@ public:
      */
     virtual void log(const char* origin, const char* func, LogLevel level, const char* format, va_list& arglist) = 0;
 
+    /**
+     * Write a log entry already formatted and time-stamped, e.g. by the
+     * background writer of an asynchronous logger. The default is to log
+     * the message, stamped with the current time.
+     */
+    virtual void write(const XTime& tm, const char* origin, const char* func, LogLevel level, const char* msg);
+
     const char* getLevelStr(const int& level);
 
     virtual void setLevel(LogLevel l);
 
+    /**
+     * Stop the background threads of the handler, if any. The default
+     * does nothing.
+     */
+    virtual void stop();
+
 protected:
     LogLevel level;
 };
@@ -226,6 +389,7 @@ public:
 
     virtual void flush();
     virtual void log(const char* origin, const char* func, LogLevel level, const char* format, va_list& arglist); 
+    virtual void write(const XTime& tm, const char* origin, const char* func, LogLevel level, const char* msg);
 
 private:
     XMutex mutex;
@@ -246,6 +410,7 @@ public:
 
     virtual void flush();
     virtual void log(const char* origin, const char* func, LogLevel level, const char* format, va_list& arglist); 
+    virtual void write(const XTime& tm, const char* origin, const char* func, LogLevel level, const char* msg);
 
 protected:
     void openLogFile();
@@ -256,6 +421,7 @@ protected:
 
     string log_filename;
     long log_file_size;
+    time_t log_file_time;   // When the log file was opened
     FILE * log_file;
 };
 
@@ -284,23 +450,68 @@ public:
  * XLogRollingFileHandler
  ********************************************************************************/
 
-// class XLogRollingFileHandler : public XLogFileHandlerBase
-// {
-// public:
-//     XLogRollingFileHandler();
-//     ~XLogRollingFileHandler();
-//    virtual const string getNextFilename() = 0;
-//    virtual bool reachFileLimit() = 0;
-
-// private:
-//     const string getNextFilename();
-//     bool reachFileLimit();
-
-//     int curr_index;      // Current log file 1 .. num_files
-//     int num_files;       // Number of log files
-//     long max_file_size;  // Log file size limit
-//     int curr_file_num;   // Current log file number
-// };
+/**
+ * File log handler that starts a new file when the current one reaches a
+ * size or an age. The previous files are kept as <filename>.1 (the most
+ * recent) to <filename>.N, gzipped if asked, and the older ones removed.
+ * A file that cannot be compressed is kept as <filename>.I, uncompressed,
+ * and shifted and removed with the others.
+ *
+ * The new file is opened while the entries are still written to the old
+ * one, renamed, and the writers only wait for the swap of the two. The
+ * renames of the previous files and the compression are done by a
+ * background thread.
+ */
+class XLogRollingFileHandler : public XLogFileHandlerBase
+{
+public:
+    /**
+     * Constructor.
+     *
+     * @param filename   Path and file name of the log file.
+     * @param max_size   Size in bytes above which the file is rotated,
+     *                   0 for no limit.
+     * @param max_age    Age in seconds above which the file is rotated,
+     *                   0 for no limit.
+     * @param num_files  Number of previous files kept.
+     * @param compress   Whether the previous files are gzipped.
+     */
+    XLogRollingFileHandler(const char* filename, long max_size, int max_age,
+                           int num_files, bool compress);
+    ~XLogRollingFileHandler();
+
+    virtual void log(const char* origin, const char* func, LogLevel level, const char* format, va_list& arglist); 
+    virtual void write(const XTime& tm, const char* origin, const char* func, LogLevel level, const char* msg);
+    /**
+     * Stop the archiver. The files rotated afterwards keep their rotated
+     * names.
+     */
+    virtual void stop();
+
+private:
+    bool reachFileLimit();
+    void rotate();
+    const string getFilename(int index, bool gz);
+    void archive(const string& filename);
+    static void* archiverMain(void* arg);
+    void archiver();
+
+    long max_file_size;     // Log file size limit
+    int max_file_age;       // Log file age limit, in seconds
+    int num_files;          // Number of previous log files
+    bool compress;
+
+    volatile int rotating;
+    unsigned long rotations;
+
+    // Files rotated, to be renamed and compressed by the archiver
+    XMutex archive_mutex;
+    XCondition archive_cond;
+    vector<string> archive_files;
+    bool archiver_started;
+    bool archiver_stop;
+    pthread_t archiver_thread;
+};
 
 /********************************************************************************
  * XLogSyslogHandler
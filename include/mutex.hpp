@@ -24,6 +24,8 @@ public:
     void unlock();
 
 private:
+    friend class XCondition;
+
 #if __WIN32__ || _MSC_VER
    CRITICAL_SECTION crit_section;
 #elif __unix__
@@ -31,3 +33,35 @@ private:
 #endif
 
 };
+
+/**
+ * A simple condition variable class that is portable. It is always
+ * used together with an XMutex, which must be locked by the caller.
+ */
+class XCondition
+{
+public:
+    XCondition();
+    ~XCondition();
+
+    /**
+     * Wait until signaled. The mutex is released while waiting.
+     */
+    void wait(XMutex& m);
+    /**
+     * Wait until signaled, or at most msec milliseconds.
+     *
+     * @returns   true if signaled, false on timeout.
+     */
+    bool timedWait(XMutex& m, long msec);
+    void signal();
+    void broadcast();
+
+private:
+#if __WIN32__ || _MSC_VER
+   CONDITION_VARIABLE cond;
+#elif __unix__
+   pthread_cond_t   cond;
+#endif
+
+};
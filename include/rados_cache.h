@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+
+#ifndef _RADOS_CACHE_H_
+#define _RADOS_CACHE_H_
+
+#include <map>
+#include <list>
+#include <string>
+
+#include "rados_nif.h"
+
+using namespace std;
+
+/*
+ * A buffer of object data. It is kept in a resource, so that all the
+ * binaries made from it share the same memory, without copy.
+ */
+struct read_buf_t
+{
+    size_t size;
+    char data[1];
+};
+
+extern ErlNifResourceType * read_buf_type_resource;
+
+read_buf_t* read_buf_alloc(size_t size);
+ERL_NIF_TERM read_buf_make_binary(ErlNifEnv* env, read_buf_t* buf, size_t offset, size_t len);
+
+/*
+ * LRU cache of object ranges for an io context, bounded in bytes.
+ *
+ * Entries are invalidated by the writes issued through the same io
+ * context. With validation on, every hit is also checked against the
+ * object version on the OSD, which costs a round trip but no data
+ * transfer, so that writes from other clients are seen as well.
+ */
+class ReadCache
+{
+public:
+    ReadCache(size_t max_bytes, bool validate);
+
+    void keep();
+    void release();
+
+    /*
+     * Read through the cache. Returns the same terms as x_read().
+     */
+    ERL_NIF_TERM read(ErlNifEnv* env, rados_ioctx_t io, const char* oid, size_t len, uint64_t offset);
+    /*
+     * Drop all the entries of an object.
+     */
+    void invalidate(const char* oid);
+    void clear();
+    ERL_NIF_TERM stats(ErlNifEnv* env);
+
+private:
+    ~ReadCache();
+    ReadCache(const ReadCache&);
+    ReadCache& operator=(const ReadCache&);
+
+    struct Entry
+    {
+        string oid;
+        uint64_t offset;
+        size_t len;             // Length asked for, buf->size is what was read
+        uint64_t version;
+        read_buf_t * buf;
+        list<Entry*>::iterator lru_pos;
+    };
+    typedef multimap<string, Entry*> EntryMap;
+
+    read_buf_t* lookup(const char* oid, size_t len, uint64_t offset,
+                       uint64_t* version, size_t* buf_offset, size_t* buf_len);
+    void insert(const char* oid, size_t len, uint64_t offset,
+                read_buf_t* buf, uint64_t version, uint64_t gen);
+    void evict(EntryMap::iterator it);
+
+    XMutex mutex;
+    EntryMap entries;
+    list<Entry*> lru;
+    size_t max_bytes;
+    size_t bytes;
+    bool validate;
+    uint64_t generation;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    volatile int refs;
+};
+
+/*
+ * Cache of object metadata for an io context: the results of stat, the
+ * xattr values, and the lookups of objects or xattrs that do not exist.
+ *
+ * The entries expire after a time to live, which bounds how long the
+ * changes made by other clients go unnoticed. The changes made through
+ * the same io context invalidate the object right away.
+ */
+class MetaCache
+{
+public:
+    MetaCache(uint64_t ttl_ms, size_t max_entries);
+
+    void keep();
+    void release();
+
+    /*
+     * The generation must be taken before the OSD is queried, and given
+     * back when the result is stored, so that a result that raced with
+     * an invalidation is not stored.
+     */
+    uint64_t getGeneration();
+
+    /*
+     * Lookups return false on a miss. On a hit, err is 0 or the negative
+     * error code of the lookup cached.
+     */
+    bool getStat(const char* oid, int* err, uint64_t* size, time_t* mtime);
+    void putStat(const char* oid, int err, uint64_t size, time_t mtime, uint64_t gen);
+    bool getXattr(const char* oid, const char* name, int* err, string* value);
+    void putXattr(const char* oid, const char* name, int err,
+                  const char* value, size_t len, uint64_t gen);
+
+    void invalidate(const char* oid);
+    void clear();
+    ERL_NIF_TERM stats(ErlNifEnv* env);
+
+private:
+    ~MetaCache();
+    MetaCache(const MetaCache&);
+    MetaCache& operator=(const MetaCache&);
+
+    struct Xattr
+    {
+        int err;
+        string value;
+        uint64_t expires;
+    };
+
+    struct Entry
+    {
+        bool has_stat;
+        int stat_err;
+        uint64_t size;
+        time_t mtime;
+        uint64_t stat_expires;
+        map<string, Xattr> xattrs;
+        list<string>::iterator lru_pos;
+    };
+    typedef map<string, Entry> EntryMap;
+
+    Entry* touch(const char* oid);
+    void hit(int err);
+
+    XMutex mutex;
+    EntryMap entries;
+    list<string> lru;
+    uint64_t ttl_ms;
+    size_t max_entries;
+    uint64_t generation;
+    uint64_t hits;
+    uint64_t negative_hits;
+    uint64_t misses;
+    volatile int refs;
+};
+
+/*
+ * Drop the cached data and metadata of an object, after a change through
+ * io context id.
+ */
+void cache_invalidate(uint64_t id, const char* oid);
+/*
+ * Drop everything cached for io context id.
+ */
+void cache_clear(uint64_t id);
+
+/*
+ * Read an object range, sharing the read with the identical or larger
+ * reads of the same io context in flight. Concurrent readers of a hot
+ * object then cost a single read, and get binaries of the same buffer.
+ * Reads started before a change through the io context are not shared
+ * with the reads that follow it.
+ */
+ERL_NIF_TERM coalesced_read(ErlNifEnv* env, uint64_t id, rados_ioctx_t io,
+                            const char* oid, size_t len, uint64_t offset);
+bool coalesce_enabled(uint64_t id);
+void coalesce_invalidate(uint64_t id, const char* oid);
+void coalesce_clear(uint64_t id);
+/*
+ * Forget an io context, when it is destroyed.
+ */
+void coalesce_forget(uint64_t id);
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+
+#ifndef _RADOS_DISK_H_
+#define _RADOS_DISK_H_
+
+#include <map>
+#include <list>
+#include <string>
+
+#include "rados_nif.h"
+#include "rados_cache.h"
+
+using namespace std;
+
+#define DISK_MAGIC              0x52414432      // "RAD2"
+
+/*
+ * How the cached data is checked against the object before it is used.
+ */
+#define DISK_VALIDATE_NONE      0
+#define DISK_VALIDATE_VERSION   1
+#define DISK_VALIDATE_MTIME     2
+
+/*
+ * Header of a cache file, followed by the key and the data.
+ */
+struct disk_file_hdr_t
+{
+    uint32_t magic;
+    uint32_t key_len;
+    uint64_t version;
+    uint64_t mtime;             // In nanoseconds
+    uint64_t offset;
+    uint64_t len;               // Length asked for
+    uint64_t data_len;          // Length read
+};
+
+/*
+ * Read-through cache of object ranges in a local directory, meant for a
+ * local SSD. Each range is kept in its own file, and the index is rebuilt
+ * from the file headers when the cache is opened, so the cache survives
+ * restarts. The files are written in the background by the work pool,
+ * the read that missed does not wait for them.
+ */
+class DiskCache
+{
+public:
+    DiskCache(const char* dir, uint64_t max_bytes, int validate);
+
+    /*
+     * Create the directory if needed, and load the index. Returns 0 or a
+     * negative error code.
+     */
+    int open();
+    void keep();
+    void release();
+
+    ERL_NIF_TERM read(ErlNifEnv* env, rados_ioctx_t io, uint64_t snap,
+                      const char* oid, size_t len, uint64_t offset);
+    void invalidate(rados_ioctx_t io, uint64_t snap, const char* oid);
+    ERL_NIF_TERM stats(ErlNifEnv* env);
+
+    /*
+     * Write a range to its file and add it to the index. Called from the
+     * work pool.
+     */
+    void store(const string& key, read_buf_t* buf, uint64_t offset, size_t len,
+               uint64_t version, uint64_t mtime, uint64_t gen);
+
+    /*
+     * Count the writes queued on the work pool, for the statistics.
+     */
+    void storeQueued();
+    void storeDone();
+
+private:
+    ~DiskCache();
+    DiskCache(const DiskCache&);
+    DiskCache& operator=(const DiskCache&);
+
+    struct Entry
+    {
+        string key;
+        string file;
+        uint64_t offset;
+        size_t len;
+        size_t data_len;
+        uint64_t version;
+        uint64_t mtime;
+        list<Entry*>::iterator lru_pos;
+    };
+    typedef multimap<string, Entry*> EntryMap;
+
+    string fileName(const string& key, uint64_t offset, size_t len);
+    void loadFile(const char* name);
+    bool lookup(const string& key, size_t len, uint64_t offset, Entry* found);
+    void insert(Entry* e, list<string>& unlinks);
+    void remove(const string& key, const string& file);
+    void evict(EntryMap::iterator it, list<string>& unlinks);
+    int readFile(const Entry& e, uint64_t offset, size_t len, read_buf_t** buf);
+
+    string dir;
+    XMutex mutex;
+    EntryMap entries;
+    list<Entry*> lru;
+    uint64_t max_bytes;
+    uint64_t bytes;
+    int validate;
+    uint64_t generation;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stale;
+    uint64_t evictions;
+    uint64_t write_errors;
+    volatile uint64_t pending_stores;
+    volatile int refs;
+};
+
+/*
+ * The disk cache, or NULL if it is not open. The cache returned has been
+ * kept, the caller must release it.
+ */
+DiskCache* disk_cache_get();
+bool disk_cache_enabled(uint64_t id);
+void disk_cache_invalidate(uint64_t id, const char* oid);
+/*
+ * Forget an io context, when it is destroyed.
+ */
+void disk_cache_forget(uint64_t id);
+/*
+ * Close the cache, when the library is unloaded.
+ */
+void disk_cache_shutdown();
+
+#endif
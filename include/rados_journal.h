@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+
+#ifndef _RADOS_JOURNAL_H_
+#define _RADOS_JOURNAL_H_
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <pthread.h>
+
+#include "rados_nif.h"
+
+using namespace std;
+
+#define JOURNAL_MAGIC           0x5241444a      // "RADJ"
+#define JOURNAL_WRITE_FULL      1
+#define JOURNAL_WRITE           2
+
+#define JOURNAL_MAX_SNAPS       65536
+
+/*
+ * Header of a record of the journal file, followed by the object name,
+ * the snapshots of the write context and the data. The checksum covers
+ * the header, with a null checksum, the name, the snapshots and the data,
+ * so that a record torn by a crash is detected.
+ */
+struct journal_rec_hdr_t
+{
+    uint32_t magic;
+    uint32_t type;
+    uint64_t seq;
+    uint64_t offset;
+    uint32_t oid_len;
+    uint32_t num_snaps;
+    uint64_t data_len;
+    uint64_t snap_seq;
+    uint64_t checksum;
+};
+
+/*
+ * Write-back journal of an io context. The writes are acked once they are
+ * appended to a local file and synced, and are applied to RADOS by a
+ * flusher thread, in the order they were journaled. The sequence number
+ * of the last write applied is kept in a checkpoint file, and the writes
+ * after it are applied again when the journal is opened, e.g. after a
+ * crash. Only full and offset writes are journaled: applying them twice,
+ * in order, gives the same result.
+ *
+ * The reads and stats of an object with writes still in the journal are
+ * computed from the object and the writes. The other changes of such an
+ * object wait for its writes to be applied first.
+ *
+ * The writes are applied with the self-managed snapshot context the io
+ * context had when they were journaled.
+ *
+ * A write that fails with an error that can go away, e.g. while the pool
+ * is full or the OSDs recover, is retried until it is applied. A write
+ * that fails otherwise is dropped, and the owner of the journal is sent
+ * {rados_journal, IoCtx, {error, Oid, Reason}}.
+ */
+class WriteJournal
+{
+public:
+    WriteJournal(uint64_t io_id, const char* path, uint64_t max_lag, const ErlNifPid& owner);
+
+    /*
+     * Open the journal, and apply the writes left in it. Returns 0 or a
+     * negative error code.
+     */
+    int open(rados_ioctx_t io);
+    /*
+     * Wait until all the writes are applied, and stop the flusher.
+     */
+    void close();
+    void keep();
+    void release();
+
+    /*
+     * Journal a write. Waits a while if the writes not yet applied exceed
+     * the maximum lag, and gives up with -EAGAIN if they still do. A write
+     * larger than the OSDs take is refused with -E2BIG. The writes made at
+     * the same time are synced together. Returns 0 or a negative error
+     * code. Blocks: must be called from a dirty scheduler.
+     */
+    int append(int type, const char* oid, const char* data, size_t len, uint64_t offset);
+    /*
+     * Wait until the writes of an object, or all the writes, are applied,
+     * and checkpoint them so that they are not replayed over the changes
+     * that follow.
+     */
+    void drain(const char* oid);
+    void flush();
+
+    /*
+     * Read or stat an object with writes in the journal. Return false if
+     * the object has none, in which case the object itself is up to date.
+     */
+    bool read(ErlNifEnv* env, rados_ioctx_t io, const char* oid, size_t len, uint64_t offset,
+              ERL_NIF_TERM* ret);
+    bool stat(rados_ioctx_t io, const char* oid, int* err, uint64_t* size, time_t* mtime);
+    ERL_NIF_TERM stats(ErlNifEnv* env);
+
+private:
+    ~WriteJournal();
+    WriteJournal(const WriteJournal&);
+    WriteJournal& operator=(const WriteJournal&);
+
+    struct Record
+    {
+        uint64_t seq;
+        int type;
+        string oid;
+        uint64_t offset;
+        string data;
+        time_t time;
+        write_ctx_t ctx;
+    };
+
+    /*
+     * Writes appended to the journal file together, with a single sync.
+     * The first writer to find no batch being written writes the batch
+     * open, the others wait for it.
+     */
+    struct Batch
+    {
+        vector<Record*> records;
+        int waiters;
+        bool done;
+        int err;
+    };
+
+    /*
+     * Part of a write falling in the range read.
+     */
+    struct Piece
+    {
+        int type;
+        uint64_t end;           // End of the write in the object
+        uint64_t offset;        // Offset of the part in the object
+        string data;
+    };
+
+    int replay();
+    int writeBatch(Batch* b);
+    void writeCheckpoint(uint64_t seq);
+    void enqueue(Record* r);
+    bool snapshot(const char* oid, uint64_t offset, size_t len, vector<Piece>& pieces, time_t* mtime);
+    int apply(Record* r);
+    void notifyDropped(Record* r, int err);
+    void compact();
+    static void* threadMain(void* arg);
+    void run();
+
+    uint64_t io_id;
+    string path;
+    string ckpt_path;
+    uint64_t max_lag;
+    uint64_t max_record;        // Largest write the OSDs take
+    ErlNifPid owner;            // Told about the writes dropped
+    int fd;
+    int ckpt_fd;
+    rados_ioctx_t io;
+    write_ctx_t io_ctx;         // Write context set on io
+    pthread_t thread;
+    bool started;
+    bool stopping;
+
+    XMutex append_mutex;        // Guards the batches, taken before mutex
+    XCondition append_cond;
+    Batch* open_batch;          // Batch the appends join
+    bool committing;            // Whether a batch is being written
+    XMutex mutex;
+    XCondition cond;
+    deque<Record*> pending;
+    map<string, int> pending_oids;
+    uint64_t pending_bytes;
+    uint64_t next_seq;
+    uint64_t flushed_seq;
+    uint64_t journal_size;
+    XMutex ckpt_mutex;          // Orders the checkpoints, taken after mutex
+    uint64_t ckpt_seq;          // Last sequence number checkpointed
+
+    uint64_t appended;
+    uint64_t flushed;
+    uint64_t replayed;
+    uint64_t errors;
+    volatile int refs;
+};
+
+/*
+ * Whether an io context has a journal. The writes made with it are synced
+ * to the journal file, and its other changes of an object wait for the
+ * journaled writes of the object: the NIFs making them move to a dirty
+ * I/O scheduler.
+ */
+bool journal_enabled(uint64_t id);
+/*
+ * Wait for the journaled writes of an object, before changing it in a way
+ * that is not journaled.
+ */
+void journal_drain(uint64_t id, const char* oid);
+/*
+ * Close the journal of an io context, when it is destroyed.
+ */
+void journal_close_ioctx(uint64_t id);
+
+#endif
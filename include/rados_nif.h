@@ -8,19 +8,233 @@
 #define _RADOS_NIF_H_
 
 #include <map>
+#include <string>
+#include <vector>
+#include <regex.h>
 #include <rados/librados.h>
 #include <erl_nif.h>
 
 #include "log.hpp"
+#include "workpool.hpp"
 
 using namespace std;
 
 #define MAX_NAME_LEN       1024
 #define MAX_FILE_NAME_LEN  2048
 #define MAX_BUF_LEN        4096
+#define MAX_XATTR_LEN      (64 * 1024 * 1024)
+#define WORK_POOL_THREADS  8
+
+/*
+ * Monitor of the owner process of a job or a watch, which cancels the job
+ * or stops the watch when the process exits. The resource is held by what
+ * is monitored, and the monitor goes with it when it is released.
+ */
+#define OWNER_JOB       1
+#define OWNER_WATCH     2
+
+struct owner_monitor_t
+{
+    int kind;
+    uint64_t id;
+};
+
+extern ErlNifResourceType * owner_monitor_type_resource;
+void down_owner_monitor(ErlNifEnv* env, void* obj, ErlNifPid* pid, ErlNifMonitor* mon);
+/*
+ * Start monitoring a process. Returns the resource, to be released with
+ * enif_release_resource(), or NULL if the process is not alive.
+ */
+owner_monitor_t* owner_monitor_start(ErlNifEnv* env, const ErlNifPid* pid, int kind, uint64_t id);
+
+/*
+ * Base class of the jobs running in the background on the work pool.
+ * A job reports to an Erlang process with messages of the form
+ * {Tag, JobId, Payload}. A job can be split into several work items,
+ * so it is reference counted, and deleted when the last reference is
+ * released.
+ */
+class RadosJob
+{
+public:
+    RadosJob(const char* tag, const ErlNifPid& pid);
+    virtual ~RadosJob();
+
+    uint64_t getId() { return id; }
+    void keep();
+    void release();
+    virtual void cancel();
+    bool isCancelled();
+    /*
+     * Send {Tag, JobId, Payload} to the owner process. The payload must
+     * be built in msg_env, which is cleared afterwards. Returns false if
+     * the owner process is gone, in which case the job is cancelled.
+     */
+    bool send(ErlNifEnv* msg_env, ERL_NIF_TERM payload);
+    /*
+     * Cancel the job when the owner process exits, for the jobs that can
+     * wait on it without sending anything. Must be called from a NIF.
+     * Returns false, and cancels the job, if the owner is already gone.
+     */
+    bool monitor(ErlNifEnv* env);
+
+protected:
+    uint64_t id;
+    const char* tag;
+    ErlNifPid pid;
+    volatile int refs;
+    volatile int cancelled;
+    owner_monitor_t * owner_monitor;
+};
+
+extern XWorkPool* work_pool;
+
+/*
+ * Watch on an object. The notifications are acked at once, and are sent
+ * to the owner process, if any, as {rados_watch, WatchId, Payload}. The
+ * caches of the io context drop the object on every notification.
+ */
+class RadosWatch
+{
+public:
+    RadosWatch(uint64_t io_id, rados_ioctx_t io, const char* oid, const ErlNifPid* pid);
+    ~RadosWatch();
+
+    uint64_t getId() { return id; }
+    uint64_t getIoCtxId() { return io_id; }
+    int watch();
+    void unwatch();
+    /*
+     * Stop the watch when the owner process exits. Must be called from a
+     * NIF. Returns false if the owner is already gone.
+     */
+    bool monitor(ErlNifEnv* env, const ErlNifPid* owner);
+
+private:
+    RadosWatch(const RadosWatch&);
+    RadosWatch& operator=(const RadosWatch&);
+
+    static void notifyCallback(void* arg, uint64_t notify_id, uint64_t handle,
+                               uint64_t notifier_id, void* data, size_t data_len);
+    static void errorCallback(void* arg, uint64_t cookie, int err);
+    void send(ErlNifEnv* msg_env, ERL_NIF_TERM payload);
+
+    uint64_t id;
+    uint64_t io_id;
+    rados_ioctx_t io;
+    string oid;
+    bool has_pid;
+    ErlNifPid pid;
+    uint64_t cookie;
+    owner_monitor_t * owner_monitor;
+};
+
+class ReadCache;
+class MetaCache;
+class WriteJournal;
+
+/*
+ * Filter on object names, evaluated natively during listings so that
+ * no term is built for the names that are filtered out. The filter is
+ * given as a list of options, all of which must match:
+ *
+ *   {prefix, Prefix}, {suffix, Suffix}, {glob, Pattern}, {regex, Regex}
+ *
+ * The glob follows fnmatch(3), the regex is a POSIX extended regex.
+ */
+class ObjectFilter
+{
+public:
+    ObjectFilter();
+    ~ObjectFilter();
+
+    /*
+     * Reference counting, for the filters of list contexts, which are
+     * used by NIF calls while objects_list_close() can remove them.
+     */
+    void keep();
+    void release();
+
+    /*
+     * Parse the filter options. Returns 0 if an option is invalid.
+     */
+    int parse(ErlNifEnv* env, ERL_NIF_TERM opts);
+    bool isActive();
+    bool match(const char* name, size_t len);
+
+private:
+    ObjectFilter(const ObjectFilter&);
+    ObjectFilter& operator=(const ObjectFilter&);
+
+    volatile int refs;
+    bool active;
+    string prefix;
+    string suffix;
+    string glob;
+    bool has_regex;
+    regex_t regex;
+};
 
 extern XLog logger;
 
+/*
+ * The librados handles, kept in the priv_data of the library, so that a
+ * code upgrade hands them over to the new version instead of reconnecting.
+ * Only plain handles are shared: the caches, journals, watches and jobs
+ * have their code in the library, and are closed when it is unloaded. The
+ * layout must not change without bumping RADOS_PRIV_VERSION, as the old
+ * and the new version of the library use it at the same time.
+ */
+#define RADOS_PRIV_VERSION      1
+
+/*
+ * Self-managed snapshot context the writes of an io context are made with.
+ */
+struct write_ctx_t
+{
+    uint64_t seq;
+    vector<uint64_t> snaps;
+
+    write_ctx_t() : seq(0) {}
+    bool operator==(const write_ctx_t& other) const
+    {
+        return seq == other.seq && snaps == other.snaps;
+    }
+    bool operator!=(const write_ctx_t& other) const
+    {
+        return !(*this == other);
+    }
+};
+
+struct rados_priv_t
+{
+    int version;
+    volatile int users;             // Versions of the library using it
+    volatile int journals;          // Write-back journals open
+
+    XMutex id_mutex;
+    uint64_t id_index;
+
+    XMutex cluster_mutex;
+    map<uint64_t, rados_t> clusters;
+    XMutex ioctx_mutex;
+    map<uint64_t, rados_ioctx_t> ioctxs;
+    XMutex list_ctx_mutex;
+    map<uint64_t, rados_list_ctx_t> list_ctxs;
+    XMutex xattr_iter_mutex;
+    map<uint64_t, rados_xattrs_iter_t> xattr_iters;
+    map<uint64_t, uint64_t> xattr_iter_ioctxs;     // Io context of each iterator
+    // Snapshots read by the io contexts not reading the head. librados
+    // does not tell which snapshot an io context reads, and the caches
+    // need it.
+    XMutex read_snap_mutex;
+    map<uint64_t, uint64_t> read_snaps;
+    // Write contexts set on the io contexts, to be set again on the io
+    // contexts that apply their writes later, e.g. the one of a journal.
+    XMutex write_ctx_mutex;
+    map<uint64_t, write_ctx_t> write_ctxs;
+};
+
 uint64_t new_id();
 
 void map_cluster_add(uint64_t id, rados_t cluster);
@@ -35,16 +249,68 @@ void map_list_ctx_add(uint64_t id, rados_list_ctx_t ctx);
 rados_list_ctx_t map_list_ctx_get(uint64_t id);
 rados_list_ctx_t map_list_ctx_remove(uint64_t id);
 
-void map_xattr_iter_add(uint64_t id, rados_xattrs_iter_t it);
+void map_list_filter_add(uint64_t id, ObjectFilter* filter);
+ObjectFilter* map_list_filter_get(uint64_t id);
+ObjectFilter* map_list_filter_remove(uint64_t id);
+
+void map_xattr_iter_add(uint64_t id, rados_xattrs_iter_t it, uint64_t io_id);
 rados_xattrs_iter_t map_xattr_iter_get(uint64_t id);
 rados_xattrs_iter_t map_xattr_iter_remove(uint64_t id);
+void map_xattr_iter_remove_ioctx(uint64_t io_id, vector<rados_xattrs_iter_t>& iters);
+
+void map_job_add(uint64_t id, RadosJob* job);
+RadosJob* map_job_get(uint64_t id);
+RadosJob* map_job_remove(uint64_t id);
+
+ReadCache* map_read_cache_add(uint64_t id, ReadCache* cache);
+ReadCache* map_read_cache_get(uint64_t id);
+ReadCache* map_read_cache_remove(uint64_t id);
+
+MetaCache* map_meta_cache_add(uint64_t id, MetaCache* cache);
+MetaCache* map_meta_cache_get(uint64_t id);
+MetaCache* map_meta_cache_remove(uint64_t id);
+
+void map_journal_add(uint64_t id, WriteJournal* journal);
+WriteJournal* map_journal_get(uint64_t id);
+WriteJournal* map_journal_remove(uint64_t id);
+
+void map_read_snap_set(uint64_t id, uint64_t snap);
+uint64_t map_read_snap_get(uint64_t id);
+void map_read_snap_remove(uint64_t id);
+
+void map_write_ctx_set(uint64_t id, const write_ctx_t& ctx);
+bool map_write_ctx_get(uint64_t id, write_ctx_t* ctx);
+void map_write_ctx_remove(uint64_t id);
+
+void map_watch_add(uint64_t id, RadosWatch* w);
+RadosWatch* map_watch_remove(uint64_t id);
+void map_watch_remove_ioctx(uint64_t io_id, vector<RadosWatch*>& watches);
+
+void watch_close_ioctx(uint64_t io_id);
+void watch_owner_down(uint64_t id);
+
+/*
+ * Wait for the background connections, when the library is unloaded.
+ */
+void connect_shutdown();
+
+int ioctx_dup(rados_ioctx_t io, rados_ioctx_t* out);
+int ioctx_set_write_ctx(rados_ioctx_t io, const write_ctx_t& ctx);
+int read_versioned(rados_ioctx_t io, const char* oid, char* buf, size_t len,
+                   uint64_t offset, uint64_t* version);
 
 ERL_NIF_TERM make_error_tuple(ErlNifEnv* env, int err);
+int get_opt(ErlNifEnv* env, ERL_NIF_TERM opts, const char* name, ERL_NIF_TERM* value);
+int get_name_arg(ErlNifEnv* env, ERL_NIF_TERM term, char* buf, unsigned len);
 
 ERL_NIF_TERM x_add_stderr_log_handler(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_add_sys_log_handler(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_add_file_log_handler(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_add_rolling_file_log_handler(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_set_log_level(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_log_async_enable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_log_async_disable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_log_dropped(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 
 ERL_NIF_TERM x_create(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_create_with_user(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
@@ -53,6 +319,7 @@ ERL_NIF_TERM x_conf_read_file2(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
 ERL_NIF_TERM x_conf_set(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 // x_conf_get()
 ERL_NIF_TERM x_connect(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_connect_async(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_shutdown(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_get_instance_id(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_pool_list(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
@@ -75,11 +342,17 @@ ERL_NIF_TERM x_ioctx_get_pool_name(ErlNifEnv* env, int argc, const ERL_NIF_TERM
 ERL_NIF_TERM x_ioctx_snap_create(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_ioctx_snap_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_rollback(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_rollback_many(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_ioctx_snap_list(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_ioctx_snap_list_full(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_ioctx_snap_lookup(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_ioctx_snap_get_name(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_ioctx_snap_get_stamp(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-// x_ioctx_snap_set_read()
+ERL_NIF_TERM x_ioctx_snap_set_read(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_ioctx_selfmanaged_snap_create(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_ioctx_selfmanaged_snap_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_ioctx_selfmanaged_snap_rollback(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_ioctx_selfmanaged_snap_set_write_ctx(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 // x_get_last_version
 ERL_NIF_TERM x_write(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_write_full(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
@@ -92,7 +365,11 @@ ERL_NIF_TERM x_trunc(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 // x_ioctx_pool_get_auid()
 // x_ioctx_locator_set_key()
 ERL_NIF_TERM x_objects_list_open(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_objects_list_open2(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_objects_list_next(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_objects_list_next_batch(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_objects_list_position(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_objects_list_seek(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_objects_list_close(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 
 ERL_NIF_TERM x_getxattr(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
@@ -101,9 +378,57 @@ ERL_NIF_TERM x_rmxattr(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_getxattrs(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_getxattrs_next(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM x_getxattrs_end(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_getxattrs_map(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_getxattr_many(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_setxattr_many(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+ERL_NIF_TERM x_omap_set(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_omap_rm_keys(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_omap_get_vals(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_omap_get_keys(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_omap_get_vals_by_keys(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 
 ERL_NIF_TERM x_stat(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 
+ERL_NIF_TERM x_pool_scan(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_pool_changes(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_job_cancel(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_objects_list_stream(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_objects_list_stream_ack(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+ERL_NIF_TERM x_cache_enable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_cache_disable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_cache_stats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_meta_cache_enable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_meta_cache_disable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_meta_cache_stats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+ERL_NIF_TERM x_watch(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_cache_watch(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_unwatch(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_notify(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+ERL_NIF_TERM x_shm_cache_open(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_shm_cache_close(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_shm_cache_enable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_shm_cache_disable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_shm_cache_stats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+ERL_NIF_TERM x_disk_cache_open(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_disk_cache_close(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_disk_cache_enable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_disk_cache_disable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_disk_cache_stats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+ERL_NIF_TERM x_journal_enable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_journal_disable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_journal_flush(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_journal_stats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+ERL_NIF_TERM x_coalesce_enable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_coalesce_disable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM x_coalesce_stats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
 ERL_NIF_TERM x_aio_flush(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 
 #endif
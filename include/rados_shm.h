@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+
+#ifndef _RADOS_SHM_H_
+#define _RADOS_SHM_H_
+
+#include <string>
+
+#include "rados_nif.h"
+
+using namespace std;
+
+#define SHM_MAGIC          0x52414453      // "RADS"
+#define SHM_VERSION        3
+#define SHM_CLASSES        5
+#define SHM_KEY_LEN        224
+#define SHM_PROBE_LEN      16
+#define SHM_NO_SLOT        0xffffffff
+
+/*
+ * Layout of the shared memory segment. The segment is mapped at a
+ * different address in each process, so it only holds offsets and
+ * indexes, never pointers. All the fields are accessed with atomic
+ * operations or under the seqlock of a slot.
+ *
+ *   header | slots[nslots] | chunks of class 0 | ... | chunks of class 4
+ */
+struct shm_class_t
+{
+    uint32_t chunk_size;        // Size of the data of a chunk
+    uint32_t nchunks;
+    uint64_t offset;            // Offset of the first chunk in the segment
+    volatile uint32_t clock;    // Hand of the clock sweeping the chunks
+    uint32_t pad;
+};
+
+struct shm_header_t
+{
+    uint32_t magic;
+    uint32_t version;
+    volatile uint32_t ready;    // Set once the creator has laid out the segment
+    uint32_t nslots;
+    uint64_t size;
+    shm_class_t classes[SHM_CLASSES];
+    volatile uint64_t hits;     // Host-wide statistics
+    volatile uint64_t misses;
+    volatile uint64_t evictions;
+};
+
+/*
+ * Entry of the index. The index is an open-addressing hash table on the
+ * object, so that all the cached ranges of an object are within the
+ * SHM_PROBE_LEN slots following its bucket. A slot is protected by a
+ * seqlock: odd while it is being written, readers retry if it changed
+ * while they were reading it. The invalidation count of the first slot
+ * of a bucket is bumped whenever an object of the bucket is invalidated,
+ * so that a fill started before is not indexed.
+ */
+struct shm_slot_t
+{
+    volatile uint32_t seq;
+    uint32_t chunk;             // Chunk id + 1, 0 if the slot is empty
+    uint32_t gen;               // Generation of the chunk when it was indexed
+    uint32_t key_len;
+    volatile uint32_t inval;    // Invalidations of the bucket starting here
+    uint32_t pad;
+    uint64_t offset;
+    uint64_t len;               // Length asked for, the chunk has what was read
+    char key[SHM_KEY_LEN];      // Cluster fsid, pool id, snap and object name
+};
+
+/*
+ * Header of a chunk of data. The reference count is -1 while the chunk is
+ * being filled or evicted by a process, otherwise it counts the binaries
+ * pointing to it. Only a chunk with no reference can be evicted.
+ */
+struct shm_chunk_t
+{
+    volatile int32_t refs;
+    volatile uint32_t gen;      // Bumped every time the chunk is reused
+    uint32_t slot;              // Slot indexing the chunk, or SHM_NO_SLOT
+    uint32_t len;               // Number of bytes of data
+    uint64_t version;           // Object version the data was read at
+    uint64_t pad[5];
+    char data[0];
+};
+
+/*
+ * Object cache in a POSIX shared memory segment, shared by all the
+ * instances of the library on the host. The data is served as resource
+ * binaries mapped onto the segment, without copy.
+ *
+ * A process that dies while holding chunks leaks them until the segment
+ * is removed, which only reduces the capacity of the cache.
+ */
+class ShmCache
+{
+public:
+    ShmCache();
+
+    /*
+     * Open the segment, creating it with the given size if it does not
+     * exist. Returns 0 or a negative error code.
+     */
+    int open(const char* name, uint64_t size, bool validate);
+    void keep();
+    void release();
+
+    ERL_NIF_TERM read(ErlNifEnv* env, rados_ioctx_t io, uint64_t snap,
+                      const char* oid, size_t len, uint64_t offset);
+    void invalidate(rados_ioctx_t io, uint64_t snap, const char* oid);
+    ERL_NIF_TERM stats(ErlNifEnv* env);
+
+    /*
+     * Drop a reference on a chunk, taken by a binary.
+     */
+    static void unpin(shm_chunk_t* chunk);
+
+private:
+    ~ShmCache();
+    ShmCache(const ShmCache&);
+    ShmCache& operator=(const ShmCache&);
+
+    void layout(uint64_t size);
+    shm_slot_t* slot(uint32_t i);
+    shm_chunk_t* chunk(uint32_t id);
+    uint32_t bucket(const char* key, size_t key_len);
+    bool lockSlot(shm_slot_t* s);
+    void unlockSlot(shm_slot_t* s);
+    shm_chunk_t* lookup(const char* key, size_t key_len, size_t len, uint64_t offset,
+                        size_t* buf_offset, size_t* buf_len);
+    shm_chunk_t* claim(size_t len, uint32_t* id);
+    void publish(const char* key, size_t key_len, size_t len, uint64_t offset,
+                 shm_chunk_t* c, uint32_t id, uint32_t inval);
+    void drop(shm_chunk_t* c, uint32_t gen);
+    ERL_NIF_TERM makeBinary(ErlNifEnv* env, shm_chunk_t* c, size_t offset, size_t len);
+
+    char * base;
+    shm_header_t * header;
+    uint64_t size;
+    bool validate;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t bypassed;
+    volatile int refs;
+};
+
+extern ErlNifResourceType * shm_ref_type_resource;
+void dtor_shm_ref_type(ErlNifEnv* env, void* obj);
+
+/*
+ * The host cache, or NULL if it is not open. The cache returned has been
+ * kept, the caller must release it.
+ */
+ShmCache* shm_cache_get();
+bool shm_cache_enabled(uint64_t id);
+void shm_cache_invalidate(uint64_t id, const char* oid);
+/*
+ * Forget an io context, when it is destroyed.
+ */
+void shm_cache_forget(uint64_t id);
+/*
+ * Close the cache, when the library is unloaded.
+ */
+void shm_cache_shutdown();
+
+#endif
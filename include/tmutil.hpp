@@ -21,11 +21,31 @@ struct XTime {
     int millisecond;
 };
 
+/**
+ * Size of the buffer of TMUtil::formatTime().
+ */
+#define XTIME_STR_LEN       32
+
 /**
  * Time-related utilities
  */
 class TMUtil
 {
 public:
+    /**
+     * Get the local time. It can be called from any thread without lock.
+     * On Linux, the clock is the coarse one, which only has the precision
+     * of the scheduler tick, but costs no system call, and the conversion
+     * to local time is only done once per second and thread.
+     */
     static void getCurrentTime(struct XTime& currTime);
+
+    /**
+     * Format a time as "YYYY-MM-DD HH:MM:SS.mmm". The part up to the
+     * second is cached per thread, so that only the milliseconds are
+     * formatted in most calls.
+     *
+     * @param buf    Buffer of XTIME_STR_LEN bytes.
+     */
+    static void formatTime(const struct XTime& tm, char* buf);
 };
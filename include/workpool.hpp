@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <erl_nif.h>
+
+#include "mutex.hpp"
+
+using namespace std;
+
+/**
+ * A unit of work to be run by the work pool.
+ *
+ * Long-running work should be cut into slices: run() does one slice and
+ * returns AGAIN, so that the item goes back to the end of the queue and
+ * other items get their turn. An item that has to wait for something
+ * returns WAIT, and whoever it is waiting for submits it again later.
+ */
+class XWorkItem
+{
+public:
+    enum Status {
+        DONE,       /**< Finished, the pool releases the item. */
+        AGAIN,      /**< Not finished, queue the item again. */
+        WAIT        /**< Not finished, the item will be submitted again by its owner. */
+    };
+
+    virtual ~XWorkItem() {};
+
+    /**
+     * Run one slice of work.
+     */
+    virtual Status run() = 0;
+    /**
+     * Called instead of run() for items still queued when the pool stops.
+     */
+    virtual void abort() {};
+    /**
+     * Called by the pool once it is done with the item.
+     */
+    virtual void release() { delete this; };
+};
+
+/**
+ * A pool of worker threads running XWorkItem's. Threads are started on
+ * demand, up to the maximum number given to the constructor. They are
+ * created by the emulator, so that it knows about them.
+ */
+class XWorkPool
+{
+public:
+    XWorkPool(int max_threads);
+    ~XWorkPool();
+
+    /**
+     * Queue a work item. The pool takes ownership of the item until
+     * run() returns DONE or WAIT.
+     */
+    void submit(XWorkItem* item);
+    /**
+     * Stop the pool. Items being run are allowed to finish their
+     * current slice, queued items are aborted and released. All the
+     * worker threads are joined.
+     */
+    void stop();
+    /**
+     * Number of items waiting in the queue.
+     */
+    int pending();
+
+private:
+    static void* threadMain(void* arg);
+    void work();
+
+    XMutex mutex;
+    XCondition cond;
+    deque<XWorkItem*> queue;
+    vector<ErlNifTid> threads;
+    int max_threads;
+    int idle_threads;
+    bool stopping;
+};
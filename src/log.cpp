@@ -4,6 +4,10 @@
  */
 
 #include <algorithm>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #if __linux
 #include <syslog.h>
@@ -15,16 +19,100 @@
 #include "tmutil.hpp"
 #include "log.hpp"
 
+/********************************************************************************
+ * XLogQueue
+ ********************************************************************************/
+
+XLogQueue::XLogQueue(size_t capacity) :
+    enqueue_pos(0),
+    dequeue_pos(0)
+{
+    size_t size = 2;
+    while (size < capacity)
+        size <<= 1;
+    mask = size - 1;
+    cells = new Cell[size];
+    for (size_t i = 0; i < size; i++)
+        cells[i].seq = i;
+}
+
+XLogQueue::~XLogQueue()
+{
+    delete [] cells;
+}
+
+XLogRecord* XLogQueue::reserve(size_t* pos)
+{
+    size_t p = enqueue_pos;
+    while (true) {
+        Cell * cell = &cells[p & mask];
+        size_t seq = cell->seq;
+        long diff = (long)seq - (long)p;
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&enqueue_pos, p, p + 1)) {
+                *pos = p;
+                return &cell->rec;
+            }
+            p = enqueue_pos;
+        }
+        else if (diff < 0) {
+            // The consumer has not released the cell yet: full
+            return NULL;
+        }
+        else {
+            p = enqueue_pos;
+        }
+    }
+}
+
+void XLogQueue::commit(size_t pos)
+{
+    __sync_synchronize();
+    cells[pos & mask].seq = pos + 1;
+}
+
+XLogRecord* XLogQueue::front()
+{
+    Cell * cell = &cells[dequeue_pos & mask];
+    if (cell->seq != dequeue_pos + 1)
+        return NULL;
+    __sync_synchronize();
+    return &cell->rec;
+}
+
+void XLogQueue::pop()
+{
+    Cell * cell = &cells[dequeue_pos & mask];
+    __sync_synchronize();
+    cell->seq = dequeue_pos + mask + 1;
+    dequeue_pos++;
+}
+
 /********************************************************************************
  * XLog
  ********************************************************************************/
 
-XLog::XLog()
+#define XLOG_BATCH          256
+#define XLOG_IDLE_MSEC      100
+
+XLog::XLog() :
+    queue(NULL),
+    producers(0),
+    block_when_full(false),
+    dropped(0),
+    writer_stop(false),
+    writer_idle(0)
 {
     curr_level = NONE;
 }
 
-XLog::XLog(const string& name)
+XLog::XLog(const string& name) :
+    queue(NULL),
+    producers(0),
+    block_when_full(false),
+    dropped(0),
+    writer_stop(false),
+    writer_idle(0)
 {
     curr_level = NONE;
     logger_name = name;
@@ -32,24 +120,30 @@ XLog::XLog(const string& name)
 
 void XLog::setLevel(LogLevel level)
 {
+    handlers_mutex.lock();
     curr_level = level;
     set<XLogHandler*>::iterator it = log_handlers.begin();
     while (it != log_handlers.end()) {
         (*it)->setLevel(level);
         it++;
     }
+    handlers_mutex.unlock();
 }
 
 void XLog::addHandler(XLogHandler& handler)
 {
+    handlers_mutex.lock();
     log_handlers.insert(&handler);
+    handlers_mutex.unlock();
 }
 
 void XLog::removeHandler(XLogHandler* const handler)
 {
+    handlers_mutex.lock();
     set<XLogHandler*>::iterator it = log_handlers.find(handler);
     if (it != log_handlers.end())
         log_handlers.erase(it);
+    handlers_mutex.unlock();
 }
 
 void XLog::fatal(const char* origin, const char* func, const char* format, ...)
@@ -104,6 +198,18 @@ void XLog::debug(const char* origin, const char* func, const char* format, ...)
 
 void XLog::log(const char* origin, const char* func, LogLevel level, const char* format, va_list& arglist)
 {
+    if (queue != NULL) {
+        // The writer is only stopped once no thread uses the queue
+        __sync_add_and_fetch(&producers, 1);
+        XLogQueue * q = queue;
+        if (q != NULL) {
+            enqueue(q, origin, func, level, format, arglist);
+            __sync_sub_and_fetch(&producers, 1);
+            return;
+        }
+        __sync_sub_and_fetch(&producers, 1);
+    }
+
     set<XLogHandler*>::iterator it = log_handlers.begin();
     while (it != log_handlers.end()) {
         XLogHandler * handler = *it;
@@ -118,14 +224,175 @@ void XLog::log(const char* origin, const char* func, LogLevel level, const char*
     }
 }
 
+void XLog::stopHandlers()
+{
+    handlers_mutex.lock();
+    set<XLogHandler*>::iterator it = log_handlers.begin();
+    while (it != log_handlers.end()) {
+        (*it)->stop();
+        it++;
+    }
+    handlers_mutex.unlock();
+}
+
 void XLog::flush()
 {
+    // The writer flushes the handlers once it has drained the queue
+    if (queue != NULL) {
+        writer_mutex.lock();
+        writer_cond.signal();
+        writer_mutex.unlock();
+        return;
+    }
+
+    handlers_mutex.lock();
     set<XLogHandler*>::iterator it = log_handlers.begin();
     while (it != log_handlers.end()) {
         XLogHandler * handler = *it;
         (*handler).flush();
         it++;
     }
+    handlers_mutex.unlock();
+}
+
+void XLog::enqueue(XLogQueue* q, const char* origin, const char* func, LogLevel level,
+                   const char* format, va_list& arglist)
+{
+    size_t pos;
+    XLogRecord * rec = q->reserve(&pos);
+    while (rec == NULL) {
+        if (!block_when_full) {
+            __sync_add_and_fetch(&dropped, 1);
+            return;
+        }
+        sched_yield();
+        rec = q->reserve(&pos);
+    }
+
+    TMUtil::getCurrentTime(rec->time);
+    rec->level = level;
+    rec->origin = origin;
+    rec->func = func;
+    vsnprintf(rec->msg, XLOG_MSG_LEN, format, arglist);
+    q->commit(pos);
+
+    if (writer_idle) {
+        writer_mutex.lock();
+        writer_cond.signal();
+        writer_mutex.unlock();
+    }
+}
+
+int XLog::startAsync(size_t capacity, bool block)
+{
+    async_mutex.lock();
+    stopWriter();
+
+    block_when_full = block;
+    writer_stop = false;
+    XLogQueue * q = new XLogQueue(capacity);
+    queue = q;
+    int err = pthread_create(&writer_thread, NULL, writerMain, this);
+    if (err != 0) {
+        queue = NULL;
+        while (producers > 0)
+            sched_yield();
+        delete q;
+    }
+    async_mutex.unlock();
+    return err;
+}
+
+void XLog::stopAsync()
+{
+    async_mutex.lock();
+    stopWriter();
+    async_mutex.unlock();
+}
+
+void XLog::stopWriter()
+{
+    XLogQueue * q = queue;
+    if (q == NULL)
+        return;
+
+    // New entries are logged synchronously from now on. Wait for those
+    // being queued.
+    queue = NULL;
+    __sync_synchronize();
+    while (producers > 0)
+        sched_yield();
+
+    writer_mutex.lock();
+    writer_stop = true;
+    writer_cond.signal();
+    writer_mutex.unlock();
+    pthread_join(writer_thread, NULL);
+
+    // The writer drains the queue before it stops.
+    delete q;
+}
+
+uint64_t XLog::getDropped()
+{
+    return dropped;
+}
+
+void* XLog::writerMain(void* arg)
+{
+    ((XLog *)arg)->writer();
+    return NULL;
+}
+
+void XLog::writeBatch(XLogQueue* q)
+{
+    handlers_mutex.lock();
+    for (int i = 0; i < XLOG_BATCH; i++) {
+        XLogRecord * rec = q->front();
+        if (rec == NULL)
+            break;
+        set<XLogHandler*>::iterator it = log_handlers.begin();
+        while (it != log_handlers.end()) {
+            (*it)->write(rec->time, rec->origin, rec->func, rec->level, rec->msg);
+            it++;
+        }
+        q->pop();
+    }
+    handlers_mutex.unlock();
+}
+
+void XLog::writer()
+{
+    // stopAsync() clears the queue pointer before stopping the writer,
+    // so keep our own.
+    XLogQueue * q = queue;
+    while (true) {
+        if (q->front() != NULL) {
+            writeBatch(q);
+            continue;
+        }
+
+        // The queue is empty: flush the handlers, then wait for more
+        handlers_mutex.lock();
+        set<XLogHandler*>::iterator it = log_handlers.begin();
+        while (it != log_handlers.end()) {
+            (*it)->flush();
+            it++;
+        }
+        handlers_mutex.unlock();
+
+        writer_mutex.lock();
+        if (writer_stop && q->front() == NULL) {
+            writer_mutex.unlock();
+            break;
+        }
+        writer_idle = 1;
+        __sync_synchronize();
+        if (q->front() == NULL && !writer_stop)
+            writer_cond.timedWait(writer_mutex, XLOG_IDLE_MSEC);
+        writer_idle = 0;
+        writer_mutex.unlock();
+    }
 }
 
 /********************************************************************************
@@ -211,6 +478,24 @@ void XLogHandler::setLevel(LogLevel l)
     level = l;
 }
 
+void XLogHandler::stop()
+{
+}
+
+static void log_message(XLogHandler* handler, const char* origin, const char* func, LogLevel level,
+                        const char* format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    handler->log(origin, func, level, format, ap);
+    va_end(ap);
+}
+
+void XLogHandler::write(const XTime& tm, const char* origin, const char* func, LogLevel level, const char* msg)
+{
+    log_message(this, origin, func, level, "%s", msg);
+}
+
 /********************************************************************************
  * XLogStderrHandler
  ********************************************************************************/
@@ -229,13 +514,28 @@ void XLogStderrHandler::flush()
     fflush(stderr);
 }
 
-void XLogStderrHandler::log(const char* origin, const char* func, LogLevel level, const char* format, va_list& arglist)
+void XLogStderrHandler::write(const XTime& tm, const char* origin, const char* func, LogLevel level, const char* msg)
 {
+    char stamp[XTIME_STR_LEN];
+    TMUtil::formatTime(tm, stamp);
     mutex.lock();
+    fprintf(stderr, "%s ", stamp);
+    fprintf(stderr, "%-8s ", getLevelStr(level));
+    if (origin != NULL) {
+        fprintf(stderr, "[%s %s] ", origin, func);
+    }
+    fprintf(stderr, "%s\n", msg);
+    mutex.unlock();
+}
+
+void XLogStderrHandler::log(const char* origin, const char* func, LogLevel level, const char* format, va_list& arglist)
+{
     XTime tm;
+    char stamp[XTIME_STR_LEN];
     TMUtil::getCurrentTime(tm);
-    fprintf(stderr, "%d-%02d-%02d %02d:%02d:%02d.%03d ", 
-            tm.year, tm.month, tm.day, tm.hour, tm.min, tm.second, tm.millisecond);
+    TMUtil::formatTime(tm, stamp);
+    mutex.lock();
+    fprintf(stderr, "%s ", stamp);
     fprintf(stderr, "%-8s ", getLevelStr(level));
     if (origin != NULL) {
         fprintf(stderr, "[%s %s] ", origin, func);
@@ -255,6 +555,7 @@ vector<string> XLogFileHandlerBase::log_files;
 XLogFileHandlerBase::XLogFileHandlerBase(const char* filename) :
     XLogHandler(),
     log_file_size(0),
+    log_file_time(0),
     log_file(NULL)
 {
     vector<string>::iterator it = find(log_files.begin(), 
@@ -288,42 +589,73 @@ XLogFileHandlerBase::~XLogFileHandlerBase()
 
 void XLogFileHandlerBase::flush()
 {
+    // A rotation may close the file meanwhile
+    mutex.lock();
     if (log_file)
         fflush(log_file);
+    mutex.unlock();
 }
 
 void XLogFileHandlerBase::log(const char* origin, const char* func, LogLevel level, const char* format, va_list& arglist)
 {
+    XTime tm;
+    char stamp[XTIME_STR_LEN];
+    TMUtil::getCurrentTime(tm);
+    TMUtil::formatTime(tm, stamp);
+
+    mutex.lock();
+    if (!log_file)
+        openLogFile();
+
+    if (log_file) {
+        long len = fprintf(log_file, "%s %-8s ", stamp, getLevelStr(level));
+        if (origin != NULL) {
+            len += fprintf(log_file, "[%s %s] ", origin, func);
+        }
+        len += vfprintf(log_file, format, arglist);
+        len += fprintf(log_file, "\n");
+        log_file_size += len;
+    }
+    mutex.unlock();
+}
+
+void XLogFileHandlerBase::write(const XTime& tm, const char* origin, const char* func, LogLevel level, const char* msg)
+{
+    char stamp[XTIME_STR_LEN];
+    TMUtil::formatTime(tm, stamp);
+
+    mutex.lock();
     if (!log_file)
         openLogFile();
 
     if (log_file) {
-        mutex.lock();
-        XTime tm;
-        TMUtil::getCurrentTime(tm);
-        fprintf(log_file, "%d-%02d-%02d %02d:%02d:%02d.%03d ", 
-                tm.year, tm.month, tm.day, tm.hour, tm.min, tm.second, tm.millisecond);
-        fprintf(log_file, "%-8s ", getLevelStr(level));
+        long len = fprintf(log_file, "%s %-8s ", stamp, getLevelStr(level));
         if (origin != NULL) {
-            fprintf(log_file, "[%s %s] ", origin, func);
+            len += fprintf(log_file, "[%s %s] ", origin, func);
         }
-        vfprintf(log_file, format, arglist);
-        fprintf(log_file, "\n");
-        mutex.unlock();
+        len += fprintf(log_file, "%s\n", msg);
+        log_file_size += len;
     }
+    mutex.unlock();
 }
 
 void XLogFileHandlerBase::openLogFile()
 {
     if (!log_file) {
-        log_file = fopen(log_filename.c_str(), "w");
+        // Append, so that the entries of the previous runs are kept
+        log_file = fopen(log_filename.c_str(), "a");
+        if (log_file) {
+            fseek(log_file, 0, SEEK_END);
+            log_file_size = ftell(log_file);
+            log_file_time = time(NULL);
+        }
     }
 }
 
 void XLogFileHandlerBase::openLogFile(const char* filename)
 {
     if (log_file) {
-        flush();
+        fflush(log_file);
         fclose(log_file);
         log_file = NULL;
     }
@@ -349,6 +681,213 @@ XLogFileHandler::~XLogFileHandler()
  * XLogRollingFileHandler
  ********************************************************************************/
 
+#define XLOG_GZIP_CHUNK     65536
+
+/*
+ * Compress a file with gzip. Returns 0, or -1 on failure, in which case
+ * the destination file is removed.
+ */
+static int gzip_file(const char* src, const char* dest)
+{
+    FILE * in = fopen(src, "r");
+    if (in == NULL)
+        return -1;
+    gzFile out = gzopen(dest, "wb");
+    if (out == NULL) {
+        fclose(in);
+        return -1;
+    }
+
+    int err = 0;
+    vector<char> buf(XLOG_GZIP_CHUNK);
+    size_t len;
+    while ((len = fread(&buf[0], 1, buf.size(), in)) > 0) {
+        if (gzwrite(out, &buf[0], len) != (int)len) {
+            err = -1;
+            break;
+        }
+    }
+    if (ferror(in))
+        err = -1;
+    fclose(in);
+    if (gzclose(out) != Z_OK)
+        err = -1;
+    if (err < 0)
+        unlink(dest);
+    return err;
+}
+
+XLogRollingFileHandler::XLogRollingFileHandler(const char* filename, long max_size, int max_age,
+                                               int num_files, bool compress) :
+    XLogFileHandlerBase(filename),
+    max_file_size(max_size),
+    max_file_age(max_age),
+    num_files(num_files),
+    compress(compress),
+    rotating(0),
+    rotations(0),
+    archiver_started(false),
+    archiver_stop(false)
+{
+}
+
+XLogRollingFileHandler::~XLogRollingFileHandler()
+{
+    stop();
+}
+
+void XLogRollingFileHandler::stop()
+{
+    // The archiver finishes with the files rotated before it stops. The
+    // files rotated afterwards are kept under their rotated names.
+    archive_mutex.lock();
+    archiver_stop = true;
+    bool started = archiver_started;
+    archiver_started = false;
+    archive_cond.signal();
+    archive_mutex.unlock();
+    if (started)
+        pthread_join(archiver_thread, NULL);
+}
+
+void XLogRollingFileHandler::log(const char* origin, const char* func, LogLevel level, const char* format, va_list& arglist)
+{
+    XLogFileHandlerBase::log(origin, func, level, format, arglist);
+    if (reachFileLimit())
+        rotate();
+}
+
+void XLogRollingFileHandler::write(const XTime& tm, const char* origin, const char* func, LogLevel level, const char* msg)
+{
+    XLogFileHandlerBase::write(tm, origin, func, level, msg);
+    if (reachFileLimit())
+        rotate();
+}
+
+bool XLogRollingFileHandler::reachFileLimit()
+{
+    // Read without the lock: at worst, the file is rotated an entry late.
+    if (!log_file)
+        return false;
+    if (max_file_size > 0 && log_file_size >= max_file_size)
+        return true;
+    if (max_file_age > 0 && time(NULL) - log_file_time >= max_file_age)
+        return true;
+    return false;
+}
+
+void XLogRollingFileHandler::rotate()
+{
+    // One writer rotates the file, the others go on writing meanwhile.
+    if (!__sync_bool_compare_and_swap(&rotating, 0, 1))
+        return;
+
+    // The file is renamed first, and written under its new name until the
+    // new file is open, so that the writers only wait for the swap.
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ".%ld-%lu", (long)time(NULL), rotations++);
+    string rotated = log_filename + suffix;
+    FILE * file = NULL;
+    if (rename(log_filename.c_str(), rotated.c_str()) == 0) {
+        file = fopen(log_filename.c_str(), "a");
+        if (file == NULL)
+            rename(rotated.c_str(), log_filename.c_str());
+    }
+
+    mutex.lock();
+    FILE * old_file = NULL;
+    if (file != NULL) {
+        old_file = log_file;
+        log_file = file;
+    }
+    // On failure, try again at the next limit rather than at every entry
+    log_file_size = 0;
+    log_file_time = time(NULL);
+    mutex.unlock();
+
+    if (old_file != NULL) {
+        fclose(old_file);
+        archive(rotated);
+    }
+    rotating = 0;
+}
+
+const string XLogRollingFileHandler::getFilename(int index, bool gz)
+{
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d%s", index, gz ? ".gz" : "");
+    return log_filename + suffix;
+}
+
+void XLogRollingFileHandler::archive(const string& filename)
+{
+    archive_mutex.lock();
+    if (archiver_stop) {
+        archive_mutex.unlock();
+        return;
+    }
+    if (!archiver_started) {
+        if (pthread_create(&archiver_thread, NULL, archiverMain, this) != 0) {
+            // Keep the file under its rotated name
+            archive_mutex.unlock();
+            return;
+        }
+        archiver_started = true;
+    }
+    archive_files.push_back(filename);
+    archive_cond.signal();
+    archive_mutex.unlock();
+}
+
+void* XLogRollingFileHandler::archiverMain(void* arg)
+{
+    ((XLogRollingFileHandler *)arg)->archiver();
+    return NULL;
+}
+
+void XLogRollingFileHandler::archiver()
+{
+    archive_mutex.lock();
+    while (true) {
+        while (archive_files.empty() && !archiver_stop)
+            archive_cond.wait(archive_mutex);
+        if (archive_files.empty())
+            break;
+        string rotated = archive_files.front();
+        archive_files.erase(archive_files.begin());
+        archive_mutex.unlock();
+
+        // Shift the previous files, dropping the oldest one. A file that
+        // could not be compressed is kept uncompressed, under the same
+        // index, so both names are shifted.
+        unlink(getFilename(num_files, compress).c_str());
+        if (compress)
+            unlink(getFilename(num_files, false).c_str());
+        for (int i = num_files - 1; i >= 1; i--) {
+            rename(getFilename(i, compress).c_str(), getFilename(i + 1, compress).c_str());
+            if (compress)
+                rename(getFilename(i, false).c_str(), getFilename(i + 1, false).c_str());
+        }
+
+        if (num_files <= 0) {
+            unlink(rotated.c_str());
+        }
+        else if (!compress) {
+            rename(rotated.c_str(), getFilename(1, false).c_str());
+        }
+        else if (gzip_file(rotated.c_str(), getFilename(1, true).c_str()) == 0) {
+            unlink(rotated.c_str());
+        }
+        else {
+            // Keep it uncompressed rather than lose it
+            rename(rotated.c_str(), getFilename(1, false).c_str());
+        }
+
+        archive_mutex.lock();
+    }
+    archive_mutex.unlock();
+}
+
 
 /********************************************************************************
  * XLogSyslogHandler
@@ -3,6 +3,11 @@
  * All rights reserved.
  */
 
+#if __unix__
+#include <errno.h>
+#include <time.h>
+#endif
+
 #include "mutex.hpp"
 
 XMutex::XMutex()
@@ -40,3 +45,65 @@ void XMutex::unlock()
     pthread_mutex_unlock(&mutex);
 #endif
 }
+
+XCondition::XCondition()
+{
+#if __WIN32__ || _MSC_VER
+    InitializeConditionVariable(&cond);
+#elif __unix__
+    pthread_cond_init(&cond, NULL);
+#endif
+}
+
+XCondition::~XCondition()
+{
+#if __WIN32__ || _MSC_VER
+    // Nothing to do
+#elif __unix__
+    pthread_cond_destroy(&cond);
+#endif
+}
+
+void XCondition::wait(XMutex& m)
+{
+#if __WIN32__ || _MSC_VER
+    SleepConditionVariableCS(&cond, &m.crit_section, INFINITE);
+#elif __unix__
+    pthread_cond_wait(&cond, &m.mutex);
+#endif
+}
+
+bool XCondition::timedWait(XMutex& m, long msec)
+{
+#if __WIN32__ || _MSC_VER
+    return SleepConditionVariableCS(&cond, &m.crit_section, msec) != 0;
+#elif __unix__
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += msec / 1000;
+    ts.tv_nsec += (msec % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return pthread_cond_timedwait(&cond, &m.mutex, &ts) != ETIMEDOUT;
+#endif
+}
+
+void XCondition::signal()
+{
+#if __WIN32__ || _MSC_VER
+    WakeConditionVariable(&cond);
+#elif __unix__
+    pthread_cond_signal(&cond);
+#endif
+}
+
+void XCondition::broadcast()
+{
+#if __WIN32__ || _MSC_VER
+    WakeAllConditionVariable(&cond);
+#elif __unix__
+    pthread_cond_broadcast(&cond);
+#endif
+}
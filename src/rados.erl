@@ -8,10 +8,12 @@
 -export([
          load/1,
          add_stderr_log_handler/0, add_sys_log_handler/0, add_file_log_handler/1, set_log_level/1,
+         add_rolling_file_log_handler/2,
+         log_async_enable/1, log_async_disable/0, log_dropped/0,
          create/0, create/1,
          conf_read_file/1, conf_read_file/2,
          conf_set/3,
-         connect/1,
+         connect/1, connect_async/3,
          shutdown/1,
          get_instance_id/1,
          pool_list/1,
@@ -27,20 +29,41 @@
          ioctx_get_id/1,
          ioctx_get_pool_name/1,
          ioctx_snap_create/2, ioctx_snap_remove/2,
-         rollback/3,
-         ioctx_snap_list/1, ioctx_snap_list_with_name/1,
+         rollback/3, rollback_many/4,
+         ioctx_snap_list/1, ioctx_snap_list_full/1, ioctx_snap_list_with_name/1,
          ioctx_snap_lookup/2, ioctx_snap_get_name/2, ioctx_snap_get_stamp/2,
+         ioctx_snap_set_read/2, ioctx_create_snap_read/3,
+         ioctx_selfmanaged_snap_create/1, ioctx_selfmanaged_snap_remove/2,
+         ioctx_selfmanaged_snap_rollback/3, ioctx_selfmanaged_snap_set_write_ctx/3,
          aio_flush/1,
          write/4,
          write_full/3,
          append/3,
          read/4,
+         cache_enable/2, cache_disable/1, cache_stats/1,
+         meta_cache_enable/2, meta_cache_disable/1, meta_cache_stats/1,
+         watch/3, cache_watch/2, unwatch/1, notify/3,
+         shm_cache_open/2, shm_cache_close/0,
+         shm_cache_enable/1, shm_cache_disable/1, shm_cache_stats/0,
+         disk_cache_open/2, disk_cache_close/0,
+         disk_cache_enable/1, disk_cache_disable/1, disk_cache_stats/0,
+         journal_enable/3, journal_disable/1, journal_flush/1, journal_stats/1,
+         coalesce_enable/1, coalesce_disable/1, coalesce_stats/0,
          remove/2,
          trunc/3,
          stat/2,
-         objects_list_open/1, objects_list_next/1, objects_list_close/1,
+         objects_list_open/1, objects_list_open/2,
+         objects_list_next/1, objects_list_next/2,
+         objects_list_position/1, objects_list_seek/2,
+         objects_list_close/1,
+         pool_scan/4, pool_changes/4, job_cancel/1,
+         objects_list_stream/3, objects_list_stream_ack/2,
          getxattr/3, setxattr/4, rmxattr/3, 
-         getxattrs/2, getxattrs_next/1, getxattrs_end/1
+         getxattrs/2, getxattrs_next/1, getxattrs_end/1,
+         getxattrs_map/2,
+         getxattr_many/3, setxattr_many/3,
+         omap_set/3, omap_rm_keys/3,
+         omap_get_vals/4, omap_get_keys/4, omap_get_vals_by_keys/3
         ]).
 
 -define(LIBNAME, rados_nif).
@@ -55,6 +78,12 @@
 %% Load the rados_nif shared library. This must called before other functions
 %% can be called.
 %%
+%% When a new version of the module is loaded, the clusters, io contexts,
+%% list contexts and xattr iterators are handed over to the new library,
+%% and the handles stay valid. The caches, watches and background jobs
+%% are not carried over: they stop when the old code is purged, and must
+%% be set up again. The upgrade fails while write-back journals are open.
+%%
 %% @param File   Path of the dirctory where rados_nif.so file is
 %%               located, or the absolute path of rados_nif.so.
 %%
@@ -94,17 +123,73 @@ add_sys_log_handler() ->
 add_file_log_handler(Filenamee) ->
     "RADOS NIF library not loaded".
 
+%%
+%% Add a log handler that outputs to the specified file, and starts a new
+%% file when it reaches a size or an age. The previous files are kept as
+%% Filename.1, the most recent, to Filename.N, gzipped by default; the
+%% renames and the compression are done by a background thread.
+%%
+%% @param Filename    Log file name and path
+%% @param Opts        Proplist of options:
+%%                      {max_size, Bytes}    rotate above this size, 64 MB
+%%                                           by default, 0 for no limit
+%%                      {max_age, Secs}      rotate the file after this
+%%                                           time, 0 (no limit) by default
+%%                      {keep, N}            previous files kept, 7
+%%                      {compress, Bool}     gzip the previous files, true
+%%
+%% @returns          'ok'
+%%
+add_rolling_file_log_handler(Filename, Opts) ->
+    "RADOS NIF library not loaded".
+
 %%
 %% Set the log level.
 %%
 %% @param Level      Log level. Log levels are atoms, acceptable levels are 
-%%                   fatal, error, warning, info, debug.
+%%                   fatal, error, warning, info, debug, and none to turn
+%%                   logging off. The level is checked before the arguments
+%%                   of a log entry are built, so that the entries disabled
+%%                   cost almost nothing.
 %%
 %% @returns          'ok' on success, {error, Reason} on failure.
 %%
 set_log_level(Level) ->
     "RADOS NIF library not loaded".
 
+%%
+%% Log asynchronously: the log entries are formatted by the caller, and
+%% put in a queue, written to the log handlers by a background thread.
+%% Calling it again restarts the writer with the new options.
+%%
+%% @param Opts       Proplist of options:
+%%                     {queue, N}              number of entries of the
+%%                                             queue, 8192 by default
+%%                     {when_full, drop|block} drop the entry, the default,
+%%                                             or wait for room when the
+%%                                             queue is full
+%%
+%% @returns          'ok' on success, {error, Reason} on failure.
+%%
+log_async_enable(Opts) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Write the entries queued, and go back to logging synchronously.
+%%
+%% @returns          'ok'
+%%
+log_async_disable() ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Get the number of log entries dropped because the queue was full.
+%%
+%% @returns          Count of entries dropped since the library was loaded.
+%%
+log_dropped() ->
+    "RADOS NIF library not loaded".
+
 %%
 %% Create a handle for communicating with a RADOS cluster.
 %% 
@@ -155,7 +240,8 @@ conf_set(Cluster, Option, Value) when is_integer(Cluster) ->
     "RADOS NIF library not loaded".
 
 %%
-%% Connect to the cluster.
+%% Connect to the cluster. Runs on a dirty I/O scheduler, as it can block
+%% until the mount timeout.
 %%
 %% @param Cluster  The cluster to connect to.
 %%
@@ -164,6 +250,24 @@ conf_set(Cluster, Option, Value) when is_integer(Cluster) ->
 connect(Cluster) when is_integer(Cluster) ->
     "RADOS NIF library not loaded".
 
+%%
+%% Connect to the cluster in the background. The result is sent to Pid as
+%% {rados_connect, ConnectId, ok} or {rados_connect, ConnectId, {error, Reason}}.
+%% Each connection has its own thread, so that several clusters can be
+%% connected in parallel. shutdown/1 returns {error, Reason} with the
+%% reason for EBUSY until the result is sent.
+%%
+%% @param Cluster  The cluster to connect to.
+%% @param Pid      the process to send the result to
+%% @param Opts     list of options:
+%%                   {timeout, Seconds}   sets client_mount_timeout, after
+%%                                        which the connection fails
+%%
+%% @returns       {ok, ConnectId}, {error, Reason} on failure.
+%%
+connect_async(Cluster, Pid, Opts) when is_integer(Cluster), is_pid(Pid), is_list(Opts) ->
+    "RADOS NIF library not loaded".
+
 
 %%
 %% Disconnects from the cluster.
@@ -172,7 +276,8 @@ connect(Cluster) when is_integer(Cluster) ->
 %%
 %% @param Cluster   the cluster to shutdown
 %%
-%% @returns       'ok' on return.
+%% @returns       'ok' on return, {error, Reason} with the reason for EBUSY
+%%                while a connection to the cluster is in progress.
 %%
 shutdown(Cluster) ->
     "RADOS NIF library not loaded".
@@ -281,6 +386,9 @@ ioctx_create(Cluster, PoolName) when is_integer(Cluster) ->
 %% not be freed immediately if there are pending asynchronous requests on it, but 
 %% you should not use an io context again after calling this function on it.
 %%
+%% The journaled writes of the io context are applied first, which waits
+%% as long as the pool is not writable. Runs on a dirty I/O scheduler.
+%%
 %% @param IoCtx   the io context to dispose of
 %%
 %% @returns       'ok' on return.
@@ -393,6 +501,39 @@ ioctx_snap_remove(IoCtx, SnapName) when is_integer(IoCtx) ->
 rollback(IoCtx, Oid, SnapName) when is_integer(IoCtx) ->
     "RADOS NIF library not loaded".
 
+%%
+%% Rollback many objects to a snapshot, in the background.
+%%
+%% The objects are rolled back with a bounded number of asynchronous
+%% rollbacks in flight, driven by a single worker of the work pool. With
+%% 'all', the pool is listed as the rollback goes, so that the whole list
+%% of objects is never held in memory. The rollback
+%% uses its own io context, so IoCtx may be destroyed while it is running.
+%% Results are sent as messages of the form {rados_rollback, JobId, Msg},
+%% where Msg is one of:
+%%
+%%   {progress, Done, Failed}   objects rolled back and failed so far
+%%   {error, Oid, Reason}       an object could not be rolled back
+%%   {error, Reason}            the listing of the pool has failed
+%%   {done, Done, Failed}       the rollback is finished, no more messages
+%%
+%% The rollback can be stopped with job_cancel/1.
+%%
+%% @param IoCtx    the pool io context
+%% @param Oids     the objects to rollback, or 'all' for the whole pool
+%% @param Snap     the name of a pool snapshot, or the id of a self-managed
+%%                 snapshot
+%% @param Opts     list of options:
+%%                   {parallel, N}   number of rollbacks in flight (16)
+%%                   {progress, N}   report progress every N objects (1000)
+%%                   {pid, Pid}      process to send the results to, the
+%%                                   caller by default
+%%
+%% @returns        {ok, JobId}, {error, Reason} on failure.
+%%
+rollback_many(IoCtx, Oids, Snap, Opts) when is_integer(IoCtx), is_list(Opts) ->
+    "RADOS NIF library not loaded".
+
 %%
 %% List all the ids of pool snapshots.
 %%
@@ -405,12 +546,18 @@ rollback(IoCtx, Oid, SnapName) when is_integer(IoCtx) ->
 ioctx_snap_list(IoCtx) when is_integer(IoCtx) ->
     "RADOS NIF library not loaded".
 
-proc_snap_list(IoCtx, []) ->
-    [];
-proc_snap_list(IoCtx, L) ->
-    [H|T] = L,
-    {ok, Name} = ioctx_snap_get_name(IoCtx, H),
-    [[{id, H},{name, Name}] | proc_snap_list(IoCtx, T)].
+%%
+%% List all the ids, names and timestamps of pool snapshots, in a single
+%% call.
+%%
+%% @param IoCtx    the pool to read from
+%%
+%% @returns        {ok, [{SnapId, SnapName, Stamp}|...]} on success,
+%%                 the list might be empty if the pool has no snapshot
+%%                 {error, Reason} on failure.
+%%
+ioctx_snap_list_full(IoCtx) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
 
 %%
 %% List all the ids and names of pool snapshots.
@@ -422,8 +569,12 @@ proc_snap_list(IoCtx, L) ->
 %%                 {error, Reason} on failure.
 %%
 ioctx_snap_list_with_name(IoCtx) when is_integer(IoCtx) ->
-    {ok, Ids} = ioctx_snap_list(IoCtx),
-    {ok, proc_snap_list(IoCtx, Ids)}.
+    case ioctx_snap_list_full(IoCtx) of
+        {ok, Snaps} ->
+            {ok, [[{id, Id}, {name, Name}] || {Id, Name, _Stamp} <- Snaps]};
+        Error ->
+            Error
+    end.
 
 %%
 %% Get the id of a pool snapshot.
@@ -458,6 +609,91 @@ ioctx_snap_get_name(IoCtx, SnapId) when is_integer(IoCtx) ->
 ioctx_snap_get_stamp(IoCtx, SnapId) when is_integer(IoCtx) ->
     "RADOS NIF library not loaded".
 
+%%
+%% Set the snapshot the reads of an io context are done from. The writes
+%% are not affected, they always go to the head of the objects. The caches
+%% enabled on the io context are cleared when the snapshot changes, so it
+%% is best to keep a dedicated io context per snapshot read.
+%%
+%% @param IoCtx     the io context
+%% @param SnapId    the snapshot to read from, or 'head' for the live data
+%%
+%% @returns         'ok'
+%%
+ioctx_snap_set_read(IoCtx, SnapId) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Create an io context reading from a pool snapshot, e.g. to export a
+%% consistent image of a pool while it is written.
+%%
+%% @param Cluster   which cluster the pool is in
+%% @param PoolName  name of the pool
+%% @param SnapName  the snapshot to read from
+%%
+%% @returns         {ok, Handle} to the io context, or {error, Reason} on failure.
+%%
+ioctx_create_snap_read(Cluster, PoolName, SnapName) when is_integer(Cluster) ->
+    case ioctx_create(Cluster, PoolName) of
+        {ok, IoCtx} ->
+            case ioctx_snap_lookup(IoCtx, SnapName) of
+                {ok, SnapId} ->
+                    ok = ioctx_snap_set_read(IoCtx, SnapId),
+                    {ok, IoCtx};
+                Error ->
+                    ioctx_destroy(IoCtx),
+                    Error
+            end;
+        Error ->
+            Error
+    end.
+
+%%
+%% Allocate an id for a self-managed snapshot. The snapshot is taken by
+%% the writes made once the id is in the write context of the io context.
+%%
+%% @param IoCtx     the pool to allocate the snapshot in
+%%
+%% @returns         {ok, SnapId} on success, {error, Reason} on failure.
+%%
+ioctx_selfmanaged_snap_create(IoCtx) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Remove a self-managed snapshot.
+%%
+%% @param IoCtx     the pool the snapshot is in
+%% @param SnapId    the snapshot to remove
+%%
+%% @returns         'ok' on success, {error, Reason} on failure.
+%%
+ioctx_selfmanaged_snap_remove(IoCtx, SnapId) when is_integer(IoCtx), is_integer(SnapId) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Rollback an object to a self-managed snapshot.
+%%
+%% @param IoCtx     the pool the object is in
+%% @param Oid       the object to rollback
+%% @param SnapId    the snapshot to rollback to
+%%
+%% @returns         'ok' on success, {error, Reason} on failure.
+%%
+ioctx_selfmanaged_snap_rollback(IoCtx, Oid, SnapId) when is_integer(IoCtx), is_integer(SnapId) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Set the snapshot context of the writes of an io context.
+%%
+%% @param IoCtx     the io context
+%% @param Seq       the newest snapshot sequence number of the pool
+%% @param Snaps     the existing snapshots of the objects, newest first
+%%
+%% @returns         'ok' on success, {error, Reason} on failure.
+%%
+ioctx_selfmanaged_snap_set_write_ctx(IoCtx, Seq, Snaps) when is_integer(IoCtx), is_list(Snaps) ->
+    "RADOS NIF library not loaded".
+
 %%
 %% Write data to an object.
 %%
@@ -512,6 +748,388 @@ append(IoCtx, Oid, Data) when is_integer(IoCtx) ->
 read(IoCtx, Oid, Len, Offset) when is_integer(IoCtx), is_integer(Len), is_integer(Offset) ->
     "RADOS NIF library not loaded".
 
+%%
+%% Enable a read cache on an io context. The ranges read with read/4 are
+%% kept in memory, and the reads within a cached range are served from it.
+%% The writes, truncates, removes and rollbacks issued through the same io
+%% context drop the cached data of the object. With validation on, a hit
+%% also checks the version of the object on the OSD, so that the writes
+%% from other clients are seen as well; this costs a round trip, but no
+%% data is transferred. Enabling the cache again replaces it.
+%%
+%% @param IoCtx    the io context
+%% @param Opts     list of options:
+%%                   {max_bytes, N}     size of the cache in bytes (64 MB)
+%%                   {validate, Bool}   check the object version on hits (true)
+%%
+%% @returns        'ok'
+%%
+cache_enable(IoCtx, Opts) when is_integer(IoCtx), is_list(Opts) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Disable the read cache of an io context, and free the cached data.
+%%
+%% @param IoCtx    the io context
+%%
+%% @returns        'ok'
+%%
+cache_disable(IoCtx) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Get the statistics of the read cache of an io context.
+%%
+%% @param IoCtx    the io context
+%%
+%% @returns        {ok, [{hits, N}, {misses, N}, {hit_ratio, R}, {evictions, N},
+%%                 {entries, N}, {bytes, N}, {max_bytes, N}]},
+%%                 or {error, Reason} if there is no cache.
+%%
+cache_stats(IoCtx) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Enable a metadata cache on an io context. The results of stat/2 and
+%% getxattr/3 are kept for a time to live, including the lookups of objects
+%% or xattrs that do not exist. The changes made through the same io context
+%% (writes, removes, setxattr, rmxattr, omap updates) drop the cached
+%% metadata of the object at once; the changes made by other clients may go
+%% unnoticed for up to the time to live. Enabling the cache again replaces it.
+%%
+%% @param IoCtx    the io context
+%% @param Opts     list of options:
+%%                   {ttl, Ms}            time to live of the entries (1000)
+%%                   {max_entries, N}     maximum number of objects (10000)
+%%
+%% @returns        'ok'
+%%
+meta_cache_enable(IoCtx, Opts) when is_integer(IoCtx), is_list(Opts) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Disable the metadata cache of an io context.
+%%
+%% @param IoCtx    the io context
+%%
+%% @returns        'ok'
+%%
+meta_cache_disable(IoCtx) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Get the statistics of the metadata cache of an io context.
+%%
+%% @param IoCtx    the io context
+%%
+%% @returns        {ok, [{hits, N}, {misses, N}, {negative_hits, N},
+%%                 {hit_ratio, R}, {entries, N}]},
+%%                 or {error, Reason} if there is no cache.
+%%
+meta_cache_stats(IoCtx) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Watch an object. Each notification on the object is acked at once and
+%% sent to Pid as {rados_watch, WatchId, {notify, NotifyId, NotifierId, Payload}}.
+%% If the watch is lost, e.g. after a disconnection, Pid receives
+%% {rados_watch, WatchId, {error, Reason}}. The caches of the io context
+%% drop the object on every notification, and are flushed when the watch
+%% is lost.
+%% The watch is stopped when Pid exits.
+%%
+%% @param IoCtx    the io context
+%% @param Oid      the object to watch
+%% @param Pid      the process to send the notifications to
+%%
+%% @returns        {ok, WatchId}, or {error, Reason} on failure.
+%%
+watch(IoCtx, Oid, Pid) when is_integer(IoCtx), is_pid(Pid) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Watch an object on behalf of the caches of an io context only: the
+%% cached data and metadata of the object are dropped whenever it is
+%% notified, no message is sent. The watch is stopped when the calling
+%% process exits.
+%%
+%% The writes made through this module (write, write_full, append, remove,
+%% trunc, setxattr, rmxattr, rollback and the others) do not notify the
+%% object. For the caches of the other nodes to see a change, the writer
+%% must call notify/3 on the object after it.
+%%
+%% @param IoCtx    the io context
+%% @param Oid      the object to watch
+%%
+%% @returns        {ok, WatchId}, or {error, Reason} on failure.
+%%
+cache_watch(IoCtx, Oid) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Stop a watch. No notification of the watch is delivered after this
+%% returns. The watches of an io context are stopped by ioctx_destroy/1.
+%%
+%% @param WatchId  the watch from watch/3 or cache_watch/2
+%%
+%% @returns        'ok'
+%%
+unwatch(WatchId) when is_integer(WatchId) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Notify the watchers of an object, and wait until all of them have acked
+%% or timed out. Runs on a dirty I/O scheduler.
+%%
+%% @param IoCtx    the io context
+%% @param Oid      the object to notify
+%% @param Payload  binary sent to the watchers
+%%
+%% @returns        'ok', or {error, Reason} on failure.
+%%
+notify(IoCtx, Oid, Payload) when is_integer(IoCtx), is_binary(Payload) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Open the host cache, a POSIX shared memory segment shared by all the
+%% Erlang nodes of the host that open it with the same name. The segment
+%% is created if it does not exist yet, otherwise the size it was created
+%% with is used. It persists until it is removed from /dev/shm, or the host
+%% reboots. Opening the cache again replaces it.
+%%
+%% The reads served from the segment return binaries pointing into it,
+%% without copy. With validation on, each hit checks the object version on
+%% the OSD, which is required if the objects are written by other clients.
+%%
+%% @param Name     name of the segment, e.g. "/rados_cache"
+%% @param Opts     list of options:
+%%                   {size, Bytes}      size of a new segment (256 MB)
+%%                   {validate, Bool}   check the object version on hits (true)
+%%
+%% @returns        'ok', or {error, Reason} on failure.
+%%
+shm_cache_open(Name, Opts) when is_list(Opts) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Close the host cache for this node. The segment is unmapped once the
+%% binaries pointing into it are garbage collected.
+%%
+%% @returns        'ok'
+%%
+shm_cache_close() ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Serve the reads of an io context from the host cache. The read cache of
+%% the io context, if enabled with cache_enable/2, takes precedence.
+%%
+%% @param IoCtx    the io context
+%%
+%% @returns        'ok', or {error, Reason} if the host cache is not open.
+%%
+shm_cache_enable(IoCtx) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Stop serving the reads of an io context from the host cache.
+%%
+%% @param IoCtx    the io context
+%%
+%% @returns        'ok'
+%%
+shm_cache_disable(IoCtx) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Get the statistics of the host cache: the hits, misses and evictions of
+%% this node, the reads that bypassed the cache, and the hits, misses and
+%% evictions of all the nodes of the host.
+%%
+%% @returns        {ok, [{hits, N}, {misses, N}, {hit_ratio, R}, {evictions, N},
+%%                 {bypassed, N}, {host_hits, N}, {host_misses, N},
+%%                 {host_evictions, N}, {size, Bytes}]},
+%%                 or {error, Reason} if the host cache is not open.
+%%
+shm_cache_stats() ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Open the disk cache, a read-through cache of object ranges in a local
+%% directory, meant for a local SSD. Each range is kept in a file, and the
+%% index is rebuilt from the files when the cache is opened again, e.g.
+%% after a restart. The directory must not be shared with another node.
+%% Opening the cache again replaces it. The directory is scanned before
+%% the call returns, on a dirty I/O scheduler.
+%%
+%% The ranges are checked against the object before they are used:
+%%   version  the object version must not have changed (one round trip,
+%%            no data transferred)
+%%   mtime    the object mtime must not have changed, to the nanosecond
+%%            (one stat)
+%%   none     no check, for objects that are never rewritten
+%%
+%% @param Dir      the cache directory, created if needed
+%% @param Opts     list of options:
+%%                   {max_bytes, N}     size of the cache in bytes (1 GB)
+%%                   {validate, How}    version, mtime or none (version)
+%%
+%% @returns        'ok', or {error, Reason} on failure.
+%%
+disk_cache_open(Dir, Opts) when is_list(Opts) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Close the disk cache. The files are kept for the next time it is opened.
+%%
+%% @returns        'ok'
+%%
+disk_cache_close() ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Serve the reads of an io context from the disk cache. The read cache of
+%% the io context and the host cache, if enabled, take precedence.
+%%
+%% @param IoCtx    the io context
+%%
+%% @returns        'ok', or {error, Reason} if the disk cache is not open.
+%%
+disk_cache_enable(IoCtx) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Stop serving the reads of an io context from the disk cache.
+%%
+%% @param IoCtx    the io context
+%%
+%% @returns        'ok'
+%%
+disk_cache_disable(IoCtx) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Get the statistics of the disk cache. The stale entries are the ones
+%% dropped because the object had changed, or the file could not be read.
+%% The pending stores are the ranges read but not yet written to the
+%% cache directory.
+%%
+%% @returns        {ok, [{hits, N}, {misses, N}, {hit_ratio, R}, {stale, N},
+%%                 {evictions, N}, {entries, N}, {bytes, N}, {max_bytes, N},
+%%                 {write_errors, N}, {pending_stores, N}]},
+%%                 or {error, Reason} if the disk cache is not open.
+%%
+disk_cache_stats() ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Enable write-back on an io context. write/4 and write_full/3 return once
+%% the write is appended to a local journal file and synced, and the writes
+%% are applied to the pool in the background, in the order they were made.
+%% The reads and stats of the io context see the writes not yet applied.
+%% The appends, truncates, removes and rollbacks of an object wait for its
+%% writes to be applied first.
+%%
+%% The writes left in the journal, e.g. after a crash, are applied again
+%% when the journal is enabled, so the same journal must always be used
+%% with the same pool. When the writes not yet applied exceed the maximum
+%% lag, the writers wait up to a second for the journal to catch up, then
+%% get {error, Reason} with the reason for EAGAIN. A write larger than
+%% the OSDs take (osd_max_write_size) is refused with the reason for E2BIG.
+%%
+%% A write that cannot be applied, for a reason that will not go away, is
+%% dropped, and the calling process is sent
+%% {rados_journal, IoCtx, {error, Oid, Reason}}. Runs on a dirty I/O
+%% scheduler.
+%%
+%% While the journal is enabled, write/4, write_full/3, append/3, remove/2,
+%% trunc/3, rollback/3 and ioctx_selfmanaged_snap_rollback/3 run on a dirty
+%% I/O scheduler, as they wait for the journal. The writes made at the same
+%% time are synced to the journal file together.
+%%
+%% @param IoCtx    the io context
+%% @param Path     the journal file, created if needed
+%% @param Opts     list of options:
+%%                   {max_lag, Bytes}   maximum size of the writes not
+%%                                      yet applied (64 MB)
+%%
+%% @returns        'ok', or {error, Reason} on failure.
+%%
+journal_enable(IoCtx, Path, Opts) when is_integer(IoCtx), is_list(Opts) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Disable write-back on an io context, once all the writes are applied.
+%% The writes that cannot be applied are retried until they are, so this
+%% waits as long as the pool is not writable. ioctx_destroy/1 does the same.
+%% Runs on a dirty I/O scheduler.
+%%
+%% @param IoCtx    the io context
+%%
+%% @returns        'ok'
+%%
+journal_disable(IoCtx) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Wait until all the journaled writes of an io context are applied. Runs on
+%% a dirty I/O scheduler.
+%%
+%% @param IoCtx    the io context
+%%
+%% @returns        'ok'
+%%
+journal_flush(IoCtx) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Get the statistics of the journal of an io context. The lag is the age
+%% of the oldest write not yet applied.
+%%
+%% @param IoCtx    the io context
+%%
+%% @returns        {ok, [{pending_ops, N}, {pending_bytes, N}, {lag_seconds, N},
+%%                 {appended, N}, {flushed, N}, {replayed, N}, {errors, N},
+%%                 {journal_size, N}]},
+%%                 or {error, Reason} if write-back is not enabled.
+%%
+journal_stats(IoCtx) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Coalesce the concurrent reads of an io context. While a read is in
+%% flight, the identical reads and the reads of a range it covers wait
+%% for it, instead of reading the object again, and get sub binaries of
+%% the same buffer. A read started before a change through the io context
+%% is not shared with the reads after it, but a read may return data a
+%% little older than a change made by another client at the same time.
+%% Only the reads not served by a cache are coalesced.
+%%
+%% @param IoCtx    the io context
+%%
+%% @returns        'ok'
+%%
+coalesce_enable(IoCtx) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Stop coalescing the reads of an io context.
+%%
+%% @param IoCtx    the io context
+%%
+%% @returns        'ok'
+%%
+coalesce_disable(IoCtx) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Get the statistics of read coalescing, for all the io contexts.
+%%
+%% @returns        {ok, [{coalesced, N}, {in_flight, N}]}
+%%
+coalesce_stats() ->
+    "RADOS NIF library not loaded".
+
 %%
 %% Delete an object.
 %%
@@ -564,6 +1182,28 @@ stat(IoCtx, Oid) when is_integer(IoCtx) ->
 objects_list_open(IoCtx) when is_integer(IoCtx) ->
     "RADOS NIF library not loaded".
 
+%%
+%% Start listing objects in a pool, with options.
+%%
+%% @param IoCtx    the pool io context
+%% @param Opts     list of options:
+%%                   {position, Pos}   resume the listing at a position
+%%                                     returned by objects_list_position/1
+%%                   {prefix, Prefix}  only list names starting with Prefix
+%%                   {suffix, Suffix}  only list names ending with Suffix
+%%                   {glob, Pattern}   only list names matching a shell
+%%                                     wildcard pattern, see fnmatch(3)
+%%                   {regex, Regex}    only list names matching a POSIX
+%%                                     extended regular expression
+%%                 Filters are evaluated natively, and all of them must match.
+%%                 Names are given as strings or binaries.
+%%
+%% @returns        {ok, ListCtx}, {error, Reason} on failure.
+%%                 ListCtx is the list context
+%%
+objects_list_open(IoCtx, Opts) when is_integer(IoCtx), is_list(Opts) ->
+    "RADOS NIF library not loaded".
+
 %%
 %% Get the next object name and locator in the pool.
 %% 
@@ -579,6 +1219,50 @@ objects_list_open(IoCtx) when is_integer(IoCtx) ->
 objects_list_next(ListCtx) when is_integer(ListCtx) ->
     "RADOS NIF library not loaded".
 
+%%
+%% Get the next batch of object names and locators in the pool.
+%%
+%% Fewer than Max entries, possibly none at all with a filter, may be
+%% returned when the call has used up its scheduler timeslice; this does
+%% not mean the listing is over.
+%%
+%% @param ListCtx    iterator marking where you are in the listing
+%% @param Max        maximum number of entries to return
+%%
+%% @returns          {ok, [{Entry, Key}|...]} with names and locators in
+%%                   binary format, Key is <<>> when there is no locator,
+%%                   'end' when there is no more, {error, Reason} on failure.
+%%
+objects_list_next(ListCtx, Max) when is_integer(ListCtx), is_integer(Max), Max > 0 ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Get the current position of a listing.
+%%
+%% The position is an opaque binary, the object-list cursor of the next
+%% object to be returned, which can be saved as a checkpoint. A listing
+%% reopened at this position with objects_list_open/2, possibly after a
+%% restart, continues with that object. The position does not depend on
+%% the number of placement groups of the pool.
+%%
+%% @param ListCtx    the list context
+%%
+%% @returns          {ok, Pos}, {error, Reason} on failure.
+%%
+objects_list_position(ListCtx) when is_integer(ListCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Move a listing to a position returned by objects_list_position/1.
+%%
+%% @param ListCtx    the list context
+%% @param Pos        the position to move to
+%%
+%% @returns          'ok'
+%%
+objects_list_seek(ListCtx, Pos) when is_integer(ListCtx), is_binary(Pos) ->
+    "RADOS NIF library not loaded".
+
 %%
 %% Close the object listing handle.
 %%
@@ -592,6 +1276,117 @@ objects_list_next(ListCtx) when is_integer(ListCtx) ->
 objects_list_close(ListCtx) when is_integer(ListCtx) ->
     "RADOS NIF library not loaded".
 
+%%
+%% Scan all the objects of a pool in parallel.
+%%
+%% The object namespace of the pool is split into Shards ranges, and each
+%% range is listed by its own worker in the background. The scan uses its
+%% own io context, so IoCtx may be destroyed while the scan is running.
+%% Results are sent to Pid as messages of the form {rados_scan, ScanId, Msg},
+%% where Msg is one of:
+%%
+%%   {objects, Shard, [Oid|...]}    a batch of object names, in binary format
+%%   {progress, Shard, Scanned}     number of objects listed so far in the shard
+%%   {error, Shard, Reason}         the shard has stopped on an error
+%%   {shard_done, Shard, Scanned}   the shard is finished
+%%   done                           all the shards are finished, no more messages
+%%
+%% @param IoCtx    the pool io context
+%% @param Pid      the process to send the results to
+%% @param Shards   number of ranges to split the pool into
+%% @param Opts     list of options:
+%%                   {batch, N}      maximum number of objects per message (1000)
+%%                   {progress, N}   report progress every N objects (10000)
+%%                 and the name filters of objects_list_open/2. Scanned counts
+%%                 include the objects filtered out.
+%%
+%% @returns        {ok, ScanId}, {error, Reason} on failure.
+%%
+pool_scan(IoCtx, Pid, Shards, Opts) when is_integer(IoCtx), is_pid(Pid), is_integer(Shards), is_list(Opts) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Scan a pool for the objects changed since a snapshot, e.g. for an
+%% incremental backup.
+%%
+%% The pool is scanned in parallel as with pool_scan/4, and the messages
+%% are the same, tagged with rados_changes instead of rados_scan, except
+%% that the objects are reported as {Oid, new | changed, Size}. With the
+%% 'stat' comparison, an object is new if it is not in the snapshot, and
+%% changed if its size or modification time differ from the snapshot. With
+%% 'mtime', an object is changed if it was modified after the snapshot was
+%% taken, or in the same second: this takes half the operations, but new
+%% objects are reported as changed. The whole object is reported, as
+%% librados does not tell which extents changed. The objects removed since
+%% the snapshot are not reported. An object that cannot be compared, e.g.
+%% because a stat fails, is reported as {error, Oid, Reason} in the list.
+%%
+%% @param IoCtx    the pool io context
+%% @param Pid      the process to send the results to
+%% @param Snap     the name of a pool snapshot, or the id of a self-managed
+%%                 snapshot
+%% @param Opts     list of options:
+%%                   {shards, N}         number of ranges to split the pool into (16)
+%%                   {compare, Mode}     'stat' or 'mtime', for a pool snapshot
+%%                                       only ('stat')
+%%                 and the options of pool_scan/4.
+%%
+%% @returns        {ok, ScanId}, {error, Reason} on failure.
+%%
+pool_changes(IoCtx, Pid, Snap, Opts) when is_integer(IoCtx), is_pid(Pid), is_list(Opts) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Stream the object names of a pool to a process.
+%%
+%% The pool is listed in the background, and the names are sent to Pid in
+%% batches, as messages of the form {rados_list, StreamId, Msg}, where Msg
+%% is one of:
+%%
+%%   {objects, [Oid|...]}    a batch of object names, in binary format
+%%   {error, Reason}         the listing has stopped on an error
+%%   done                    the listing is finished, no more messages
+%%
+%% Flow control is credit-based: each batch sent uses a credit, and the
+%% listing pauses when there is none left, until the receiver grants more
+%% with objects_list_stream_ack/2. The mailbox of a slow receiver thus never
+%% holds more than the credits it has granted.
+%%
+%% @param IoCtx    the pool io context
+%% @param Pid      the process to send the names to
+%% @param Opts     list of options:
+%%                   {batch, N}      maximum number of names per batch (1000)
+%%                   {window, N}     initial number of credits (2)
+%%                 and the name filters of objects_list_open/2.
+%%
+%% @returns        {ok, StreamId}, {error, Reason} on failure.
+%%
+objects_list_stream(IoCtx, Pid, Opts) when is_integer(IoCtx), is_pid(Pid), is_list(Opts) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Grant more credits to a stream, i.e. allow N more batches to be sent.
+%% Acks for a stream that is already finished are ignored.
+%%
+%% @param StreamId    the stream from objects_list_stream/3
+%% @param N           number of batches
+%%
+%% @returns           'ok'
+%%
+objects_list_stream_ack(StreamId, N) when is_integer(StreamId), is_integer(N), N >= 0 ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Cancel a background job, such as a pool scan. The job stops at its next
+%% batch, and still sends its final messages.
+%%
+%% @param JobId    id of the job
+%%
+%% @returns        'ok' on success, {error, Reason} on failure.
+%%
+job_cancel(JobId) when is_integer(JobId) ->
+    "RADOS NIF library not loaded".
+
 %%
 %% Get the value of an extended attribute on an object.
 %%
@@ -600,6 +1395,7 @@ objects_list_close(ListCtx) when is_integer(ListCtx) ->
 %% @param XAttrName   which extended attribute to read
 %%
 %% @returns           {ok, XAttrValue}, {error, Reason} on failure.
+%%                    Values of any size up to 64 MB are returned in full.
 %%
 getxattr(IoCtx, Oid, XAttrName) when is_integer(IoCtx) ->
     "RADOS NIF library not loaded".
@@ -636,7 +1432,11 @@ rmxattr(IoCtx, Oid, XAttrName) when is_integer(IoCtx) ->
 %% @param IoCtx       the context in which to list xattrs
 %% @param Oid         name of the object
 %%
+%% The iterator must be closed with getxattrs_end/1. Those left open are
+%% closed when the io context is destroyed.
+%%
 %% @returns           {ok, Iterator}, {error, Reason} on failure.
+%%
 getxattrs(IoCtx, Oid) when is_integer(IoCtx) ->
     "RADOS NIF library not loaded".
 
@@ -662,6 +1462,122 @@ getxattrs_next(Iterator) when is_integer(Iterator) ->
 getxattrs_end(Iterator) when is_integer(Iterator) ->
     "RADOS NIF library not loaded".
 
+%%
+%% Get all the xattrs on the object in one call.
+%%
+%% The xattr iterator is drained and closed natively, there is no
+%% iterator handle to release afterwards.
+%%
+%% @param IoCtx       the context in which to list xattrs
+%% @param Oid         name of the object
+%%
+%% @returns           {ok, #{XAttrName => XAttrVal}} with names and values
+%%                    in binary format, {error, Reason} on failure.
+%%
+getxattrs_map(IoCtx, Oid) when is_integer(IoCtx) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Get the values of several extended attributes on an object in one call.
+%%
+%% @param IoCtx       the context in which the attributes are read
+%% @param Oid         name of the object
+%% @param XAttrNames  list of extended attribute names, as strings or binaries
+%%
+%% @returns           {ok, #{XAttrName => XAttrVal}} with names and values
+%%                    in binary format, attributes that do not exist are
+%%                    left out of the map, {error, Reason} on failure.
+%%
+getxattr_many(IoCtx, Oid, XAttrNames) when is_integer(IoCtx), is_list(XAttrNames) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Set several extended attributes on an object atomically.
+%%
+%% @param IoCtx       the context in which the attributes are set
+%% @param Oid         name of the object
+%% @param XAttrs      map of XAttrName => XAttrVal, names as strings or
+%%                    binaries, values as binaries
+%%
+%% @returns           'ok' on success, {error, Reason} on failure.
+%%
+setxattr_many(IoCtx, Oid, XAttrs) when is_integer(IoCtx), is_map(XAttrs) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Set key/value pairs in the omap of an object, in one atomic operation.
+%%
+%% @param IoCtx       the context in which the omap is written
+%% @param Oid         name of the object
+%% @param KeyVals     map of Key => Value, keys as binaries or strings,
+%%                    values as binaries
+%%
+%% @returns           'ok' on success, {error, Reason} on failure.
+%%
+omap_set(IoCtx, Oid, KeyVals) when is_integer(IoCtx), is_map(KeyVals) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Remove keys from the omap of an object, in one atomic operation.
+%%
+%% @param IoCtx       the context in which the omap is written
+%% @param Oid         name of the object
+%% @param Keys        list of keys to remove, as binaries or strings
+%%
+%% @returns           'ok' on success, {error, Reason} on failure.
+%%
+omap_rm_keys(IoCtx, Oid, Keys) when is_integer(IoCtx), is_list(Keys) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Get a page of key/value pairs from the omap of an object.
+%%
+%% Keys are returned in sorted order. To get the next page, call again
+%% with StartAfter set to the last key returned. librados takes StartAfter
+%% as a C string, so the keys with a NUL byte cannot be paged from, and
+%% are refused as StartAfter.
+%%
+%% @param IoCtx       the context in which the omap is read
+%% @param Oid         name of the object
+%% @param StartAfter  list keys after this one, <<>> to start from the beginning
+%% @param MaxReturn   maximum number of pairs to return
+%%
+%% @returns           {ok, [{Key, Value}|...], More} with keys and values in
+%%                    binary format, More is true if there are more pairs
+%%                    after this page, {error, Reason} on failure.
+%%
+omap_get_vals(IoCtx, Oid, StartAfter, MaxReturn) when is_integer(IoCtx), is_integer(MaxReturn) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Get a page of keys from the omap of an object.
+%%
+%% @param IoCtx       the context in which the omap is read
+%% @param Oid         name of the object
+%% @param StartAfter  list keys after this one, <<>> to start from the beginning
+%% @param MaxReturn   maximum number of keys to return
+%%
+%% @returns           {ok, [Key|...], More} with keys in binary format,
+%%                    More is true if there are more keys after this page,
+%%                    {error, Reason} on failure.
+%%
+omap_get_keys(IoCtx, Oid, StartAfter, MaxReturn) when is_integer(IoCtx), is_integer(MaxReturn) ->
+    "RADOS NIF library not loaded".
+
+%%
+%% Get the values of a set of omap keys, in one operation.
+%%
+%% @param IoCtx       the context in which the omap is read
+%% @param Oid         name of the object
+%% @param Keys        list of keys to get, as binaries or strings
+%%
+%% @returns           {ok, [{Key, Value}|...]} with keys and values in binary
+%%                    format, keys that do not exist are left out,
+%%                    {error, Reason} on failure.
+%%
+omap_get_vals_by_keys(IoCtx, Oid, Keys) when is_integer(IoCtx), is_list(Keys) ->
+    "RADOS NIF library not loaded".
+
 %%
 %% Block until all pending writes in an io context are safe.
 %% 
@@ -0,0 +1,781 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "rados_cache.h"
+#include "rados_shm.h"
+#include "rados_disk.h"
+
+static const char* MOD_NAME = "rados_cache";
+
+#define CACHE_MAX_BYTES     (64 * 1024 * 1024)
+#define META_TTL_MS         1000
+#define META_MAX_ENTRIES    10000
+#define META_MAX_VALUE      (64 * 1024)
+
+ErlNifResourceType * read_buf_type_resource = NULL;
+
+read_buf_t* read_buf_alloc(size_t size)
+{
+    read_buf_t * buf = (read_buf_t *)enif_alloc_resource(read_buf_type_resource,
+                                                         offsetof(read_buf_t, data) + size);
+    if (buf != NULL)
+        buf->size = size;
+    return buf;
+}
+
+/*
+ * Make a binary out of a part of the buffer. The binary holds its own
+ * reference on the buffer.
+ */
+ERL_NIF_TERM read_buf_make_binary(ErlNifEnv* env, read_buf_t* buf, size_t offset, size_t len)
+{
+    return enif_make_resource_binary(env, buf, buf->data + offset, len);
+}
+
+/********************************************************************************
+ * ReadCache
+ ********************************************************************************/
+
+ReadCache::ReadCache(size_t max_bytes, bool validate) :
+    max_bytes(max_bytes),
+    bytes(0),
+    validate(validate),
+    generation(0),
+    hits(0),
+    misses(0),
+    evictions(0),
+    refs(1)
+{
+}
+
+ReadCache::~ReadCache()
+{
+    clear();
+}
+
+void ReadCache::keep()
+{
+    __sync_add_and_fetch(&refs, 1);
+}
+
+void ReadCache::release()
+{
+    if (__sync_sub_and_fetch(&refs, 1) == 0)
+        delete this;
+}
+
+/*
+ * Find an entry holding the range. The buffer returned has been kept.
+ * A range past the end of a short read is served as well, with a length
+ * of zero, since the read has shown where the object ends.
+ */
+read_buf_t* ReadCache::lookup(const char* oid, size_t len, uint64_t offset,
+                              uint64_t* version, size_t* buf_offset, size_t* buf_len)
+{
+    read_buf_t * buf = NULL;
+    mutex.lock();
+    pair<EntryMap::iterator, EntryMap::iterator> range = entries.equal_range(oid);
+    for (EntryMap::iterator it = range.first; it != range.second; it++)
+    {
+        Entry * e = it->second;
+        if (offset < e->offset || offset + len > e->offset + e->len)
+            continue;
+        size_t start = offset - e->offset;
+        buf = e->buf;
+        enif_keep_resource(buf);
+        *version = e->version;
+        *buf_offset = (start < buf->size) ? start : buf->size;
+        *buf_len = (start + len <= buf->size) ? len : buf->size - *buf_offset;
+        lru.splice(lru.begin(), lru, e->lru_pos);
+        break;
+    }
+    mutex.unlock();
+    return buf;
+}
+
+void ReadCache::insert(const char* oid, size_t len, uint64_t offset,
+                       read_buf_t* buf, uint64_t version, uint64_t gen)
+{
+    mutex.lock();
+    // The object may have been written while it was being read.
+    if (gen != generation)
+    {
+        mutex.unlock();
+        return;
+    }
+
+    Entry * e = new Entry;
+    e->oid = oid;
+    e->offset = offset;
+    e->len = len;
+    e->version = version;
+    e->buf = buf;
+    enif_keep_resource(buf);
+    lru.push_front(e);
+    e->lru_pos = lru.begin();
+    entries.insert(make_pair(e->oid, e));
+    bytes += buf->size;
+
+    while (bytes > max_bytes && !lru.empty())
+    {
+        Entry * old = lru.back();
+        pair<EntryMap::iterator, EntryMap::iterator> range = entries.equal_range(old->oid);
+        for (EntryMap::iterator it = range.first; it != range.second; it++)
+        {
+            if (it->second == old)
+            {
+                evict(it);
+                evictions++;
+                break;
+            }
+        }
+    }
+    mutex.unlock();
+}
+
+/*
+ * Remove an entry. The mutex must be held.
+ */
+void ReadCache::evict(EntryMap::iterator it)
+{
+    Entry * e = it->second;
+    bytes -= e->buf->size;
+    lru.erase(e->lru_pos);
+    entries.erase(it);
+    enif_release_resource(e->buf);
+    delete e;
+}
+
+void ReadCache::invalidate(const char* oid)
+{
+    mutex.lock();
+    generation++;
+    pair<EntryMap::iterator, EntryMap::iterator> range = entries.equal_range(oid);
+    EntryMap::iterator it = range.first;
+    while (it != range.second)
+        evict(it++);
+    mutex.unlock();
+}
+
+void ReadCache::clear()
+{
+    mutex.lock();
+    generation++;
+    while (!entries.empty())
+        evict(entries.begin());
+    mutex.unlock();
+}
+
+ERL_NIF_TERM ReadCache::read(ErlNifEnv* env, rados_ioctx_t io, const char* oid, size_t len, uint64_t offset)
+{
+    const char * func_name = "ReadCache::read()";
+
+    uint64_t version;
+    size_t buf_offset;
+    size_t buf_len;
+    read_buf_t * buf = lookup(oid, len, offset, &version, &buf_offset, &buf_len);
+    if (buf != NULL && validate)
+    {
+        // Make sure that nobody else has written the object since.
+        rados_read_op_t op = rados_create_read_op();
+        rados_read_op_assert_version(op, version);
+        int err = rados_read_op_operate(op, io, oid, LIBRADOS_OPERATION_NOFLAG);
+        rados_release_read_op(op);
+        if (err < 0)
+        {
+            XLOG_DEBUG(logger, MOD_NAME, func_name, "stale entry for %s: %s", oid, strerror(-err));
+            enif_release_resource(buf);
+            buf = NULL;
+            invalidate(oid);
+        }
+    }
+
+    if (buf != NULL)
+    {
+        __sync_add_and_fetch(&hits, 1);
+        ERL_NIF_TERM ret;
+        if (buf_len > 0)
+            ret = enif_make_tuple2(env,
+                                   enif_make_atom(env, "ok"),
+                                   read_buf_make_binary(env, buf, buf_offset, buf_len));
+        else
+            ret = enif_make_atom(env, "eof");
+        enif_release_resource(buf);
+        return ret;
+    }
+
+    __sync_add_and_fetch(&misses, 1);
+
+    buf = read_buf_alloc(len);
+    if (buf == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "unable to alloc %ld bytes", len);
+        return make_error_tuple(env, ENOMEM);
+    }
+
+    mutex.lock();
+    uint64_t gen = generation;
+    mutex.unlock();
+
+    int err;
+    version = 0;
+    if (validate)
+        err = read_versioned(io, oid, buf->data, len, offset, &version);
+    else
+        err = rados_read(io, oid, buf->data, len, offset);
+    if (err < 0)
+    {
+        enif_release_resource(buf);
+        logger.error(MOD_NAME, func_name, "read failed for %s: %s", oid, strerror(-err));
+        return make_error_tuple(env, -err);
+    }
+
+    // Do not keep a large buffer around for a short read.
+    if ((size_t)err < len / 2)
+    {
+        read_buf_t * small = read_buf_alloc(err);
+        if (small != NULL)
+        {
+            memcpy(small->data, buf->data, err);
+            enif_release_resource(buf);
+            buf = small;
+        }
+    }
+    buf->size = err;
+
+    // Ranges too large for the cache are not worth evicting others for.
+    if (len <= max_bytes / 8)
+        insert(oid, len, offset, buf, version, gen);
+
+    ERL_NIF_TERM ret;
+    if (err > 0)
+        ret = enif_make_tuple2(env,
+                               enif_make_atom(env, "ok"),
+                               read_buf_make_binary(env, buf, 0, err));
+    else
+        ret = enif_make_atom(env, "eof");
+    enif_release_resource(buf);
+    return ret;
+}
+
+ERL_NIF_TERM ReadCache::stats(ErlNifEnv* env)
+{
+    mutex.lock();
+    uint64_t h = hits;
+    uint64_t m = misses;
+    uint64_t e = evictions;
+    uint64_t b = bytes;
+    uint64_t n = entries.size();
+    mutex.unlock();
+
+    double ratio = (h + m > 0) ? (double)h / (double)(h + m) : 0.0;
+
+    ERL_NIF_TERM term_list = enif_make_list(env, 0);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "max_bytes"),
+                                                     enif_make_uint64(env, max_bytes)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "bytes"),
+                                                     enif_make_uint64(env, b)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "entries"),
+                                                     enif_make_uint64(env, n)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "evictions"),
+                                                     enif_make_uint64(env, e)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "hit_ratio"),
+                                                     enif_make_double(env, ratio)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "misses"),
+                                                     enif_make_uint64(env, m)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "hits"),
+                                                     enif_make_uint64(env, h)),
+                                    term_list);
+    return term_list;
+}
+
+/********************************************************************************
+ * MetaCache
+ ********************************************************************************/
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+MetaCache::MetaCache(uint64_t ttl_ms, size_t max_entries) :
+    ttl_ms(ttl_ms),
+    max_entries(max_entries),
+    generation(0),
+    hits(0),
+    negative_hits(0),
+    misses(0),
+    refs(1)
+{
+}
+
+MetaCache::~MetaCache()
+{
+}
+
+void MetaCache::keep()
+{
+    __sync_add_and_fetch(&refs, 1);
+}
+
+void MetaCache::release()
+{
+    if (__sync_sub_and_fetch(&refs, 1) == 0)
+        delete this;
+}
+
+uint64_t MetaCache::getGeneration()
+{
+    mutex.lock();
+    uint64_t gen = generation;
+    mutex.unlock();
+    return gen;
+}
+
+/*
+ * Count a hit. The mutex must be held.
+ */
+void MetaCache::hit(int err)
+{
+    hits++;
+    if (err < 0)
+        negative_hits++;
+}
+
+bool MetaCache::getStat(const char* oid, int* err, uint64_t* size, time_t* mtime)
+{
+    bool found = false;
+    mutex.lock();
+    EntryMap::iterator it = entries.find(oid);
+    if (it != entries.end() && it->second.has_stat &&
+        it->second.stat_expires > now_ms())
+    {
+        *err = it->second.stat_err;
+        *size = it->second.size;
+        *mtime = it->second.mtime;
+        hit(*err);
+        found = true;
+    }
+    else
+        misses++;
+    mutex.unlock();
+    return found;
+}
+
+bool MetaCache::getXattr(const char* oid, const char* name, int* err, string* value)
+{
+    bool found = false;
+    mutex.lock();
+    EntryMap::iterator it = entries.find(oid);
+    if (it != entries.end())
+    {
+        uint64_t now = now_ms();
+        Entry & e = it->second;
+        // An object known not to exist has no xattr either.
+        if (e.has_stat && e.stat_err == -ENOENT && e.stat_expires > now)
+        {
+            *err = -ENOENT;
+            found = true;
+        }
+        else
+        {
+            map<string, Xattr>::iterator x = e.xattrs.find(name);
+            if (x != e.xattrs.end() && x->second.expires > now)
+            {
+                *err = x->second.err;
+                *value = x->second.value;
+                found = true;
+            }
+        }
+    }
+    if (found)
+        hit(*err);
+    else
+        misses++;
+    mutex.unlock();
+    return found;
+}
+
+/*
+ * Get the entry of an object, creating it if needed, and evicting the
+ * least recently used entry if the cache is full. The mutex must be held.
+ */
+MetaCache::Entry* MetaCache::touch(const char* oid)
+{
+    EntryMap::iterator it = entries.find(oid);
+    if (it != entries.end())
+    {
+        lru.splice(lru.begin(), lru, it->second.lru_pos);
+        return &it->second;
+    }
+
+    if (entries.size() >= max_entries)
+    {
+        entries.erase(lru.back());
+        lru.pop_back();
+    }
+
+    Entry & e = entries[oid];
+    e.has_stat = false;
+    lru.push_front(oid);
+    e.lru_pos = lru.begin();
+    return &e;
+}
+
+void MetaCache::putStat(const char* oid, int err, uint64_t size, time_t mtime, uint64_t gen)
+{
+    mutex.lock();
+    if (gen == generation)
+    {
+        Entry * e = touch(oid);
+        e->has_stat = true;
+        e->stat_err = err;
+        e->size = size;
+        e->mtime = mtime;
+        e->stat_expires = now_ms() + ttl_ms;
+    }
+    mutex.unlock();
+}
+
+void MetaCache::putXattr(const char* oid, const char* name, int err,
+                         const char* value, size_t len, uint64_t gen)
+{
+    // Large values are not worth the memory.
+    if (len > META_MAX_VALUE)
+        return;
+
+    mutex.lock();
+    if (gen == generation)
+    {
+        Entry * e = touch(oid);
+        uint64_t expires = now_ms() + ttl_ms;
+        if (err == -ENOENT)
+        {
+            e->has_stat = true;
+            e->stat_err = err;
+            e->size = 0;
+            e->mtime = 0;
+            e->stat_expires = expires;
+        }
+        else
+        {
+            Xattr & x = e->xattrs[name];
+            x.err = err;
+            x.value.assign(value, len);
+            x.expires = expires;
+        }
+    }
+    mutex.unlock();
+}
+
+void MetaCache::invalidate(const char* oid)
+{
+    mutex.lock();
+    generation++;
+    EntryMap::iterator it = entries.find(oid);
+    if (it != entries.end())
+    {
+        lru.erase(it->second.lru_pos);
+        entries.erase(it);
+    }
+    mutex.unlock();
+}
+
+void MetaCache::clear()
+{
+    mutex.lock();
+    generation++;
+    entries.clear();
+    lru.clear();
+    mutex.unlock();
+}
+
+ERL_NIF_TERM MetaCache::stats(ErlNifEnv* env)
+{
+    mutex.lock();
+    uint64_t h = hits;
+    uint64_t nh = negative_hits;
+    uint64_t m = misses;
+    uint64_t n = entries.size();
+    mutex.unlock();
+
+    double ratio = (h + m > 0) ? (double)h / (double)(h + m) : 0.0;
+
+    ERL_NIF_TERM term_list = enif_make_list(env, 0);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "entries"),
+                                                     enif_make_uint64(env, n)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "hit_ratio"),
+                                                     enif_make_double(env, ratio)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "negative_hits"),
+                                                     enif_make_uint64(env, nh)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "misses"),
+                                                     enif_make_uint64(env, m)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "hits"),
+                                                     enif_make_uint64(env, h)),
+                                    term_list);
+    return term_list;
+}
+
+void cache_invalidate(uint64_t id, const char* oid)
+{
+    ReadCache * cache = map_read_cache_get(id);
+    if (cache != NULL)
+    {
+        cache->invalidate(oid);
+        cache->release();
+    }
+
+    MetaCache * meta = map_meta_cache_get(id);
+    if (meta != NULL)
+    {
+        meta->invalidate(oid);
+        meta->release();
+    }
+
+    shm_cache_invalidate(id, oid);
+    disk_cache_invalidate(id, oid);
+    coalesce_invalidate(id, oid);
+}
+
+void cache_clear(uint64_t id)
+{
+    ReadCache * cache = map_read_cache_get(id);
+    if (cache != NULL)
+    {
+        cache->clear();
+        cache->release();
+    }
+
+    MetaCache * meta = map_meta_cache_get(id);
+    if (meta != NULL)
+    {
+        meta->clear();
+        meta->release();
+    }
+
+    coalesce_clear(id);
+}
+
+/********************************************************************************
+ * NIF functions
+ ********************************************************************************/
+
+// Erlang: cache_enable(IoCtx, Opts)
+ERL_NIF_TERM x_cache_enable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_cache_enable()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_is_list(env, argv[1]))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    uint64_t max_bytes = CACHE_MAX_BYTES;
+    char validate[MAX_NAME_LEN];
+    strcpy(validate, "true");
+    ERL_NIF_TERM opt;
+    if ((get_opt(env, argv[1], "max_bytes", &opt) &&
+         (!enif_get_uint64(env, opt, &max_bytes) || max_bytes == 0)) ||
+        (get_opt(env, argv[1], "validate", &opt) &&
+         !enif_get_atom(env, opt, validate, MAX_NAME_LEN, ERL_NIF_LATIN1)))
+    {
+        logger.error(MOD_NAME, func_name, "invalid options");
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx=%ld, max_bytes=%ld, validate=%s", id, max_bytes, validate);
+
+    ReadCache * cache = new ReadCache(max_bytes, strcmp(validate, "true") == 0);
+    ReadCache * old = map_read_cache_add(id, cache);
+    if (old != NULL)
+        old->release();
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: cache_disable(IoCtx)
+ERL_NIF_TERM x_cache_disable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_cache_disable()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx=%ld", id);
+
+    ReadCache * cache = map_read_cache_remove(id);
+    if (cache != NULL)
+        cache->release();
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: cache_stats(IoCtx)
+ERL_NIF_TERM x_cache_stats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_cache_stats()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    ReadCache * cache = map_read_cache_get(id);
+    if (cache == NULL)
+    {
+        return make_error_tuple(env, ENOENT);
+    }
+
+    ERL_NIF_TERM stats = cache->stats(env);
+    cache->release();
+
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            stats);
+}
+
+// Erlang: meta_cache_enable(IoCtx, Opts)
+ERL_NIF_TERM x_meta_cache_enable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_meta_cache_enable()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_is_list(env, argv[1]))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    uint64_t ttl = META_TTL_MS;
+    uint64_t max_entries = META_MAX_ENTRIES;
+    ERL_NIF_TERM opt;
+    if ((get_opt(env, argv[1], "ttl", &opt) &&
+         !enif_get_uint64(env, opt, &ttl)) ||
+        (get_opt(env, argv[1], "max_entries", &opt) &&
+         (!enif_get_uint64(env, opt, &max_entries) || max_entries == 0)))
+    {
+        logger.error(MOD_NAME, func_name, "invalid options");
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx=%ld, ttl=%ld, max_entries=%ld", id, ttl, max_entries);
+
+    MetaCache * old = map_meta_cache_add(id, new MetaCache(ttl, max_entries));
+    if (old != NULL)
+        old->release();
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: meta_cache_disable(IoCtx)
+ERL_NIF_TERM x_meta_cache_disable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_meta_cache_disable()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx=%ld", id);
+
+    MetaCache * cache = map_meta_cache_remove(id);
+    if (cache != NULL)
+        cache->release();
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: meta_cache_stats(IoCtx)
+ERL_NIF_TERM x_meta_cache_stats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_meta_cache_stats()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    MetaCache * cache = map_meta_cache_get(id);
+    if (cache == NULL)
+    {
+        return make_error_tuple(env, ENOENT);
+    }
+
+    ERL_NIF_TERM stats = cache->stats(env);
+    cache->release();
+
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            stats);
+}
@@ -6,15 +6,49 @@
 #include <errno.h>
 #include <stdio.h>
 #include <list>
+#include <map>
 
 #include "rados_nif.h"
 
 static const char* MOD_NAME = "rados_cluster";
 
+/*
+ * The connections in progress, by cluster, so that a cluster is not shut
+ * down under rados_connect(), and the background connections, so that
+ * the library is not unloaded under their threads.
+ */
+class ConnectJob;
+static XMutex connect_mutex;
+static map<uint64_t, int> connecting;
+static list<ConnectJob*> connect_jobs;
+
+/*
+ * Get a cluster to connect, and count the connection in progress. Returns
+ * NULL if there is no such cluster.
+ */
+static rados_t connect_begin(uint64_t id)
+{
+    connect_mutex.lock();
+    rados_t cluster = map_cluster_get(id);
+    if (cluster != NULL)
+        connecting[id]++;
+    connect_mutex.unlock();
+    return cluster;
+}
+
+static void connect_end(uint64_t id)
+{
+    connect_mutex.lock();
+    map<uint64_t, int>::iterator it = connecting.find(id);
+    if (it != connecting.end() && --it->second == 0)
+        connecting.erase(it);
+    connect_mutex.unlock();
+}
+
 ERL_NIF_TERM x_create(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     const char * func_name = "x_create()";
-    logger.debug(MOD_NAME, func_name, "Entered");
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "Entered");
     logger.flush();
 
     rados_t cluster;
@@ -25,13 +59,13 @@ ERL_NIF_TERM x_create(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return make_error_tuple(env, -err);
     }
 
-    logger.debug(MOD_NAME, func_name, "cluster created");
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "cluster created");
     logger.flush();
 
     uint64_t id = new_id();
     map_cluster_add(id, cluster);
 
-    logger.debug(MOD_NAME, func_name, "cluster added to local map: %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "cluster added to local map: %ld", id);
     logger.flush();
 
     return enif_make_tuple2(env, 
@@ -42,7 +76,7 @@ ERL_NIF_TERM x_create(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 ERL_NIF_TERM x_create_with_user(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     const char * func_name = "x_create_with_user()";
-    logger.debug(MOD_NAME, func_name, "Entered");
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "Entered");
 
     char name[MAX_NAME_LEN];
     memset(name, 0, MAX_NAME_LEN);
@@ -63,7 +97,7 @@ ERL_NIF_TERM x_create_with_user(ErlNifEnv* env, int argc, const ERL_NIF_TERM arg
     uint64_t id = new_id();
     map_cluster_add(id, cluster);
 
-    logger.debug(MOD_NAME, func_name, "cluster : %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "cluster : %ld", id);
 
     return enif_make_tuple2(env,
                             enif_make_atom(env, "ok"),
@@ -73,7 +107,7 @@ ERL_NIF_TERM x_create_with_user(ErlNifEnv* env, int argc, const ERL_NIF_TERM arg
 ERL_NIF_TERM x_conf_read_file(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     const char * func_name = "x_conf_read_file()";
-    logger.debug(MOD_NAME, func_name, "Entered");
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "Entered");
 
     uint64_t id;
     if (!enif_get_uint64(env, argv[0], &id))
@@ -82,7 +116,7 @@ ERL_NIF_TERM x_conf_read_file(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "cluster : %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "cluster : %ld", id);
 
     rados_t cluster = map_cluster_get(id);
     if (cluster == NULL)
@@ -104,7 +138,7 @@ ERL_NIF_TERM x_conf_read_file(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[
 ERL_NIF_TERM x_conf_read_file2(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     const char * func_name = "x_conf_read_file2()";
-    logger.debug(MOD_NAME, func_name, "Entered");
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "Entered");
     logger.flush();
 
     uint64_t id;
@@ -117,7 +151,7 @@ ERL_NIF_TERM x_conf_read_file2(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "cluster : %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "cluster : %ld", id);
     logger.flush();
 
     rados_t cluster = map_cluster_get(id);
@@ -127,7 +161,7 @@ ERL_NIF_TERM x_conf_read_file2(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "cluster found: %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "cluster found: %ld", id);
     logger.flush();
 
     int err = rados_conf_read_file(cluster, conf_file);
@@ -137,7 +171,7 @@ ERL_NIF_TERM x_conf_read_file2(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
         return make_error_tuple(env, -err);
     }
 
-    logger.debug(MOD_NAME, func_name, "config file read: %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "config file read: %ld", id);
     logger.flush();
 
     return enif_make_atom(env, "ok");
@@ -146,7 +180,7 @@ ERL_NIF_TERM x_conf_read_file2(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
 ERL_NIF_TERM x_conf_set(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     const char * func_name = "x_conf_set()";
-    logger.debug(MOD_NAME, func_name, "Entered");
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "Entered");
 
     uint64_t id;
     char option[MAX_NAME_LEN];
@@ -161,7 +195,7 @@ ERL_NIF_TERM x_conf_set(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "cluster : %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "cluster : %ld", id);
 
     rados_t cluster = map_cluster_get(id);
     if (cluster == NULL)
@@ -182,7 +216,7 @@ ERL_NIF_TERM x_conf_set(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 ERL_NIF_TERM x_connect(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     const char * func_name = "x_connect()";
-    logger.debug(MOD_NAME, func_name, "Entered");
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "Entered");
 
     uint64_t id;
     if (!enif_get_uint64(env, argv[0], &id))
@@ -191,9 +225,9 @@ ERL_NIF_TERM x_connect(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "cluster : %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "cluster : %ld", id);
 
-    rados_t cluster = map_cluster_get(id);
+    rados_t cluster = connect_begin(id);
     if (cluster == NULL)
     {
         logger.error(MOD_NAME, func_name, "cluster non-existing : %ld", id);
@@ -201,6 +235,7 @@ ERL_NIF_TERM x_connect(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
     }
 
     int err = rados_connect(cluster);
+    connect_end(id);
     if (err < 0) 
     {
         logger.error(MOD_NAME, func_name, "failed to connect to cluster %ld: %s", id, strerror(-err));
@@ -210,10 +245,204 @@ ERL_NIF_TERM x_connect(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
     return enif_make_atom(env, "ok");
 }
 
+/*
+ * A connection to a cluster made in the background. Each connection has
+ * its own thread, rather than a worker of the work pool, since it can
+ * block for as long as the mount timeout, and the connections to several
+ * clusters must go in parallel.
+ *
+ * The result is sent to the owner process, tagged with rados_connect:
+ *
+ *   ok                   the cluster is connected
+ *   {error, Reason}      the connection failed
+ */
+class ConnectJob : public RadosJob
+{
+public:
+    ConnectJob(const ErlNifPid& pid, uint64_t cluster_id, rados_t cluster) :
+        RadosJob("rados_connect", pid),
+        cluster_id(cluster_id),
+        cluster(cluster),
+        finished(0)
+    {
+    }
+
+    /*
+     * Start the thread. The connection must have been counted by
+     * connect_begin(), connect_mutex must be held.
+     */
+    int start()
+    {
+        keep();
+        int err = enif_thread_create((char *)"rados_connect", &tid, threadMain, this, NULL);
+        if (err != 0)
+        {
+            release();
+            return -err;
+        }
+        connect_jobs.push_back(this);
+        keep();
+        return 0;
+    }
+
+    bool isFinished() { return finished != 0; }
+
+    /*
+     * Wait for the thread, and drop its reference.
+     */
+    void join()
+    {
+        enif_thread_join(tid, NULL);
+        release();
+    }
+
+private:
+    static void* threadMain(void* arg)
+    {
+        ConnectJob * job = (ConnectJob *)arg;
+        job->run();
+        __sync_synchronize();
+        job->finished = 1;
+        job->release();
+        return NULL;
+    }
+
+    void run()
+    {
+        const char * func_name = "ConnectJob::run()";
+
+        ErlNifEnv * msg_env = enif_alloc_env();
+        int err = rados_connect(cluster);
+
+        // The cluster can be shut down once the owner has the result.
+        connect_end(cluster_id);
+        if (err < 0)
+        {
+            logger.error(MOD_NAME, func_name, "failed to connect to cluster %ld: %s", cluster_id, strerror(-err));
+            send(msg_env,
+                 enif_make_tuple2(msg_env,
+                                  enif_make_atom(msg_env, "error"),
+                                  enif_make_string(msg_env, strerror(-err), ERL_NIF_LATIN1)));
+        }
+        else
+        {
+            XLOG_DEBUG(logger, MOD_NAME, func_name, "connected to cluster %ld", cluster_id);
+            send(msg_env, enif_make_atom(msg_env, "ok"));
+        }
+        enif_free_env(msg_env);
+    }
+
+    uint64_t cluster_id;
+    rados_t cluster;
+    ErlNifTid tid;
+    volatile int finished;
+};
+
+/*
+ * Join the threads of the background connections that are over. Must be
+ * called with connect_mutex held.
+ */
+static void connect_reap(vector<ConnectJob*>& done)
+{
+    list<ConnectJob*>::iterator it = connect_jobs.begin();
+    while (it != connect_jobs.end())
+    {
+        if ((*it)->isFinished())
+        {
+            done.push_back(*it);
+            it = connect_jobs.erase(it);
+        }
+        else
+            it++;
+    }
+}
+
+/*
+ * Wait for the background connections, when the library is unloaded.
+ * rados_connect() gives up after the mount timeout.
+ */
+void connect_shutdown()
+{
+    connect_mutex.lock();
+    vector<ConnectJob*> jobs(connect_jobs.begin(), connect_jobs.end());
+    connect_jobs.clear();
+    connect_mutex.unlock();
+
+    for (size_t i = 0; i < jobs.size(); i++)
+        jobs[i]->join();
+}
+
+// Erlang: connect_async(Cluster, Pid, Opts)
+ERL_NIF_TERM x_connect_async(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_connect_async()";
+
+    uint64_t id;
+    ErlNifPid pid;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_get_local_pid(env, argv[1], &pid) ||
+        !enif_is_list(env, argv[2]))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    unsigned timeout = 0;
+    ERL_NIF_TERM opt;
+    if (get_opt(env, argv[2], "timeout", &opt) &&
+        (!enif_get_uint(env, opt, &timeout) || timeout == 0))
+    {
+        logger.error(MOD_NAME, func_name, "invalid options");
+        return enif_make_badarg(env);
+    }
+
+    rados_t cluster = connect_begin(id);
+    if (cluster == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "cluster non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    if (timeout > 0)
+    {
+        char value[32];
+        snprintf(value, sizeof(value), "%u", timeout);
+        int err = rados_conf_set(cluster, "client_mount_timeout", value);
+        if (err < 0)
+        {
+            connect_end(id);
+            logger.error(MOD_NAME, func_name, "failed to set mount timeout: %s", strerror(-err));
+            return make_error_tuple(env, -err);
+        }
+    }
+
+    ConnectJob * job = new ConnectJob(pid, id, cluster);
+    vector<ConnectJob*> done;
+    connect_mutex.lock();
+    int err = job->start();
+    connect_reap(done);
+    connect_mutex.unlock();
+    for (size_t i = 0; i < done.size(); i++)
+        done[i]->join();
+    if (err < 0)
+    {
+        connect_end(id);
+        job->release();
+        logger.error(MOD_NAME, func_name, "unable to start connect thread: %s", strerror(-err));
+        return make_error_tuple(env, -err);
+    }
+
+    ERL_NIF_TERM ret = enif_make_tuple2(env,
+                                        enif_make_atom(env, "ok"),
+                                        enif_make_uint64(env, job->getId()));
+    job->release();
+    return ret;
+}
+
 ERL_NIF_TERM x_shutdown(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     const char * func_name = "x_shutdown()";
-    logger.debug(MOD_NAME, func_name, "Entered");
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "Entered");
 
     uint64_t id;
     if (!enif_get_uint64(env, argv[0], &id))
@@ -222,27 +451,34 @@ ERL_NIF_TERM x_shutdown(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "cluster : %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "cluster : %ld", id);
     logger.flush();
 
+    // The cluster is taken out of the map with connect_mutex held, so that
+    // no connection can start on it afterwards.
+    connect_mutex.lock();
     rados_t cluster = map_cluster_get(id);
     if (cluster == NULL)
     {
+        connect_mutex.unlock();
         logger.error(MOD_NAME, func_name, "cluster non-existing : %ld", id);
         return enif_make_badarg(env);
     }
+    if (connecting.count(id) > 0)
+    {
+        connect_mutex.unlock();
+        logger.error(MOD_NAME, func_name, "cluster %ld is connecting", id);
+        return make_error_tuple(env, EBUSY);
+    }
+    map_cluster_remove(id);
+    connect_mutex.unlock();
 
-    logger.debug(MOD_NAME, func_name, "found cluster: %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "cluster erased: %ld", id);
     logger.flush();
 
     rados_shutdown(cluster);
 
-    logger.debug(MOD_NAME, func_name, "cluster shutdown: %ld", id);
-    logger.flush();
-    
-    map_cluster_remove(id);
-
-    logger.debug(MOD_NAME, func_name, "cluster erased: %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "cluster shutdown: %ld", id);
     logger.flush();
 
     return enif_make_atom(env, "ok");
@@ -259,7 +495,7 @@ ERL_NIF_TERM x_get_instance_id(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "cluster : %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "cluster : %ld", id);
 
     rados_t cluster = map_cluster_get(id);
     if (cluster == NULL)
@@ -310,7 +546,7 @@ ERL_NIF_TERM x_pool_list(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "cluster : %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "cluster : %ld", id);
 
     rados_t cluster = map_cluster_get(id);
     if (cluster == NULL)
@@ -379,7 +615,7 @@ ERL_NIF_TERM x_cluster_stat(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "cluster : %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "cluster : %ld", id);
 
     rados_t cluster = map_cluster_get(id);
     if (cluster == NULL)
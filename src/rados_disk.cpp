@@ -0,0 +1,874 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <set>
+#include <sys/stat.h>
+
+#include "rados_disk.h"
+#include "fsutil.hpp"
+
+static const char* MOD_NAME = "rados_disk";
+
+#define DISK_MAX_BYTES      (1024ULL * 1024 * 1024)
+
+/*
+ * The disk cache of this instance, and the io contexts using it.
+ */
+static DiskCache *        disk_cache = NULL;
+static set<uint64_t>      disk_ioctx;
+static XMutex             disk_mutex;
+
+static uint64_t fnv_hash(const char* data, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * The key of an object is made of the fsid of the cluster, as the pool ids
+ * of different clusters collide, the pool id, the snapshot read and the
+ * object name.
+ */
+static string make_key(rados_ioctx_t io, uint64_t snap, const char* oid)
+{
+    char fsid[64];
+    if (rados_cluster_fsid(rados_ioctx_get_cluster(io), fsid, sizeof(fsid)) < 0)
+        fsid[0] = '\0';
+    char prefix[128];
+    snprintf(prefix, sizeof(prefix), "%s:%lld:%llu:",
+             fsid, (long long)rados_ioctx_get_id(io), (unsigned long long)snap);
+    return string(prefix) + oid;
+}
+
+/*
+ * The mtime of an object in nanoseconds, as the seconds of rados_stat()
+ * do not tell apart two writes in the same second.
+ */
+static int stat_mtime(rados_ioctx_t io, const char* oid, uint64_t* mtime)
+{
+    uint64_t size;
+    struct timespec ts;
+    int err = rados_stat2(io, oid, &size, &ts);
+    if (err == 0)
+        *mtime = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    return err;
+}
+
+static int write_all(int fd, const char* data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int pread_all(int fd, char* data, size_t len, off_t offset)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = pread(fd, data + done, len - done, offset + done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (n == 0)
+            return -EIO;
+        done += n;
+    }
+    return 0;
+}
+
+/*
+ * Work item writing a range to the cache. It holds a reference on the
+ * buffer, which is shared with the binary returned by the read.
+ */
+class DiskStoreItem : public XWorkItem
+{
+public:
+    DiskStoreItem(DiskCache* cache, const string& key, read_buf_t* buf,
+                  uint64_t offset, size_t len, uint64_t version, uint64_t mtime, uint64_t gen) :
+        cache(cache), key(key), buf(buf), offset(offset), len(len),
+        version(version), mtime(mtime), gen(gen)
+    {
+        cache->keep();
+        cache->storeQueued();
+        enif_keep_resource(buf);
+    }
+
+    ~DiskStoreItem()
+    {
+        enif_release_resource(buf);
+        cache->storeDone();
+        cache->release();
+    }
+
+    Status run()
+    {
+        cache->store(key, buf, offset, len, version, mtime, gen);
+        return DONE;
+    }
+
+private:
+    DiskCache * cache;
+    string key;
+    read_buf_t * buf;
+    uint64_t offset;
+    size_t len;
+    uint64_t version;
+    uint64_t mtime;
+    uint64_t gen;
+};
+
+DiskCache::DiskCache(const char* dir, uint64_t max_bytes, int validate) :
+    dir(dir),
+    max_bytes(max_bytes),
+    bytes(0),
+    validate(validate),
+    generation(0),
+    hits(0),
+    misses(0),
+    stale(0),
+    evictions(0),
+    write_errors(0),
+    pending_stores(0),
+    refs(1)
+{
+}
+
+DiskCache::~DiskCache()
+{
+    // The files are kept for the next time the cache is opened.
+    for (EntryMap::iterator it = entries.begin(); it != entries.end(); it++)
+        delete it->second;
+}
+
+void DiskCache::keep()
+{
+    __sync_add_and_fetch(&refs, 1);
+}
+
+void DiskCache::release()
+{
+    if (__sync_sub_and_fetch(&refs, 1) == 0)
+        delete this;
+}
+
+void DiskCache::storeQueued()
+{
+    __sync_add_and_fetch(&pending_stores, 1);
+}
+
+void DiskCache::storeDone()
+{
+    __sync_sub_and_fetch(&pending_stores, 1);
+}
+
+string DiskCache::fileName(const string& key, uint64_t offset, size_t len)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx-%llx-%llx",
+             (unsigned long long)fnv_hash(key.data(), key.size()),
+             (unsigned long long)offset, (unsigned long long)len);
+    return name;
+}
+
+/*
+ * Add a cache file found in the directory to the index. Files which are
+ * not valid, such as the leftovers of an interrupted write, are removed.
+ */
+void DiskCache::loadFile(const char* name)
+{
+    string path = dir + "/" + name;
+    bool valid = false;
+    disk_file_hdr_t hdr;
+    string key;
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        struct stat st;
+        if (name[0] != '.' &&
+            pread_all(fd, (char *)&hdr, sizeof(hdr), 0) == 0 &&
+            hdr.magic == DISK_MAGIC && hdr.key_len < MAX_NAME_LEN + 128 &&
+            fstat(fd, &st) == 0 &&
+            (uint64_t)st.st_size == sizeof(hdr) + hdr.key_len + hdr.data_len)
+        {
+            key.resize(hdr.key_len);
+            valid = pread_all(fd, &key[0], hdr.key_len, sizeof(hdr)) == 0 &&
+                    fileName(key, hdr.offset, hdr.len) == name;
+        }
+        close(fd);
+    }
+
+    if (!valid)
+    {
+        unlink(path.c_str());
+        return;
+    }
+
+    Entry * e = new Entry;
+    e->key = key;
+    e->file = name;
+    e->offset = hdr.offset;
+    e->len = hdr.len;
+    e->data_len = hdr.data_len;
+    e->version = hdr.version;
+    e->mtime = hdr.mtime;
+
+    list<string> unlinks;
+    mutex.lock();
+    insert(e, unlinks);
+    mutex.unlock();
+    for (list<string>::iterator it = unlinks.begin(); it != unlinks.end(); it++)
+        unlink((dir + "/" + *it).c_str());
+}
+
+int DiskCache::open()
+{
+    const char * func_name = "DiskCache::open()";
+
+    if (FSUtil::mkdir(dir.c_str(), 0700) < 0)
+    {
+        int err = errno;
+        logger.error(MOD_NAME, func_name, "unable to create %s: %s", dir.c_str(), strerror(err));
+        return -err;
+    }
+
+    DIR * d = opendir(dir.c_str());
+    if (d == NULL)
+    {
+        int err = errno;
+        logger.error(MOD_NAME, func_name, "unable to open %s: %s", dir.c_str(), strerror(err));
+        return -err;
+    }
+    struct dirent * de;
+    while ((de = readdir(d)) != NULL)
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        loadFile(de->d_name);
+    }
+    closedir(d);
+
+    XLOG_INFO(logger, MOD_NAME, func_name, "opened %s, %ld entries, %ld bytes",
+                dir.c_str(), entries.size(), bytes);
+    return 0;
+}
+
+/*
+ * Find an entry holding the range, and copy it. Same range semantics as
+ * the memory read cache.
+ */
+bool DiskCache::lookup(const string& key, size_t len, uint64_t offset, Entry* found)
+{
+    bool ok = false;
+    mutex.lock();
+    pair<EntryMap::iterator, EntryMap::iterator> range = entries.equal_range(key);
+    for (EntryMap::iterator it = range.first; it != range.second; it++)
+    {
+        Entry * e = it->second;
+        if (offset < e->offset || offset + len > e->offset + e->len)
+            continue;
+        *found = *e;
+        lru.splice(lru.begin(), lru, e->lru_pos);
+        ok = true;
+        break;
+    }
+    mutex.unlock();
+    return ok;
+}
+
+/*
+ * Add an entry, replacing the entry of the same range, and evict the
+ * least recently used entries beyond the size of the cache. The files to
+ * remove are added to unlinks. The mutex must be held.
+ */
+void DiskCache::insert(Entry* e, list<string>& unlinks)
+{
+    pair<EntryMap::iterator, EntryMap::iterator> range = entries.equal_range(e->key);
+    for (EntryMap::iterator it = range.first; it != range.second; it++)
+    {
+        if (it->second->file == e->file)
+        {
+            // Same file, it has already been replaced.
+            Entry * old = it->second;
+            bytes -= old->data_len;
+            lru.erase(old->lru_pos);
+            entries.erase(it);
+            delete old;
+            break;
+        }
+    }
+
+    lru.push_front(e);
+    e->lru_pos = lru.begin();
+    entries.insert(make_pair(e->key, e));
+    bytes += e->data_len;
+
+    while (bytes > max_bytes && !lru.empty())
+    {
+        Entry * old = lru.back();
+        pair<EntryMap::iterator, EntryMap::iterator> r = entries.equal_range(old->key);
+        for (EntryMap::iterator it = r.first; it != r.second; it++)
+        {
+            if (it->second == old)
+            {
+                evict(it, unlinks);
+                evictions++;
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Remove an entry. The mutex must be held.
+ */
+void DiskCache::evict(EntryMap::iterator it, list<string>& unlinks)
+{
+    Entry * e = it->second;
+    bytes -= e->data_len;
+    lru.erase(e->lru_pos);
+    entries.erase(it);
+    unlinks.push_back(e->file);
+    delete e;
+}
+
+/*
+ * Remove the entry of a file, if it is still in the index.
+ */
+void DiskCache::remove(const string& key, const string& file)
+{
+    list<string> unlinks;
+    mutex.lock();
+    pair<EntryMap::iterator, EntryMap::iterator> range = entries.equal_range(key);
+    for (EntryMap::iterator it = range.first; it != range.second; it++)
+    {
+        if (it->second->file == file)
+        {
+            evict(it, unlinks);
+            break;
+        }
+    }
+    mutex.unlock();
+    for (list<string>::iterator it = unlinks.begin(); it != unlinks.end(); it++)
+        unlink((dir + "/" + *it).c_str());
+}
+
+void DiskCache::invalidate(rados_ioctx_t io, uint64_t snap, const char* oid)
+{
+    string key = make_key(io, snap, oid);
+    list<string> unlinks;
+    mutex.lock();
+    generation++;
+    pair<EntryMap::iterator, EntryMap::iterator> range = entries.equal_range(key);
+    EntryMap::iterator it = range.first;
+    while (it != range.second)
+        evict(it++, unlinks);
+    mutex.unlock();
+    for (list<string>::iterator i = unlinks.begin(); i != unlinks.end(); i++)
+        unlink((dir + "/" + *i).c_str());
+}
+
+/*
+ * Read a range of an entry from its file. The file is checked against
+ * the entry, since it may have been replaced since the lookup.
+ */
+int DiskCache::readFile(const Entry& e, uint64_t offset, size_t len, read_buf_t** buf)
+{
+    string path = dir + "/" + e.file;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return -errno;
+
+    disk_file_hdr_t hdr;
+    int err = pread_all(fd, (char *)&hdr, sizeof(hdr), 0);
+    if (err == 0 &&
+        (hdr.magic != DISK_MAGIC || hdr.key_len != e.key.size() ||
+         hdr.version != e.version || hdr.mtime != e.mtime ||
+         hdr.offset != e.offset || hdr.len != e.len || hdr.data_len != e.data_len))
+        err = -ESTALE;
+
+    size_t start = offset - e.offset;
+    size_t n = 0;
+    if (start < e.data_len)
+        n = (start + len <= e.data_len) ? len : e.data_len - start;
+
+    read_buf_t * b = NULL;
+    if (err == 0)
+    {
+        b = read_buf_alloc(n);
+        if (b == NULL)
+            err = -ENOMEM;
+    }
+    if (err == 0 && n > 0)
+        err = pread_all(fd, b->data, n, sizeof(hdr) + hdr.key_len + start);
+    close(fd);
+
+    if (err < 0)
+    {
+        if (b != NULL)
+            enif_release_resource(b);
+        return err;
+    }
+    *buf = b;
+    return 0;
+}
+
+void DiskCache::store(const string& key, read_buf_t* buf, uint64_t offset, size_t len,
+                      uint64_t version, uint64_t mtime, uint64_t gen)
+{
+    const char * func_name = "DiskCache::store()";
+
+    string file = fileName(key, offset, len);
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), ".tmp-%lx", (unsigned long)pthread_self());
+    string tmp_path = dir + "/" + tmp;
+
+    disk_file_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = DISK_MAGIC;
+    hdr.key_len = key.size();
+    hdr.version = version;
+    hdr.mtime = mtime;
+    hdr.offset = offset;
+    hdr.len = len;
+    hdr.data_len = buf->size;
+
+    // Write to a temporary file first, so that a file is either complete
+    // or absent.
+    int err = 0;
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        err = -errno;
+    if (err == 0)
+        err = write_all(fd, (const char*)&hdr, sizeof(hdr));
+    if (err == 0)
+        err = write_all(fd, key.data(), key.size());
+    if (err == 0)
+        err = write_all(fd, buf->data, buf->size);
+    if (fd >= 0)
+        close(fd);
+
+    mutex.lock();
+    // The object may have been written while it was being read.
+    bool current = (gen == generation);
+    if (err == 0 && current &&
+        rename(tmp_path.c_str(), (dir + "/" + file).c_str()) < 0)
+        err = -errno;
+    if (err < 0 || !current)
+    {
+        if (err < 0)
+            write_errors++;
+        mutex.unlock();
+        unlink(tmp_path.c_str());
+        if (err < 0)
+            logger.error(MOD_NAME, func_name, "unable to write %s: %s", file.c_str(), strerror(-err));
+        return;
+    }
+
+    Entry * e = new Entry;
+    e->key = key;
+    e->file = file;
+    e->offset = offset;
+    e->len = len;
+    e->data_len = buf->size;
+    e->version = version;
+    e->mtime = mtime;
+
+    list<string> unlinks;
+    insert(e, unlinks);
+    mutex.unlock();
+
+    for (list<string>::iterator it = unlinks.begin(); it != unlinks.end(); it++)
+        unlink((dir + "/" + *it).c_str());
+}
+
+ERL_NIF_TERM DiskCache::read(ErlNifEnv* env, rados_ioctx_t io, uint64_t snap,
+                             const char* oid, size_t len, uint64_t offset)
+{
+    const char * func_name = "DiskCache::read()";
+
+    string key = make_key(io, snap, oid);
+    read_buf_t * buf = NULL;
+
+    Entry e;
+    if (lookup(key, len, offset, &e))
+    {
+        int err = 0;
+        if (validate == DISK_VALIDATE_VERSION)
+        {
+            rados_read_op_t op = rados_create_read_op();
+            rados_read_op_assert_version(op, e.version);
+            err = rados_read_op_operate(op, io, oid, LIBRADOS_OPERATION_NOFLAG);
+            rados_release_read_op(op);
+        }
+        else if (validate == DISK_VALIDATE_MTIME)
+        {
+            uint64_t mtime;
+            err = stat_mtime(io, oid, &mtime);
+            if (err == 0 && mtime != e.mtime)
+                err = -ESTALE;
+        }
+        if (err == 0)
+            err = readFile(e, offset, len, &buf);
+        if (err < 0)
+        {
+            XLOG_DEBUG(logger, MOD_NAME, func_name, "dropping %s for %s: %s",
+                         e.file.c_str(), oid, strerror(-err));
+            __sync_add_and_fetch(&stale, 1);
+            remove(e.key, e.file);
+        }
+    }
+
+    if (buf != NULL)
+    {
+        __sync_add_and_fetch(&hits, 1);
+        ERL_NIF_TERM ret;
+        if (buf->size > 0)
+            ret = enif_make_tuple2(env,
+                                   enif_make_atom(env, "ok"),
+                                   read_buf_make_binary(env, buf, 0, buf->size));
+        else
+            ret = enif_make_atom(env, "eof");
+        enif_release_resource(buf);
+        return ret;
+    }
+
+    __sync_add_and_fetch(&misses, 1);
+
+    buf = read_buf_alloc(len);
+    if (buf == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "unable to alloc %ld bytes", len);
+        return make_error_tuple(env, ENOMEM);
+    }
+
+    mutex.lock();
+    uint64_t gen = generation;
+    mutex.unlock();
+
+    // The mtime is taken before the read, so that a write in between
+    // makes the entry look stale rather than current.
+    int err = 0;
+    uint64_t version = 0;
+    uint64_t mtime = 0;
+    if (validate == DISK_VALIDATE_MTIME)
+        err = stat_mtime(io, oid, &mtime);
+    if (err == 0)
+    {
+        if (validate == DISK_VALIDATE_VERSION)
+            err = read_versioned(io, oid, buf->data, len, offset, &version);
+        else
+            err = rados_read(io, oid, buf->data, len, offset);
+    }
+    if (err < 0)
+    {
+        enif_release_resource(buf);
+        logger.error(MOD_NAME, func_name, "read failed for %s: %s", oid, strerror(-err));
+        return make_error_tuple(env, -err);
+    }
+
+    if ((size_t)err < len / 2)
+    {
+        read_buf_t * small = read_buf_alloc(err);
+        if (small != NULL)
+        {
+            memcpy(small->data, buf->data, err);
+            enif_release_resource(buf);
+            buf = small;
+        }
+    }
+    buf->size = err;
+
+    if (len <= max_bytes / 8)
+        work_pool->submit(new DiskStoreItem(this, key, buf, offset, len, version, mtime, gen));
+
+    ERL_NIF_TERM ret;
+    if (err > 0)
+        ret = enif_make_tuple2(env,
+                               enif_make_atom(env, "ok"),
+                               read_buf_make_binary(env, buf, 0, err));
+    else
+        ret = enif_make_atom(env, "eof");
+    enif_release_resource(buf);
+    return ret;
+}
+
+ERL_NIF_TERM DiskCache::stats(ErlNifEnv* env)
+{
+    mutex.lock();
+    uint64_t b = bytes;
+    uint64_t n = entries.size();
+    uint64_t e = evictions;
+    uint64_t we = write_errors;
+    mutex.unlock();
+
+    uint64_t h = hits;
+    uint64_t m = misses;
+    uint64_t p = pending_stores;
+    double ratio = (h + m > 0) ? (double)h / (double)(h + m) : 0.0;
+
+    ERL_NIF_TERM term_list = enif_make_list(env, 0);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "pending_stores"),
+                                                     enif_make_uint64(env, p)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "write_errors"),
+                                                     enif_make_uint64(env, we)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "max_bytes"),
+                                                     enif_make_uint64(env, max_bytes)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "bytes"),
+                                                     enif_make_uint64(env, b)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "entries"),
+                                                     enif_make_uint64(env, n)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "evictions"),
+                                                     enif_make_uint64(env, e)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "stale"),
+                                                     enif_make_uint64(env, stale)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "hit_ratio"),
+                                                     enif_make_double(env, ratio)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "misses"),
+                                                     enif_make_uint64(env, m)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "hits"),
+                                                     enif_make_uint64(env, h)),
+                                    term_list);
+    return term_list;
+}
+
+DiskCache* disk_cache_get()
+{
+    disk_mutex.lock();
+    DiskCache * cache = disk_cache;
+    if (cache != NULL)
+        cache->keep();
+    disk_mutex.unlock();
+    return cache;
+}
+
+bool disk_cache_enabled(uint64_t id)
+{
+    disk_mutex.lock();
+    bool enabled = disk_cache != NULL && disk_ioctx.count(id) > 0;
+    disk_mutex.unlock();
+    return enabled;
+}
+
+void disk_cache_invalidate(uint64_t id, const char* oid)
+{
+    if (!disk_cache_enabled(id))
+        return;
+    rados_ioctx_t io = map_ioctx_get(id);
+    DiskCache * cache = disk_cache_get();
+    if (cache != NULL && io != NULL)
+        cache->invalidate(io, LIBRADOS_SNAP_HEAD, oid);
+    if (cache != NULL)
+        cache->release();
+}
+
+void disk_cache_forget(uint64_t id)
+{
+    disk_mutex.lock();
+    disk_ioctx.erase(id);
+    disk_mutex.unlock();
+}
+
+/********************************************************************************
+ * NIF functions
+ ********************************************************************************/
+
+// Erlang: disk_cache_open(Dir, Opts)
+ERL_NIF_TERM x_disk_cache_open(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_disk_cache_open()";
+
+    char dir[MAX_FILE_NAME_LEN];
+    memset(dir, 0, MAX_FILE_NAME_LEN);
+    if (!get_name_arg(env, argv[0], dir, MAX_FILE_NAME_LEN) ||
+        !enif_is_list(env, argv[1]))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    uint64_t max_bytes = DISK_MAX_BYTES;
+    char validate[MAX_NAME_LEN];
+    strcpy(validate, "version");
+    ERL_NIF_TERM opt;
+    if ((get_opt(env, argv[1], "max_bytes", &opt) &&
+         (!enif_get_uint64(env, opt, &max_bytes) || max_bytes == 0)) ||
+        (get_opt(env, argv[1], "validate", &opt) &&
+         !enif_get_atom(env, opt, validate, MAX_NAME_LEN, ERL_NIF_LATIN1)))
+    {
+        logger.error(MOD_NAME, func_name, "invalid options");
+        return enif_make_badarg(env);
+    }
+
+    int mode;
+    if (strcmp(validate, "version") == 0)
+        mode = DISK_VALIDATE_VERSION;
+    else if (strcmp(validate, "mtime") == 0)
+        mode = DISK_VALIDATE_MTIME;
+    else if (strcmp(validate, "none") == 0)
+        mode = DISK_VALIDATE_NONE;
+    else
+    {
+        logger.error(MOD_NAME, func_name, "invalid validation : %s", validate);
+        return enif_make_badarg(env);
+    }
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "dir=%s, max_bytes=%ld, validate=%s", dir, max_bytes, validate);
+
+    DiskCache * cache = new DiskCache(dir, max_bytes, mode);
+    int err = cache->open();
+    if (err < 0)
+    {
+        cache->release();
+        return make_error_tuple(env, -err);
+    }
+
+    disk_mutex.lock();
+    DiskCache * old = disk_cache;
+    disk_cache = cache;
+    disk_mutex.unlock();
+    if (old != NULL)
+        old->release();
+
+    return enif_make_atom(env, "ok");
+}
+
+void disk_cache_shutdown()
+{
+    disk_mutex.lock();
+    DiskCache * cache = disk_cache;
+    disk_cache = NULL;
+    disk_ioctx.clear();
+    disk_mutex.unlock();
+
+    if (cache != NULL)
+        cache->release();
+}
+
+// Erlang: disk_cache_close()
+ERL_NIF_TERM x_disk_cache_close(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    disk_cache_shutdown();
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: disk_cache_enable(IoCtx)
+ERL_NIF_TERM x_disk_cache_enable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_disk_cache_enable()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    if (map_ioctx_get(id) == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    disk_mutex.lock();
+    bool open = disk_cache != NULL;
+    if (open)
+        disk_ioctx.insert(id);
+    disk_mutex.unlock();
+
+    if (!open)
+        return make_error_tuple(env, ENOENT);
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: disk_cache_disable(IoCtx)
+ERL_NIF_TERM x_disk_cache_disable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_disk_cache_disable()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    disk_cache_forget(id);
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: disk_cache_stats()
+ERL_NIF_TERM x_disk_cache_stats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    DiskCache * cache = disk_cache_get();
+    if (cache == NULL)
+    {
+        return make_error_tuple(env, ENOENT);
+    }
+
+    ERL_NIF_TERM stats = cache->stats(env);
+    cache->release();
+
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            stats);
+}
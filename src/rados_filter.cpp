@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+#include <fnmatch.h>
+
+#include "rados_nif.h"
+
+ObjectFilter::ObjectFilter() :
+    refs(1),
+    active(false),
+    has_regex(false)
+{
+}
+
+ObjectFilter::~ObjectFilter()
+{
+    if (has_regex)
+        regfree(&regex);
+}
+
+void ObjectFilter::keep()
+{
+    __sync_add_and_fetch(&refs, 1);
+}
+
+void ObjectFilter::release()
+{
+    if (__sync_sub_and_fetch(&refs, 1) == 0)
+        delete this;
+}
+
+int ObjectFilter::parse(ErlNifEnv* env, ERL_NIF_TERM opts)
+{
+    char buf[MAX_NAME_LEN];
+    ERL_NIF_TERM opt;
+
+    if (get_opt(env, opts, "prefix", &opt))
+    {
+        if (!get_name_arg(env, opt, buf, MAX_NAME_LEN))
+            return 0;
+        prefix = buf;
+        active = true;
+    }
+    if (get_opt(env, opts, "suffix", &opt))
+    {
+        if (!get_name_arg(env, opt, buf, MAX_NAME_LEN))
+            return 0;
+        suffix = buf;
+        active = true;
+    }
+    if (get_opt(env, opts, "glob", &opt))
+    {
+        if (!get_name_arg(env, opt, buf, MAX_NAME_LEN))
+            return 0;
+        glob = buf;
+        active = true;
+    }
+    if (get_opt(env, opts, "regex", &opt))
+    {
+        if (!get_name_arg(env, opt, buf, MAX_NAME_LEN) ||
+            has_regex ||
+            regcomp(&regex, buf, REG_EXTENDED | REG_NOSUB) != 0)
+            return 0;
+        has_regex = true;
+        active = true;
+    }
+    return 1;
+}
+
+bool ObjectFilter::isActive()
+{
+    return active;
+}
+
+bool ObjectFilter::match(const char* name, size_t len)
+{
+    if (!active)
+        return true;
+
+    // The cheap tests come first.
+    if (len < prefix.size() || memcmp(name, prefix.data(), prefix.size()) != 0)
+        return false;
+    if (len < suffix.size() || memcmp(name + len - suffix.size(), suffix.data(), suffix.size()) != 0)
+        return false;
+
+    if (glob.empty() && !has_regex)
+        return true;
+
+    // fnmatch() and regexec() need a null-terminated name.
+    string s(name, len);
+    if (!glob.empty() && fnmatch(glob.c_str(), s.c_str(), 0) != 0)
+        return false;
+    if (has_regex && regexec(&regex, s.c_str(), 0, NULL, 0) != 0)
+        return false;
+    return true;
+}
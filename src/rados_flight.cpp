@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+#include <errno.h>
+#include <set>
+
+#include "rados_cache.h"
+
+static const char* MOD_NAME = "rados_flight";
+
+/*
+ * A read in flight. The readers of a range it contains wait for it, and
+ * make their binaries from its buffer.
+ */
+struct Flight
+{
+    uint64_t offset;
+    size_t len;
+    bool done;
+    bool stale;                 // The object was written since the read started
+    int err;
+    read_buf_t * buf;
+    int refs;
+    XCondition cond;
+};
+
+typedef multimap<pair<uint64_t, string>, Flight*> FlightMap;
+
+/*
+ * Reads in flight, by io context and object, and the io contexts whose
+ * reads are coalesced. The flights are protected by flights_mutex.
+ */
+static FlightMap          flights;
+static XMutex             flights_mutex;
+static set<uint64_t>      coalesce_ioctx;
+static XMutex             coalesce_mutex;
+static uint64_t           coalesced = 0;
+
+/*
+ * Drop a reference on a flight. flights_mutex must be held.
+ */
+static void flight_release(Flight* f)
+{
+    if (--f->refs == 0)
+    {
+        if (f->buf != NULL)
+            enif_release_resource(f->buf);
+        delete f;
+    }
+}
+
+/*
+ * Make the result of a read of the range from the buffer of a flight.
+ */
+static ERL_NIF_TERM flight_result(ErlNifEnv* env, Flight* f, size_t len, uint64_t offset)
+{
+    if (f->err < 0)
+        return make_error_tuple(env, -f->err);
+
+    size_t start = offset - f->offset;
+    if (start >= f->buf->size)
+        return enif_make_atom(env, "eof");
+    size_t n = (start + len <= f->buf->size) ? len : f->buf->size - start;
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            read_buf_make_binary(env, f->buf, start, n));
+}
+
+bool coalesce_enabled(uint64_t id)
+{
+    coalesce_mutex.lock();
+    bool enabled = coalesce_ioctx.count(id) > 0;
+    coalesce_mutex.unlock();
+    return enabled;
+}
+
+void coalesce_forget(uint64_t id)
+{
+    coalesce_mutex.lock();
+    coalesce_ioctx.erase(id);
+    coalesce_mutex.unlock();
+}
+
+/*
+ * A read started before a write must not be shared with the reads that
+ * come after it.
+ */
+void coalesce_invalidate(uint64_t id, const char* oid)
+{
+    flights_mutex.lock();
+    pair<FlightMap::iterator, FlightMap::iterator> range = flights.equal_range(make_pair(id, string(oid)));
+    for (FlightMap::iterator it = range.first; it != range.second; it++)
+        it->second->stale = true;
+    flights_mutex.unlock();
+}
+
+void coalesce_clear(uint64_t id)
+{
+    flights_mutex.lock();
+    FlightMap::iterator it = flights.lower_bound(make_pair(id, string()));
+    for (; it != flights.end() && it->first.first == id; it++)
+        it->second->stale = true;
+    flights_mutex.unlock();
+}
+
+ERL_NIF_TERM coalesced_read(ErlNifEnv* env, uint64_t id, rados_ioctx_t io,
+                            const char* oid, size_t len, uint64_t offset)
+{
+    const char * func_name = "coalesced_read()";
+
+    pair<uint64_t, string> key = make_pair(id, string(oid));
+
+    flights_mutex.lock();
+    pair<FlightMap::iterator, FlightMap::iterator> range = flights.equal_range(key);
+    for (FlightMap::iterator it = range.first; it != range.second; it++)
+    {
+        Flight * f = it->second;
+        if (f->stale || offset < f->offset || offset + len > f->offset + f->len)
+            continue;
+
+        f->refs++;
+        coalesced++;
+        while (!f->done)
+            f->cond.wait(flights_mutex);
+        ERL_NIF_TERM ret = flight_result(env, f, len, offset);
+        flight_release(f);
+        flights_mutex.unlock();
+        return ret;
+    }
+
+    Flight * f = new Flight;
+    f->offset = offset;
+    f->len = len;
+    f->done = false;
+    f->stale = false;
+    f->err = 0;
+    f->buf = NULL;
+    f->refs = 1;
+    FlightMap::iterator pos = flights.insert(make_pair(key, f));
+    flights_mutex.unlock();
+
+    read_buf_t * buf = read_buf_alloc(len);
+    int err = -ENOMEM;
+    if (buf != NULL)
+    {
+        err = rados_read(io, oid, buf->data, len, offset);
+        if (err < 0)
+        {
+            enif_release_resource(buf);
+            buf = NULL;
+        }
+        else
+        {
+            // Do not keep a large buffer around for a short read.
+            if ((size_t)err < len / 2)
+            {
+                read_buf_t * small = read_buf_alloc(err);
+                if (small != NULL)
+                {
+                    memcpy(small->data, buf->data, err);
+                    enif_release_resource(buf);
+                    buf = small;
+                }
+            }
+            buf->size = err;
+            err = 0;
+        }
+    }
+    if (err < 0)
+        logger.error(MOD_NAME, func_name, "read failed for %s: %s", oid, strerror(-err));
+
+    flights_mutex.lock();
+    flights.erase(pos);
+    f->buf = buf;
+    f->err = err;
+    f->done = true;
+    f->cond.broadcast();
+    ERL_NIF_TERM ret = flight_result(env, f, len, offset);
+    flight_release(f);
+    flights_mutex.unlock();
+    return ret;
+}
+
+// Erlang: coalesce_enable(IoCtx)
+ERL_NIF_TERM x_coalesce_enable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_coalesce_enable()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    if (map_ioctx_get(id) == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    coalesce_mutex.lock();
+    coalesce_ioctx.insert(id);
+    coalesce_mutex.unlock();
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: coalesce_disable(IoCtx)
+ERL_NIF_TERM x_coalesce_disable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_coalesce_disable()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    coalesce_forget(id);
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: coalesce_stats()
+ERL_NIF_TERM x_coalesce_stats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    flights_mutex.lock();
+    uint64_t n = coalesced;
+    uint64_t in_flight = flights.size();
+    flights_mutex.unlock();
+
+    ERL_NIF_TERM term_list = enif_make_list(env, 0);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "in_flight"),
+                                                     enif_make_uint64(env, in_flight)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "coalesced"),
+                                                     enif_make_uint64(env, n)),
+                                    term_list);
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            term_list);
+}
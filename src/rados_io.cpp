@@ -6,8 +6,13 @@
 #include <errno.h>
 #include <time.h>
 #include <stdio.h>
+#include <rados/librados.hpp>
 
 #include "rados_nif.h"
+#include "rados_cache.h"
+#include "rados_shm.h"
+#include "rados_disk.h"
+#include "rados_journal.h"
 
 static const char* MOD_NAME = "rados_io";
 
@@ -24,7 +29,7 @@ ERL_NIF_TERM x_ioctx_create(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "cluster : %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "cluster : %ld", id);
     rados_t cluster = map_cluster_get(id);
     if (cluster == NULL)
     {
@@ -43,13 +48,64 @@ ERL_NIF_TERM x_ioctx_create(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
     uint64_t io_id = new_id();
     map_ioctx_add(io_id, io);
 
-    logger.debug(MOD_NAME, func_name, "cluster=%ld, ioctx=%ld", id, io_id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "cluster=%ld, ioctx=%ld", id, io_id);
 
     return enif_make_tuple2(env,
                             enif_make_atom(env, "ok"),
                             enif_make_uint64(env, io_id));
 }
 
+/*
+ * Create a new io context on the same pool as io. Background jobs use
+ * their own io context, so that they are not affected when Erlang
+ * destroys the one they were started from.
+ */
+int ioctx_dup(rados_ioctx_t io, rados_ioctx_t* out)
+{
+    char pool_name[MAX_NAME_LEN];
+    memset(pool_name, 0, MAX_NAME_LEN);
+    int err = rados_ioctx_get_pool_name(io, pool_name, MAX_NAME_LEN - 1);
+    if (err < 0)
+        return err;
+    return rados_ioctx_create(rados_ioctx_get_cluster(io), pool_name, out);
+}
+
+/*
+ * Set a self-managed snapshot context on an io context, e.g. the one an
+ * io context of the user writes with on a copy made by ioctx_dup().
+ */
+int ioctx_set_write_ctx(rados_ioctx_t io, const write_ctx_t& ctx)
+{
+    vector<rados_snap_t> snaps(ctx.snaps.begin(), ctx.snaps.end());
+    return rados_ioctx_selfmanaged_snap_set_write_ctx(io, ctx.seq,
+                                                      snaps.empty() ? NULL : &snaps[0],
+                                                      snaps.size());
+}
+
+/*
+ * Read a range along with the version of the object it was read at. The
+ * version of rados_get_last_version() is the one of the last op of the
+ * io context, whichever thread made it, while the one of a completion is
+ * the one of its own op.
+ */
+int read_versioned(rados_ioctx_t io, const char* oid, char* buf, size_t len,
+                   uint64_t offset, uint64_t* version)
+{
+    rados_completion_t c;
+    int err = rados_aio_create_completion(NULL, NULL, NULL, &c);
+    if (err < 0)
+        return err;
+    err = rados_aio_read(io, oid, c, buf, len, offset);
+    if (err == 0)
+    {
+        rados_aio_wait_for_complete(c);
+        err = rados_aio_get_return_value(c);
+        *version = rados_aio_get_version(c);
+    }
+    rados_aio_release(c);
+    return err;
+}
+
 ERL_NIF_TERM x_ioctx_destroy(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     const char * func_name = "x_ioctx_destroy()";
@@ -68,14 +124,35 @@ ERL_NIF_TERM x_ioctx_destroy(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "ioctx : %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx : %ld", id);
 
     // Flush first to make sure that any writes are completed.
     rados_aio_flush(io);
 
+    watch_close_ioctx(id);
+    journal_close_ioctx(id);
+
+    // The xattr iterators not closed would leak otherwise
+    vector<rados_xattrs_iter_t> iters;
+    map_xattr_iter_remove_ioctx(id, iters);
+    for (size_t i = 0; i < iters.size(); i++)
+        rados_getxattrs_end(iters[i]);
+
     rados_ioctx_destroy(io);
     map_ioctx_remove(id);
 
+    ReadCache * cache = map_read_cache_remove(id);
+    if (cache != NULL)
+        cache->release();
+    MetaCache * meta = map_meta_cache_remove(id);
+    if (meta != NULL)
+        meta->release();
+    shm_cache_forget(id);
+    disk_cache_forget(id);
+    coalesce_forget(id);
+    map_read_snap_remove(id);
+    map_write_ctx_remove(id);
+
     return enif_make_atom(env, "ok");
 }
 
@@ -99,7 +176,7 @@ ERL_NIF_TERM x_ioctx_pool_set_auid(ErlNifEnv* env, int argc, const ERL_NIF_TERM
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "ioctx : %ld, uid : %ld", id, uid);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx : %ld, uid : %ld", id, uid);
 
     int err = rados_ioctx_pool_set_auid(io, uid);
     if (err < 0) 
@@ -129,7 +206,7 @@ ERL_NIF_TERM x_ioctx_pool_get_auid(ErlNifEnv* env, int argc, const ERL_NIF_TERM
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "ioctx : %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx : %ld", id);
 
     uint64_t uid;
     int err = rados_ioctx_pool_get_auid(io, &uid);
@@ -162,7 +239,7 @@ ERL_NIF_TERM x_ioctx_get_id(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "ioctx : %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx : %ld", id);
 
     uint64_t uid = rados_ioctx_get_id(io);
     return enif_make_tuple2(env, 
@@ -188,7 +265,7 @@ ERL_NIF_TERM x_ioctx_get_pool_name(ErlNifEnv* env, int argc, const ERL_NIF_TERM
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "ioctx : %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx : %ld", id);
 
     char pool_name[MAX_NAME_LEN];
     memset(pool_name, 0, MAX_NAME_LEN);
@@ -208,7 +285,9 @@ ERL_NIF_TERM x_ioctx_get_pool_name(ErlNifEnv* env, int argc, const ERL_NIF_TERM
 
 
 // Erlang: write(IoCtx, Oid, Data, Offset)
-ERL_NIF_TERM x_write(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+static ERL_NIF_TERM x_write_dirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+static ERL_NIF_TERM do_write(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[], bool dirty)
 {
     const char * func_name = "x_write()";
 
@@ -232,12 +311,29 @@ ERL_NIF_TERM x_write(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_badarg(env);
     }
 
+    if (!dirty && journal_enabled(id))
+        return enif_schedule_nif(env, "write", ERL_NIF_DIRTY_JOB_IO_BOUND, x_write_dirty, argc, argv);
+
     ErlNifBinary ibin;
     enif_inspect_binary(env, argv[2], &ibin);
 
-    logger.debug(MOD_NAME, func_name, "id=%ld, oid=%s, len=%d, offset=%ld", id, oid, ibin.size, offset);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "id=%ld, oid=%s, len=%d, offset=%ld", id, oid, ibin.size, offset);
+
+    WriteJournal * journal = map_journal_get(id);
+    if (journal != NULL)
+    {
+        int err = journal->append(JOURNAL_WRITE, oid, (const char*)ibin.data, ibin.size, offset);
+        journal->release();
+        cache_invalidate(id, oid);
+        if (err < 0)
+            return make_error_tuple(env, -err);
+        return enif_make_tuple2(env,
+                                enif_make_atom(env, "ok"),
+                                enif_make_int(env, ibin.size));
+    }
 
     int err = rados_write(io, oid, (const char*)ibin.data, ibin.size, offset);
+    cache_invalidate(id, oid);
     if (err < 0) 
     {
         logger.error(MOD_NAME, func_name, "write failed: %s", strerror(-err));
@@ -250,8 +346,20 @@ ERL_NIF_TERM x_write(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
                             enif_make_int(env, err));    // Number of bytes written
 }
 
+static ERL_NIF_TERM x_write_dirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return do_write(env, argc, argv, true);
+}
+
+ERL_NIF_TERM x_write(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return do_write(env, argc, argv, false);
+}
+
 // Erlang: write_full(IoCtx, Oid, Data)
-ERL_NIF_TERM x_write_full(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+static ERL_NIF_TERM x_write_full_dirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+static ERL_NIF_TERM do_write_full(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[], bool dirty)
 {
     const char * func_name = "x_write_full()";
 
@@ -273,10 +381,25 @@ ERL_NIF_TERM x_write_full(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_badarg(env);
     }
 
+    if (!dirty && journal_enabled(id))
+        return enif_schedule_nif(env, "write_full", ERL_NIF_DIRTY_JOB_IO_BOUND, x_write_full_dirty, argc, argv);
+
     ErlNifBinary ibin;
     enif_inspect_binary(env, argv[2], &ibin);
 
+    WriteJournal * journal = map_journal_get(id);
+    if (journal != NULL)
+    {
+        int err = journal->append(JOURNAL_WRITE_FULL, oid, (const char*)ibin.data, ibin.size, 0);
+        journal->release();
+        cache_invalidate(id, oid);
+        if (err < 0)
+            return make_error_tuple(env, -err);
+        return enif_make_atom(env, "ok");
+    }
+
     int err = rados_write_full(io, oid, (const char*)ibin.data, ibin.size);
+    cache_invalidate(id, oid);
     if (err < 0) 
     {
         enif_release_binary(&ibin);
@@ -287,8 +410,20 @@ ERL_NIF_TERM x_write_full(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
     return enif_make_atom(env, "ok");
 }
 
+static ERL_NIF_TERM x_write_full_dirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return do_write_full(env, argc, argv, true);
+}
+
+ERL_NIF_TERM x_write_full(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return do_write_full(env, argc, argv, false);
+}
+
 // Erlang: append(IoCtx, Oid, Data)
-ERL_NIF_TERM x_append(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+static ERL_NIF_TERM x_append_dirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+static ERL_NIF_TERM do_append(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[], bool dirty)
 {
     const char * func_name = "x_append()";
 
@@ -310,10 +445,15 @@ ERL_NIF_TERM x_append(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_badarg(env);
     }
 
+    if (!dirty && journal_enabled(id))
+        return enif_schedule_nif(env, "append", ERL_NIF_DIRTY_JOB_IO_BOUND, x_append_dirty, argc, argv);
+
     ErlNifBinary ibin;
     enif_inspect_binary(env, argv[2], &ibin);
 
+    journal_drain(id, oid);
     int err = rados_append(io, oid, (const char*)ibin.data, ibin.size);
+    cache_invalidate(id, oid);
     if (err < 0) 
     {
         enif_release_binary(&ibin);
@@ -325,6 +465,16 @@ ERL_NIF_TERM x_append(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
                             enif_make_int(env, err));  // Number of bytes appended
 }
 
+static ERL_NIF_TERM x_append_dirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return do_append(env, argc, argv, true);
+}
+
+ERL_NIF_TERM x_append(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return do_append(env, argc, argv, false);
+}
+
 // Erlang: read(IoCtx, Oid, Len, Offset)
 ERL_NIF_TERM x_read(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
@@ -351,7 +501,53 @@ ERL_NIF_TERM x_read(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "io=%ld, oid=%s, len=%ld, offset=%ld", id, oid, len, offset);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "io=%ld, oid=%s, len=%ld, offset=%ld", id, oid, len, offset);
+
+    uint64_t snap = map_read_snap_get(id);
+    WriteJournal * journal = NULL;
+    if (snap == LIBRADOS_SNAP_HEAD)
+        journal = map_journal_get(id);
+    if (journal != NULL)
+    {
+        ERL_NIF_TERM ret;
+        bool journaled = journal->read(env, io, oid, len, offset, &ret);
+        journal->release();
+        if (journaled)
+            return ret;
+    }
+
+    ReadCache * cache = map_read_cache_get(id);
+    if (cache != NULL)
+    {
+        ERL_NIF_TERM ret = cache->read(env, io, oid, len, offset);
+        cache->release();
+        return ret;
+    }
+
+    if (shm_cache_enabled(id))
+    {
+        ShmCache * shm = shm_cache_get();
+        if (shm != NULL)
+        {
+            ERL_NIF_TERM ret = shm->read(env, io, snap, oid, len, offset);
+            shm->release();
+            return ret;
+        }
+    }
+
+    if (disk_cache_enabled(id))
+    {
+        DiskCache * disk = disk_cache_get();
+        if (disk != NULL)
+        {
+            ERL_NIF_TERM ret = disk->read(env, io, snap, oid, len, offset);
+            disk->release();
+            return ret;
+        }
+    }
+
+    if (coalesce_enabled(id))
+        return coalesced_read(env, id, io, oid, len, offset);
 
     char * buf = (char *)malloc(len);
     if (!buf)
@@ -392,7 +588,9 @@ ERL_NIF_TERM x_read(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
     }
 }
 
-ERL_NIF_TERM x_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+static ERL_NIF_TERM x_remove_dirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+static ERL_NIF_TERM do_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[], bool dirty)
 {
     const char * func_name = "x_remove()";
 
@@ -412,9 +610,14 @@ ERL_NIF_TERM x_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "io=%ld, oid=%s", id, oid);
+    if (!dirty && journal_enabled(id))
+        return enif_schedule_nif(env, "remove", ERL_NIF_DIRTY_JOB_IO_BOUND, x_remove_dirty, argc, argv);
 
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "io=%ld, oid=%s", id, oid);
+
+    journal_drain(id, oid);
     int err = rados_remove(io, oid);
+    cache_invalidate(id, oid);
     if (err < 0) 
     {
         logger.error(MOD_NAME, func_name, "failed to remove: io=%ld, oid=%s", id, oid);
@@ -424,7 +627,19 @@ ERL_NIF_TERM x_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
     return enif_make_atom(env, "ok");
 }
 
-ERL_NIF_TERM x_trunc(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+static ERL_NIF_TERM x_remove_dirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return do_remove(env, argc, argv, true);
+}
+
+ERL_NIF_TERM x_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return do_remove(env, argc, argv, false);
+}
+
+static ERL_NIF_TERM x_trunc_dirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+static ERL_NIF_TERM do_trunc(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[], bool dirty)
 {
     const char * func_name = "x_trunc()";
 
@@ -446,9 +661,14 @@ ERL_NIF_TERM x_trunc(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "io=%ld, oid=%s, size=%ld", id, oid, size);
+    if (!dirty && journal_enabled(id))
+        return enif_schedule_nif(env, "trunc", ERL_NIF_DIRTY_JOB_IO_BOUND, x_trunc_dirty, argc, argv);
 
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "io=%ld, oid=%s, size=%ld", id, oid, size);
+
+    journal_drain(id, oid);
     int err = rados_trunc(io, oid, size);
+    cache_invalidate(id, oid);
     if (err < 0) 
     {
         logger.error(MOD_NAME, func_name, "failed to truncate : io=%ld, oid=%s, size=%ld", id, oid, size);
@@ -458,6 +678,16 @@ ERL_NIF_TERM x_trunc(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
     return enif_make_atom(env, "ok");
 }
 
+static ERL_NIF_TERM x_trunc_dirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return do_trunc(env, argc, argv, true);
+}
+
+ERL_NIF_TERM x_trunc(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return do_trunc(env, argc, argv, false);
+}
+
 ERL_NIF_TERM x_ioctx_pool_stat(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     const char * func_name = "x_ioctx_pool_stat()";
@@ -595,11 +825,38 @@ ERL_NIF_TERM x_stat(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "ioctx=%ld, oid=%s", id, oid);
-
-    uint64_t size;
-    time_t mtime;
-    int err = rados_stat(io, oid, &size, &mtime);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx=%ld, oid=%s", id, oid);
+
+    uint64_t size = 0;
+    time_t mtime = 0;
+    int err = 0;
+    // The journal only holds writes to the head of the objects.
+    bool journaled = false;
+    WriteJournal * journal = NULL;
+    if (map_read_snap_get(id) == LIBRADOS_SNAP_HEAD)
+        journal = map_journal_get(id);
+    if (journal != NULL)
+    {
+        journaled = journal->stat(io, oid, &err, &size, &mtime);
+        journal->release();
+    }
+    if (!journaled)
+    {
+        MetaCache * meta = map_meta_cache_get(id);
+        if (meta == NULL)
+            err = rados_stat(io, oid, &size, &mtime);
+        else
+        {
+            if (!meta->getStat(oid, &err, &size, &mtime))
+            {
+                uint64_t gen = meta->getGeneration();
+                err = rados_stat(io, oid, &size, &mtime);
+                if (err >= 0 || err == -ENOENT)
+                    meta->putStat(oid, err, size, mtime, gen);
+            }
+            meta->release();
+        }
+    }
     if (err < 0) 
     {
         logger.error(MOD_NAME, func_name, "unable to read object stat for %s: %s", oid, strerror(-err));
@@ -645,7 +902,7 @@ ERL_NIF_TERM x_objects_list_open(ErlNifEnv* env, int argc, const ERL_NIF_TERM ar
     }
     
     rados_list_ctx_t ctx;
-    int err = rados_objects_list_open(io, &ctx);
+    int err = rados_nobjects_list_open(io, &ctx);
     if (err < 0) 
     {
         return make_error_tuple(env, -err);
@@ -658,6 +915,107 @@ ERL_NIF_TERM x_objects_list_open(ErlNifEnv* env, int argc, const ERL_NIF_TERM ar
                             enif_make_uint64(env, listid));
 }
 
+/*
+ * A listing position, as an object-list cursor. The cursor is freed with
+ * the object. Only the C++ API of librados turns a cursor into a string
+ * and back.
+ */
+class ListCursor : public librados::ObjectCursor
+{
+public:
+    rados_object_list_cursor get() { return c_cursor; }
+};
+
+static int list_cursor_parse(ErlNifEnv* env, ERL_NIF_TERM term, ListCursor& cursor)
+{
+    ErlNifBinary bin;
+    if (!enif_inspect_binary(env, term, &bin))
+        return 0;
+    return cursor.from_str(string((const char*)bin.data, bin.size));
+}
+
+// Erlang: objects_list_open(IoCtx, Opts)
+ERL_NIF_TERM x_objects_list_open2(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_objects_list_open2()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_is_list(env, argv[1]))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    ListCursor pos;
+    ERL_NIF_TERM opt;
+    int seek = get_opt(env, argv[1], "position", &opt);
+    if (seek && !list_cursor_parse(env, opt, pos))
+    {
+        logger.error(MOD_NAME, func_name, "invalid position");
+        return enif_make_badarg(env);
+    }
+
+    ObjectFilter * filter = new ObjectFilter();
+    if (!filter->parse(env, argv[1]))
+    {
+        filter->release();
+        logger.error(MOD_NAME, func_name, "invalid filter");
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        filter->release();
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+    
+    rados_list_ctx_t ctx;
+    int err = rados_nobjects_list_open(io, &ctx);
+    if (err < 0) 
+    {
+        filter->release();
+        return make_error_tuple(env, -err);
+    }
+
+    if (seek)
+    {
+        XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx=%ld, resume", id);
+        rados_nobjects_list_seek_cursor(ctx, pos.get());
+    }
+
+    uint64_t listid = new_id();
+    map_list_ctx_add(listid, ctx);
+    if (filter->isActive())
+        map_list_filter_add(listid, filter);
+    else
+        filter->release();
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            enif_make_uint64(env, listid));
+}
+
+/*
+ * Report the scheduler time used since *start to the VM, in percent of
+ * a 1 ms timeslice, and reset *start. Returns 1 when the timeslice is
+ * used up and the NIF should return.
+ */
+static int consume_timeslice(ErlNifEnv* env, struct timespec * start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long usec = (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+    if (usec < 100)
+        return 0;
+    *start = now;
+    int percent = (int)(usec / 10);
+    if (percent > 100)
+        percent = 100;
+    return enif_consume_timeslice(env, percent);
+}
+
 ERL_NIF_TERM x_objects_list_next(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     const char * func_name = "x_objects_list_next()";
@@ -676,11 +1034,30 @@ ERL_NIF_TERM x_objects_list_next(ErlNifEnv* env, int argc, const ERL_NIF_TERM ar
         return enif_make_badarg(env);
     }
 
-    logger.debug(MOD_NAME, func_name, "list id: %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "list id: %ld", id);
+
+    ObjectFilter * filter = map_list_filter_get(id);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     const char * entry[1];
     const char * key[1];
-    int err = rados_objects_list_next(ctx, entry, key);
+    int err;
+    while ((err = rados_nobjects_list_next(ctx, entry, key, NULL)) == 0 &&
+           filter != NULL &&
+           !filter->match(entry[0], strlen(entry[0])))
+    {
+        // Go on skipping in a rescheduled call rather than hog the
+        // scheduler with a selective filter.
+        if (consume_timeslice(env, &start))
+        {
+            filter->release();
+            return enif_schedule_nif(env, "objects_list_next", 0, x_objects_list_next, argc, argv);
+        }
+    }
+    if (filter != NULL)
+        filter->release();
     if ((err < 0) && (err != -ENOENT))
     {
         logger.error(MOD_NAME, func_name, "unable to get next object in list for %ld: %s", id, strerror(-err));
@@ -715,6 +1092,150 @@ ERL_NIF_TERM x_objects_list_next(ErlNifEnv* env, int argc, const ERL_NIF_TERM ar
                             term_list);
 }
 
+// Erlang: objects_list_next(ListCtx, Max)
+ERL_NIF_TERM x_objects_list_next_batch(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_objects_list_next_batch()";
+
+    uint64_t id;
+    unsigned max;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_get_uint(env, argv[1], &max) ||
+        max == 0)
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    rados_list_ctx_t ctx = map_list_ctx_get(id);
+    if (ctx == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx object list : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "list id: %ld, max: %d", id, max);
+
+    ObjectFilter * filter = map_list_filter_get(id);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    ERL_NIF_TERM term_list = enif_make_list(env, 0);
+    unsigned count = 0;
+    int err = 0;
+    while (count < max)
+    {
+        const char * entry[1];
+        const char * key[1];
+        err = rados_nobjects_list_next(ctx, entry, key, NULL);
+        if (err < 0)
+            break;
+
+        size_t len = strlen(entry[0]);
+        if (filter == NULL || filter->match(entry[0], len))
+        {
+            ERL_NIF_TERM e, k;
+            memcpy(enif_make_new_binary(env, len, &e), entry[0], len);
+            len = (key[0] != NULL) ? strlen(key[0]) : 0;
+            unsigned char * kbuf = enif_make_new_binary(env, len, &k);
+            if (len > 0)
+                memcpy(kbuf, key[0], len);
+            term_list = enif_make_list_cell(env, enif_make_tuple2(env, e, k), term_list);
+            count++;
+        }
+
+        // Return a short batch rather than hog the scheduler.
+        if (consume_timeslice(env, &start))
+            break;
+    }
+    if (filter != NULL)
+        filter->release();
+
+    if ((err < 0) && (err != -ENOENT))
+    {
+        logger.error(MOD_NAME, func_name, "unable to get next object in list for %ld: %s", id, strerror(-err));
+        return make_error_tuple(env, -err);
+    }
+
+    if ((count == 0) && (err == -ENOENT))
+    {
+        return enif_make_atom(env, "end");
+    }
+
+    enif_make_reverse_list(env, term_list, &term_list);
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            term_list);
+}
+
+// Erlang: objects_list_position(ListCtx)
+ERL_NIF_TERM x_objects_list_position(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_objects_list_position()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    rados_list_ctx_t ctx = map_list_ctx_get(id);
+    if (ctx == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx object list : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    rados_object_list_cursor c;
+    int err = rados_nobjects_list_get_cursor(ctx, &c);
+    if (err < 0)
+    {
+        logger.error(MOD_NAME, func_name, "unable to get position of list %ld: %s", id, strerror(-err));
+        return make_error_tuple(env, -err);
+    }
+    ListCursor cursor;
+    cursor.set(c);
+    string pos = cursor.to_str();
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "list id: %ld, position: %s", id, pos.c_str());
+
+    ERL_NIF_TERM term;
+    memcpy(enif_make_new_binary(env, pos.size(), &term), pos.data(), pos.size());
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            term);
+}
+
+// Erlang: objects_list_seek(ListCtx, Position)
+ERL_NIF_TERM x_objects_list_seek(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_objects_list_seek()";
+
+    uint64_t id;
+    ListCursor pos;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !list_cursor_parse(env, argv[1], pos))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    rados_list_ctx_t ctx = map_list_ctx_get(id);
+    if (ctx == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx object list : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "list id: %ld", id);
+
+    rados_nobjects_list_seek_cursor(ctx, pos.get());
+
+    return enif_make_atom(env, "ok");
+}
+
 ERL_NIF_TERM x_objects_list_close(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     const char * func_name = "x_objects_list_close()";
@@ -733,10 +1254,13 @@ ERL_NIF_TERM x_objects_list_close(ErlNifEnv* env, int argc, const ERL_NIF_TERM a
         return enif_make_badarg(env);
     }
     
-    logger.debug(MOD_NAME, func_name, "list id: %ld", id);
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "list id: %ld", id);
 
-    rados_objects_list_close(ctx);
+    rados_nobjects_list_close(ctx);
     map_list_ctx_remove(id);
+    ObjectFilter * filter = map_list_filter_remove(id);
+    if (filter != NULL)
+        filter->release();
 
     return enif_make_atom(env, "ok");
 }
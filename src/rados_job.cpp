@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+#include "rados_nif.h"
+
+static const char* MOD_NAME = "rados_job";
+
+RadosJob::RadosJob(const char* tag, const ErlNifPid& pid) :
+    id(new_id()),
+    tag(tag),
+    pid(pid),
+    refs(1),
+    cancelled(0),
+    owner_monitor(NULL)
+{
+}
+
+RadosJob::~RadosJob()
+{
+    if (owner_monitor != NULL)
+        enif_release_resource(owner_monitor);
+}
+
+void RadosJob::keep()
+{
+    __sync_add_and_fetch(&refs, 1);
+}
+
+void RadosJob::release()
+{
+    if (__sync_sub_and_fetch(&refs, 1) == 0)
+        delete this;
+}
+
+void RadosJob::cancel()
+{
+    cancelled = 1;
+}
+
+bool RadosJob::isCancelled()
+{
+    return cancelled != 0;
+}
+
+bool RadosJob::send(ErlNifEnv* msg_env, ERL_NIF_TERM payload)
+{
+    ERL_NIF_TERM msg = enif_make_tuple3(msg_env,
+                                        enif_make_atom(msg_env, tag),
+                                        enif_make_uint64(msg_env, id),
+                                        payload);
+    int ok = enif_send(NULL, &pid, msg_env, msg);
+    enif_clear_env(msg_env);
+    if (!ok)
+    {
+        XLOG_DEBUG(logger, MOD_NAME, "RadosJob::send()", "owner of job %ld is gone", id);
+        cancel();
+    }
+    return ok;
+}
+
+bool RadosJob::monitor(ErlNifEnv* env)
+{
+    owner_monitor = owner_monitor_start(env, &pid, OWNER_JOB, id);
+    if (owner_monitor == NULL)
+    {
+        cancel();
+        return false;
+    }
+    return true;
+}
+
+// Erlang: job_cancel(JobId)
+ERL_NIF_TERM x_job_cancel(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_job_cancel()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    RadosJob * job = map_job_get(id);
+    if (job == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "job non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "job : %ld", id);
+
+    job->cancel();
+    job->release();
+
+    return enif_make_atom(env, "ok");
+}
@@ -0,0 +1,953 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "rados_journal.h"
+#include "rados_cache.h"
+
+static const char* MOD_NAME = "rados_journal";
+
+#define JOURNAL_MAX_LAG         (64 * 1024 * 1024)
+#define JOURNAL_COMPACT_SIZE    (64 * 1024 * 1024)
+#define JOURNAL_CKPT_EVERY      64
+#define JOURNAL_RETRY_MS        1000
+#define JOURNAL_LAG_WAIT_MS     1000
+#define JOURNAL_MAX_RECORD      (1024ULL * 1024 * 1024)
+#define JOURNAL_OSD_MAX_WRITE   90              // Default osd_max_write_size, in MB
+
+static uint64_t fnv_update(uint64_t h, const char* data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t record_checksum(journal_rec_hdr_t hdr, const char* oid, const uint64_t* snaps,
+                                const char* data)
+{
+    hdr.checksum = 0;
+    uint64_t h = 14695981039346656037ULL;
+    h = fnv_update(h, (const char*)&hdr, sizeof(hdr));
+    h = fnv_update(h, oid, hdr.oid_len);
+    h = fnv_update(h, (const char*)snaps, hdr.num_snaps * sizeof(uint64_t));
+    h = fnv_update(h, data, hdr.data_len);
+    return h;
+}
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Whether a failed write may succeed later, and is worth retrying.
+ */
+static bool is_transient(int err)
+{
+    return err == -EAGAIN || err == -ETIMEDOUT || err == -EDQUOT ||
+           err == -ENOSPC || err == -EINTR;
+}
+
+static int write_all(int fd, const char* data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, char* data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = ::read(fd, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (n == 0)
+            return -EIO;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+WriteJournal::WriteJournal(uint64_t io_id, const char* path, uint64_t max_lag,
+                           const ErlNifPid& owner) :
+    io_id(io_id),
+    path(path),
+    ckpt_path(string(path) + ".ckpt"),
+    max_lag(max_lag),
+    max_record((uint64_t)JOURNAL_OSD_MAX_WRITE * 1024 * 1024),
+    owner(owner),
+    fd(-1),
+    ckpt_fd(-1),
+    io(NULL),
+    started(false),
+    stopping(false),
+    open_batch(NULL),
+    committing(false),
+    pending_bytes(0),
+    next_seq(1),
+    flushed_seq(0),
+    journal_size(0),
+    ckpt_seq(0),
+    appended(0),
+    flushed(0),
+    replayed(0),
+    errors(0),
+    refs(1)
+{
+}
+
+WriteJournal::~WriteJournal()
+{
+    for (deque<Record*>::iterator it = pending.begin(); it != pending.end(); it++)
+        delete *it;
+    if (fd >= 0)
+        ::close(fd);
+    if (ckpt_fd >= 0)
+        ::close(ckpt_fd);
+    if (io != NULL)
+        rados_ioctx_destroy(io);
+}
+
+void WriteJournal::keep()
+{
+    __sync_add_and_fetch(&refs, 1);
+}
+
+void WriteJournal::release()
+{
+    if (__sync_sub_and_fetch(&refs, 1) == 0)
+        delete this;
+}
+
+int WriteJournal::open(rados_ioctx_t user_io)
+{
+    const char * func_name = "WriteJournal::open()";
+
+    // The flusher has its own io context, so that it is not affected by
+    // what is done with the one of the user.
+    int err = ioctx_dup(user_io, &io);
+    if (err < 0)
+    {
+        io = NULL;
+        return err;
+    }
+
+    // A write larger than the OSDs take would fail on every try.
+    char value[32];
+    memset(value, 0, sizeof(value));
+    if (rados_conf_get(rados_ioctx_get_cluster(io), "osd_max_write_size", value, sizeof(value) - 1) == 0)
+    {
+        uint64_t mb = strtoull(value, NULL, 10);
+        if (mb > 0)
+            max_record = mb * 1024 * 1024;
+    }
+    if (max_record > JOURNAL_MAX_RECORD)
+        max_record = JOURNAL_MAX_RECORD;
+
+    ckpt_fd = ::open(ckpt_path.c_str(), O_RDWR | O_CREAT, 0600);
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (fd < 0 || ckpt_fd < 0)
+    {
+        err = -errno;
+        logger.error(MOD_NAME, func_name, "unable to open %s: %s", path.c_str(), strerror(-err));
+        return err;
+    }
+
+    err = replay();
+    if (err < 0)
+        return err;
+
+    if (pthread_create(&thread, NULL, threadMain, this) != 0)
+        return -EAGAIN;
+    started = true;
+
+    XLOG_INFO(logger, MOD_NAME, func_name, "opened %s, %ld writes to replay", path.c_str(), replayed);
+    return 0;
+}
+
+/*
+ * Load the writes of the journal that are after the checkpoint. The
+ * journal is cut after the last valid record.
+ */
+int WriteJournal::replay()
+{
+    const char * func_name = "WriteJournal::replay()";
+
+    uint64_t ckpt[2];
+    if (pread(ckpt_fd, ckpt, sizeof(ckpt), 0) == sizeof(ckpt) && ckpt[0] == JOURNAL_MAGIC)
+        flushed_seq = ckpt[1];
+    ckpt_seq = flushed_seq;
+    next_seq = flushed_seq + 1;
+
+    int rfd = ::open(path.c_str(), O_RDONLY);
+    if (rfd < 0)
+        return -errno;
+
+    uint64_t valid = 0;
+    for (;;)
+    {
+        journal_rec_hdr_t hdr;
+        if (read_all(rfd, (char *)&hdr, sizeof(hdr)) < 0 ||
+            hdr.magic != JOURNAL_MAGIC ||
+            hdr.oid_len >= MAX_NAME_LEN || hdr.num_snaps > JOURNAL_MAX_SNAPS ||
+            hdr.data_len > JOURNAL_MAX_RECORD)
+            break;
+
+        Record * r = new Record;
+        r->oid.resize(hdr.oid_len);
+        r->ctx.seq = hdr.snap_seq;
+        r->ctx.snaps.resize(hdr.num_snaps);
+        r->data.resize(hdr.data_len);
+        if (read_all(rfd, &r->oid[0], hdr.oid_len) < 0 ||
+            (hdr.num_snaps > 0 &&
+             read_all(rfd, (char *)&r->ctx.snaps[0], hdr.num_snaps * sizeof(uint64_t)) < 0) ||
+            (hdr.data_len > 0 && read_all(rfd, &r->data[0], hdr.data_len) < 0) ||
+            record_checksum(hdr, r->oid.data(), hdr.num_snaps > 0 ? &r->ctx.snaps[0] : NULL,
+                            r->data.data()) != hdr.checksum)
+        {
+            delete r;
+            break;
+        }
+        valid += sizeof(hdr) + hdr.oid_len + hdr.num_snaps * sizeof(uint64_t) + hdr.data_len;
+
+        if (hdr.seq <= flushed_seq)
+        {
+            delete r;
+            continue;
+        }
+        r->seq = hdr.seq;
+        r->type = hdr.type;
+        r->offset = hdr.offset;
+        r->time = time(NULL);
+        enqueue(r);
+        replayed++;
+        if (hdr.seq >= next_seq)
+            next_seq = hdr.seq + 1;
+    }
+    ::close(rfd);
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_size > valid)
+    {
+        logger.warning(MOD_NAME, func_name, "%s: dropping %ld bytes of torn records",
+                       path.c_str(), st.st_size - valid);
+        if (ftruncate(fd, valid) < 0)
+            return -errno;
+    }
+    journal_size = valid;
+    return 0;
+}
+
+/*
+ * Add a record to the queue of the flusher. The mutex must be held, or
+ * the flusher not started.
+ */
+void WriteJournal::enqueue(Record* r)
+{
+    pending.push_back(r);
+    pending_oids[r->oid]++;
+    pending_bytes += r->data.size();
+}
+
+/*
+ * Write the records of a batch, and sync them. Only the writer of the
+ * batch being written touches the file.
+ */
+int WriteJournal::writeBatch(Batch* b)
+{
+    uint64_t size = journal_size;
+    int err = 0;
+    for (size_t i = 0; i < b->records.size() && err == 0; i++)
+    {
+        Record * r = b->records[i];
+        journal_rec_hdr_t hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = JOURNAL_MAGIC;
+        hdr.type = r->type;
+        hdr.seq = r->seq;
+        hdr.offset = r->offset;
+        hdr.oid_len = r->oid.size();
+        hdr.num_snaps = r->ctx.snaps.size();
+        hdr.data_len = r->data.size();
+        hdr.snap_seq = r->ctx.seq;
+        const uint64_t * snaps = r->ctx.snaps.empty() ? NULL : &r->ctx.snaps[0];
+        size_t snaps_len = hdr.num_snaps * sizeof(uint64_t);
+        hdr.checksum = record_checksum(hdr, r->oid.data(), snaps, r->data.data());
+
+        err = write_all(fd, (const char*)&hdr, sizeof(hdr));
+        if (err == 0)
+            err = write_all(fd, r->oid.data(), r->oid.size());
+        if (err == 0 && snaps_len > 0)
+            err = write_all(fd, (const char*)snaps, snaps_len);
+        if (err == 0)
+            err = write_all(fd, r->data.data(), r->data.size());
+        size += sizeof(hdr) + r->oid.size() + snaps_len + r->data.size();
+    }
+    if (err == 0 && fdatasync(fd) < 0)
+        err = -errno;
+    if (err < 0)
+    {
+        // Cut the partial batch, so that the next records are readable.
+        if (ftruncate(fd, journal_size) < 0)
+            logger.error(MOD_NAME, "WriteJournal::writeBatch()", "unable to truncate %s", path.c_str());
+        return err;
+    }
+    journal_size = size;
+    return 0;
+}
+
+/*
+ * Record that the writes up to seq are applied. The flusher and the
+ * drains checkpoint concurrently, a checkpoint never goes back.
+ */
+void WriteJournal::writeCheckpoint(uint64_t seq)
+{
+    ckpt_mutex.lock();
+    if (seq > ckpt_seq)
+    {
+        uint64_t ckpt[2];
+        ckpt[0] = JOURNAL_MAGIC;
+        ckpt[1] = seq;
+        if (pwrite(ckpt_fd, ckpt, sizeof(ckpt), 0) != sizeof(ckpt) || fdatasync(ckpt_fd) < 0)
+            logger.error(MOD_NAME, "WriteJournal::writeCheckpoint()", "unable to write %s: %s",
+                         ckpt_path.c_str(), strerror(errno));
+        else
+            ckpt_seq = seq;
+    }
+    ckpt_mutex.unlock();
+}
+
+int WriteJournal::append(int type, const char* oid, const char* data, size_t len, uint64_t offset)
+{
+    if (len > max_record)
+    {
+        logger.error(MOD_NAME, "WriteJournal::append()", "write of %ld bytes on %s is too large",
+                     len, oid);
+        return -E2BIG;
+    }
+
+    Record * r = new Record;
+    r->type = type;
+    r->oid = oid;
+    r->offset = offset;
+    r->data.assign(data, len);
+    r->time = time(NULL);
+    map_write_ctx_get(io_id, &r->ctx);
+
+    // Wait for the flusher to catch up, but not for long: the pool may
+    // not be writable.
+    mutex.lock();
+    uint64_t deadline = now_ms() + JOURNAL_LAG_WAIT_MS;
+    while (!pending.empty() && pending_bytes + len > max_lag)
+    {
+        uint64_t now = now_ms();
+        if (now >= deadline)
+            break;
+        cond.timedWait(mutex, deadline - now);
+    }
+    bool lagging = !pending.empty() && pending_bytes + len > max_lag;
+    mutex.unlock();
+    if (lagging)
+    {
+        logger.error(MOD_NAME, "WriteJournal::append()", "%s is over the maximum lag",
+                     path.c_str());
+        delete r;
+        return -EAGAIN;
+    }
+
+    // The batches are written in turn, and the sequence numbers given in
+    // the order of the batches.
+    append_mutex.lock();
+    mutex.lock();
+    r->seq = next_seq++;
+    mutex.unlock();
+    if (open_batch == NULL)
+    {
+        open_batch = new Batch;
+        open_batch->waiters = 0;
+        open_batch->done = false;
+        open_batch->err = 0;
+    }
+    Batch * mine = open_batch;
+    mine->records.push_back(r);
+    mine->waiters++;
+
+    while (!mine->done)
+    {
+        if (committing)
+        {
+            append_cond.wait(append_mutex);
+            continue;
+        }
+
+        // Write the open batch, the writers joining meanwhile make the next.
+        Batch * b = open_batch;
+        open_batch = NULL;
+        committing = true;
+        append_mutex.unlock();
+
+        int err = writeBatch(b);
+        if (err == 0)
+        {
+            mutex.lock();
+            for (size_t i = 0; i < b->records.size(); i++)
+                enqueue(b->records[i]);
+            appended += b->records.size();
+            cond.broadcast();
+            mutex.unlock();
+        }
+
+        append_mutex.lock();
+        b->err = err;
+        b->done = true;
+        committing = false;
+        append_cond.broadcast();
+    }
+    int err = mine->err;
+    if (--mine->waiters == 0)
+        delete mine;
+    append_mutex.unlock();
+
+    if (err < 0)
+    {
+        logger.error(MOD_NAME, "WriteJournal::append()", "unable to append to %s: %s",
+                     path.c_str(), strerror(-err));
+        delete r;
+    }
+    return err;
+}
+
+void WriteJournal::drain(const char* oid)
+{
+    mutex.lock();
+    while (pending_oids.count(oid) > 0)
+        cond.wait(mutex);
+    uint64_t seq = flushed_seq;
+    mutex.unlock();
+    writeCheckpoint(seq);
+}
+
+void WriteJournal::flush()
+{
+    mutex.lock();
+    while (!pending.empty())
+        cond.wait(mutex);
+    uint64_t seq = flushed_seq;
+    mutex.unlock();
+    writeCheckpoint(seq);
+}
+
+void WriteJournal::close()
+{
+    if (!started)
+        return;
+    mutex.lock();
+    stopping = true;
+    cond.broadcast();
+    mutex.unlock();
+    pthread_join(thread, NULL);
+    started = false;
+}
+
+int WriteJournal::apply(Record* r)
+{
+    if (r->ctx != io_ctx)
+    {
+        int err = ioctx_set_write_ctx(io, r->ctx);
+        if (err < 0)
+            return err;
+        io_ctx = r->ctx;
+    }
+    if (r->type == JOURNAL_WRITE_FULL)
+        return rados_write_full(io, r->oid.c_str(), r->data.data(), r->data.size());
+    return rados_write(io, r->oid.c_str(), r->data.data(), r->data.size(), r->offset);
+}
+
+/*
+ * Empty the journal once everything in it has been applied.
+ */
+void WriteJournal::compact()
+{
+    append_mutex.lock();
+    mutex.lock();
+    if (!committing && pending.empty() && journal_size > JOURNAL_COMPACT_SIZE)
+    {
+        writeCheckpoint(flushed_seq);
+        if (ftruncate(fd, 0) == 0)
+            journal_size = 0;
+    }
+    mutex.unlock();
+    append_mutex.unlock();
+}
+
+void* WriteJournal::threadMain(void* arg)
+{
+    ((WriteJournal *)arg)->run();
+    return NULL;
+}
+
+void WriteJournal::run()
+{
+    const char * func_name = "WriteJournal::run()";
+
+    int since_ckpt = 0;
+    mutex.lock();
+    for (;;)
+    {
+        if (pending.empty())
+        {
+            if (since_ckpt > 0)
+            {
+                mutex.unlock();
+                writeCheckpoint(flushed_seq);
+                since_ckpt = 0;
+                if (journal_size > JOURNAL_COMPACT_SIZE)
+                    compact();
+                mutex.lock();
+                continue;
+            }
+            if (stopping)
+                break;
+            cond.wait(mutex);
+            continue;
+        }
+
+        Record * r = pending.front();
+        mutex.unlock();
+
+        int err = apply(r);
+        if (err < 0 && is_transient(err))
+        {
+            // Keep the write, and try again later, as long as it takes.
+            logger.error(MOD_NAME, func_name, "unable to apply write %ld on %s: %s",
+                         r->seq, r->oid.c_str(), strerror(-err));
+            mutex.lock();
+            errors++;
+            cond.timedWait(mutex, JOURNAL_RETRY_MS);
+            continue;
+        }
+        if (err < 0)
+        {
+            // It would fail again, and hold back the writes after it.
+            logger.error(MOD_NAME, func_name, "dropping write %ld on %s: %s",
+                         r->seq, r->oid.c_str(), strerror(-err));
+            notifyDropped(r, err);
+            mutex.lock();
+            errors++;
+            mutex.unlock();
+        }
+
+        // Reads that raced with the write may have cached older data.
+        cache_invalidate(io_id, r->oid.c_str());
+
+        mutex.lock();
+        pending.pop_front();
+        map<string, int>::iterator it = pending_oids.find(r->oid);
+        if (--it->second == 0)
+            pending_oids.erase(it);
+        pending_bytes -= r->data.size();
+        flushed_seq = r->seq;
+        flushed++;
+        cond.broadcast();
+        delete r;
+
+        if (++since_ckpt >= JOURNAL_CKPT_EVERY)
+        {
+            uint64_t seq = flushed_seq;
+            mutex.unlock();
+            writeCheckpoint(seq);
+            since_ckpt = 0;
+            mutex.lock();
+        }
+    }
+    mutex.unlock();
+}
+
+void WriteJournal::notifyDropped(Record* r, int err)
+{
+    ErlNifEnv * msg_env = enif_alloc_env();
+    ERL_NIF_TERM oid;
+    memcpy(enif_make_new_binary(msg_env, r->oid.size(), &oid), r->oid.data(), r->oid.size());
+    ERL_NIF_TERM msg = enif_make_tuple3(msg_env,
+                                        enif_make_atom(msg_env, "rados_journal"),
+                                        enif_make_uint64(msg_env, io_id),
+                                        enif_make_tuple3(msg_env,
+                                                         enif_make_atom(msg_env, "error"),
+                                                         oid,
+                                                         enif_make_string(msg_env, strerror(-err), ERL_NIF_LATIN1)));
+    enif_send(NULL, &owner, msg_env, msg);
+    enif_free_env(msg_env);
+}
+
+/*
+ * Copy the parts of the journaled writes of an object that fall in a
+ * range, from the last full write on. Returns false if there is none.
+ */
+bool WriteJournal::snapshot(const char* oid, uint64_t offset, size_t len,
+                            vector<Piece>& pieces, time_t* mtime)
+{
+    mutex.lock();
+    if (pending_oids.count(oid) == 0)
+    {
+        mutex.unlock();
+        return false;
+    }
+    for (deque<Record*>::iterator it = pending.begin(); it != pending.end(); it++)
+    {
+        Record * r = *it;
+        if (r->oid != oid)
+            continue;
+        if (r->type == JOURNAL_WRITE_FULL)
+            pieces.clear();
+
+        Piece p;
+        p.type = r->type;
+        p.end = r->offset + r->data.size();
+        uint64_t start = (r->offset > offset) ? r->offset : offset;
+        uint64_t end = (p.end < offset + len) ? p.end : offset + len;
+        p.offset = start;
+        if (start < end)
+            p.data.assign(r->data, start - r->offset, end - start);
+        pieces.push_back(p);
+        *mtime = r->time;
+    }
+    mutex.unlock();
+    return true;
+}
+
+bool WriteJournal::read(ErlNifEnv* env, rados_ioctx_t user_io, const char* oid, size_t len,
+                        uint64_t offset, ERL_NIF_TERM* ret)
+{
+    vector<Piece> pieces;
+    time_t mtime;
+    if (!snapshot(oid, offset, len, pieces, &mtime))
+        return false;
+
+    ErlNifBinary obin;
+    if (!enif_alloc_binary(len, &obin))
+    {
+        *ret = make_error_tuple(env, ENOMEM);
+        return true;
+    }
+    memset(obin.data, 0, len);
+
+    // End of the object in the range, as far as known.
+    uint64_t end = offset;
+    if (pieces.empty() || pieces[0].type != JOURNAL_WRITE_FULL)
+    {
+        int err = rados_read(user_io, oid, (char *)obin.data, len, offset);
+        if (err < 0 && err != -ENOENT)
+        {
+            enif_release_binary(&obin);
+            *ret = make_error_tuple(env, -err);
+            return true;
+        }
+        if (err > 0)
+            end = offset + err;
+    }
+
+    // Writes applied while reading are applied again, to the same effect.
+    for (size_t i = 0; i < pieces.size(); i++)
+    {
+        Piece & p = pieces[i];
+        memcpy(obin.data + (p.offset - offset), p.data.data(), p.data.size());
+        uint64_t p_end = (p.end < offset + len) ? p.end : offset + len;
+        if (p.type == JOURNAL_WRITE_FULL)
+            end = (p_end > offset) ? p_end : offset;
+        else if (p_end > end)
+            end = p_end;
+    }
+
+    if (end == offset)
+    {
+        enif_release_binary(&obin);
+        *ret = enif_make_atom(env, "eof");
+        return true;
+    }
+    if (end - offset < len)
+        enif_realloc_binary(&obin, end - offset);
+    *ret = enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            enif_make_binary(env, &obin));
+    return true;
+}
+
+bool WriteJournal::stat(rados_ioctx_t user_io, const char* oid, int* err, uint64_t* size, time_t* mtime)
+{
+    vector<Piece> pieces;
+    if (!snapshot(oid, 0, 0, pieces, mtime))
+        return false;
+
+    *err = 0;
+    *size = 0;
+    if (pieces[0].type != JOURNAL_WRITE_FULL)
+    {
+        time_t t;
+        *err = rados_stat(user_io, oid, size, &t);
+        if (*err == -ENOENT)
+        {
+            *err = 0;
+            *size = 0;
+        }
+        if (*err < 0)
+            return true;
+    }
+    for (size_t i = 0; i < pieces.size(); i++)
+    {
+        if (pieces[i].type == JOURNAL_WRITE_FULL)
+            *size = pieces[i].end;
+        else if (pieces[i].end > *size)
+            *size = pieces[i].end;
+    }
+    return true;
+}
+
+ERL_NIF_TERM WriteJournal::stats(ErlNifEnv* env)
+{
+    mutex.lock();
+    uint64_t ops = pending.size();
+    uint64_t bytes = pending_bytes;
+    uint64_t lag = pending.empty() ? 0 : time(NULL) - pending.front()->time;
+    uint64_t a = appended;
+    uint64_t f = flushed;
+    uint64_t e = errors;
+    uint64_t size = journal_size;
+    mutex.unlock();
+
+    ERL_NIF_TERM term_list = enif_make_list(env, 0);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "journal_size"),
+                                                     enif_make_uint64(env, size)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "errors"),
+                                                     enif_make_uint64(env, e)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "replayed"),
+                                                     enif_make_uint64(env, replayed)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "flushed"),
+                                                     enif_make_uint64(env, f)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "appended"),
+                                                     enif_make_uint64(env, a)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "lag_seconds"),
+                                                     enif_make_uint64(env, lag)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "pending_bytes"),
+                                                     enif_make_uint64(env, bytes)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "pending_ops"),
+                                                     enif_make_uint64(env, ops)),
+                                    term_list);
+    return term_list;
+}
+
+bool journal_enabled(uint64_t id)
+{
+    WriteJournal * journal = map_journal_get(id);
+    if (journal == NULL)
+        return false;
+    journal->release();
+    return true;
+}
+
+void journal_drain(uint64_t id, const char* oid)
+{
+    WriteJournal * journal = map_journal_get(id);
+    if (journal != NULL)
+    {
+        journal->drain(oid);
+        journal->release();
+    }
+}
+
+void journal_close_ioctx(uint64_t id)
+{
+    // Drain while the journal is still in the map, so that the writes made
+    // meanwhile still go through it, then close it.
+    WriteJournal * journal = map_journal_get(id);
+    if (journal == NULL)
+        return;
+    journal->flush();
+    journal->release();
+
+    journal = map_journal_remove(id);
+    if (journal != NULL)
+    {
+        journal->close();
+        journal->release();
+    }
+}
+
+/********************************************************************************
+ * NIF functions
+ ********************************************************************************/
+
+// Erlang: journal_enable(IoCtx, Path, Opts)
+ERL_NIF_TERM x_journal_enable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_journal_enable()";
+
+    uint64_t id;
+    char path[MAX_FILE_NAME_LEN];
+    memset(path, 0, MAX_FILE_NAME_LEN);
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !get_name_arg(env, argv[1], path, MAX_FILE_NAME_LEN) ||
+        !enif_is_list(env, argv[2]))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    uint64_t max_lag = JOURNAL_MAX_LAG;
+    ERL_NIF_TERM opt;
+    if (get_opt(env, argv[2], "max_lag", &opt) &&
+        (!enif_get_uint64(env, opt, &max_lag) || max_lag == 0))
+    {
+        logger.error(MOD_NAME, func_name, "invalid options");
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx=%ld, path=%s, max_lag=%ld", id, path, max_lag);
+
+    WriteJournal * journal = map_journal_get(id);
+    if (journal != NULL)
+    {
+        journal->release();
+        return make_error_tuple(env, EEXIST);
+    }
+
+    ErlNifPid owner;
+    enif_self(env, &owner);
+    journal = new WriteJournal(id, path, max_lag, owner);
+    int err = journal->open(io);
+    if (err < 0)
+    {
+        journal->close();
+        journal->release();
+        return make_error_tuple(env, -err);
+    }
+    map_journal_add(id, journal);
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: journal_disable(IoCtx)
+ERL_NIF_TERM x_journal_disable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_journal_disable()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx=%ld", id);
+
+    journal_close_ioctx(id);
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: journal_flush(IoCtx)
+ERL_NIF_TERM x_journal_flush(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_journal_flush()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    WriteJournal * journal = map_journal_get(id);
+    if (journal != NULL)
+    {
+        journal->flush();
+        journal->release();
+    }
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: journal_stats(IoCtx)
+ERL_NIF_TERM x_journal_stats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_journal_stats()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    WriteJournal * journal = map_journal_get(id);
+    if (journal == NULL)
+    {
+        return make_error_tuple(env, ENOENT);
+    }
+
+    ERL_NIF_TERM stats = journal->stats(env);
+    journal->release();
+
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            stats);
+}
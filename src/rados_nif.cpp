@@ -14,9 +14,15 @@
 #include <erl_nif.h>
 
 #include "rados_nif.h"
+#include "rados_cache.h"
+#include "rados_shm.h"
+#include "rados_journal.h"
+#include "rados_disk.h"
 
 using namespace std;
 
+static const char* MOD_NAME = "rados_nif";
+
 #define _UINT64_C(c)            c ## UL
 #define _UINT64_MAX             (_UINT64_C(18446744073709551615))
 
@@ -28,54 +34,125 @@ static void dtor_ioctx_type(ErlNifEnv* env, void* obj);
 
 static ErlNifResourceType * cluster_type_resource = NULL;
 static ErlNifResourceType * ioctx_type_resource = NULL;
+ErlNifResourceType * owner_monitor_type_resource = NULL;
+
+/*
+ * Maps of the librados handles, and the id counter. They are kept in the
+ * priv_data of the library, so that a code upgrade carries them over, see
+ * rados_priv_t.
+ */
+static rados_priv_t * registry = NULL;
+
+/*
+ * Map of name filters of list contexts. Only the list contexts opened
+ * with a filter have an entry.
+ */
+map<uint64_t, ObjectFilter*> map_list_filter;
+static XMutex                map_list_filter_mutex;
+
+/*
+ * Map of background jobs. The map holds a reference on each job.
+ */
+map<uint64_t, RadosJob*> map_job;
+static XMutex            map_job_mutex;
 
 /*
- * Map of rados cluster handles. We keep a local map of rados cluster
- * handles here, mapping to long integers. The handles are created
- * by librados api, and it's not possible to pass between Erlang and C.
- * Therefore, we pass a long integer, which is mapped to the handle here.
+ * Map of read caches, by io context. The map holds a reference on
+ * each cache.
  */
-map<uint64_t, rados_t> map_cluster;
-static XMutex          map_cluster_mutex;
+map<uint64_t, ReadCache*> map_read_cache;
+static XMutex             map_read_cache_mutex;
 
 /*
- * Map of IO context. Same mechanism as the cluster handles.
+ * Map of metadata caches, by io context. Same mechanism as the read
+ * caches.
  */
-map<uint64_t, rados_ioctx_t> map_ioctx;
-static XMutex                map_ioctx_mutex;
+map<uint64_t, MetaCache*> map_meta_cache;
+static XMutex             map_meta_cache_mutex;
 
 /*
- * Map of list context. Same mechanism as the cluster handles.
+ * Map of object watches.
  */
-map<uint64_t, rados_list_ctx_t> map_list_ctx;
-static XMutex                   map_list_ctx_mutex;
+map<uint64_t, RadosWatch*> map_watch;
+static XMutex              map_watch_mutex;
 
 /*
- * Map of xattr iterators.
+ * Map of write-back journals, by io context. Same mechanism as the read
+ * caches.
  */
-map<uint64_t, rados_xattrs_iter_t> map_xattr_iter;
-static XMutex                      map_xattr_iter_mutex;
+map<uint64_t, WriteJournal*> map_journal;
+static XMutex                map_journal_mutex;
 
-static uint64_t id_index = 0;
-static XMutex id_mutex;
+/*
+ * Pool of worker threads for the background jobs.
+ */
+XWorkPool * work_pool = NULL;
 
 XLog logger = XLogManager::instance().getLog("RadosLog");
 
-int load(ErlNifEnv* env, void** priv, ERL_NIF_TERM load_info)
+/*
+ * Open the resource types. On an upgrade, the types of the old version are
+ * taken over, so that the resources it created are freed by the new one.
+ */
+static int open_resource_types(ErlNifEnv* env, ErlNifResourceFlags flags)
 {
     ErlNifResourceType * rt = enif_open_resource_type(
-        env, NULL, "cluster_type_resource", dtor_cluster_type, ERL_NIF_RT_CREATE, NULL);
+        env, NULL, "cluster_type_resource", dtor_cluster_type, flags, NULL);
     if (rt == NULL)
         return -1;
     cluster_type_resource = rt;
 
     rt = enif_open_resource_type(
-        env, NULL, "ioctx_type_resource", dtor_ioctx_type, ERL_NIF_RT_CREATE, NULL);
+        env, NULL, "ioctx_type_resource", dtor_ioctx_type, flags, NULL);
     if (rt == NULL)
         return -1;
     ioctx_type_resource = rt;
 
-    id_index = 0;
+    rt = enif_open_resource_type(
+        env, NULL, "read_buf_type_resource", NULL, flags, NULL);
+    if (rt == NULL)
+        return -1;
+    read_buf_type_resource = rt;
+
+    rt = enif_open_resource_type(
+        env, NULL, "shm_ref_type_resource", dtor_shm_ref_type, flags, NULL);
+    if (rt == NULL)
+        return -1;
+    shm_ref_type_resource = rt;
+
+    ErlNifResourceTypeInit init;
+    memset(&init, 0, sizeof(init));
+    init.down = down_owner_monitor;
+    rt = enif_open_resource_type_x(env, "owner_monitor_type_resource", &init, flags, NULL);
+    if (rt == NULL)
+        return -1;
+    owner_monitor_type_resource = rt;
+
+    return 0;
+}
+
+static void start_work_pool(ErlNifEnv* env, ERL_NIF_TERM load_info)
+{
+    // The load info can set the maximum number of worker threads.
+    int threads;
+    if (!enif_get_int(env, load_info, &threads) || threads <= 0)
+        threads = WORK_POOL_THREADS;
+    work_pool = new XWorkPool(threads);
+}
+
+int load(ErlNifEnv* env, void** priv, ERL_NIF_TERM load_info)
+{
+    if (open_resource_types(env, ERL_NIF_RT_CREATE) < 0)
+        return -1;
+
+    registry = new rados_priv_t;
+    registry->version = RADOS_PRIV_VERSION;
+    registry->users = 1;
+    registry->journals = 0;
+    registry->id_index = 0;
+    *priv = registry;
+
+    start_work_pool(env, load_info);
 
     return 0;
 }
@@ -85,16 +162,134 @@ static int reload(ErlNifEnv* env, void** priv, ERL_NIF_TERM load_info)
     return 0;
 }
 
+/*
+ * Take over the handles of the version of the library being replaced, so
+ * that the connections survive the upgrade.
+ */
 static int upgrade(ErlNifEnv* env, 
                    void** priv, void** old_priv, 
                    ERL_NIF_TERM load_info)
 {
+    const char * func_name = "upgrade()";
+
+    rados_priv_t * old = (rados_priv_t *)*old_priv;
+    if (old == NULL || old->version != RADOS_PRIV_VERSION)
+    {
+        logger.error(MOD_NAME, func_name, "incompatible version of the loaded library");
+        return -1;
+    }
+
+    // The writes in the journals of the old version must be applied before
+    // the new version writes to the same objects.
+    if (old->journals > 0)
+    {
+        logger.error(MOD_NAME, func_name, "%d write-back journals open, disable them first", old->journals);
+        return -1;
+    }
+
+    if (open_resource_types(env, (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER)) < 0)
+        return -1;
+
+    __sync_add_and_fetch(&old->users, 1);
+    registry = old;
+    *priv = registry;
+
+    start_work_pool(env, load_info);
+
+    XLOG_INFO(logger, MOD_NAME, func_name, "took over %d clusters and %d io contexts",
+                (int)registry->clusters.size(), (int)registry->ioctxs.size());
     return 0;
 }
 
+/*
+ * Close everything the library has its code for, then the handles if no
+ * other version of the library uses them.
+ */
 static void unload(ErlNifEnv* env, void* priv)
 {
-    return;
+    // The writer thread, and the archivers of the rolling log files, run
+    // the code of this library.
+    logger.stopAsync();
+    logger.stopHandlers();
+
+    // Stop the background jobs. The items still queued are aborted.
+    vector<RadosJob*> jobs;
+    map_job_mutex.lock();
+    for (map<uint64_t, RadosJob*>::iterator it = map_job.begin(); it != map_job.end(); it++)
+        jobs.push_back(it->second);
+    map_job.clear();
+    map_job_mutex.unlock();
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        jobs[i]->cancel();
+        jobs[i]->release();
+    }
+    delete work_pool;
+    work_pool = NULL;
+    connect_shutdown();
+
+    vector<uint64_t> ioctx_ids;
+    vector<rados_ioctx_t> ioctxs;
+    registry->ioctx_mutex.lock();
+    for (map<uint64_t, rados_ioctx_t>::iterator it = registry->ioctxs.begin(); it != registry->ioctxs.end(); it++)
+    {
+        if (it->second == NULL)
+            continue;
+        ioctx_ids.push_back(it->first);
+        ioctxs.push_back(it->second);
+    }
+    registry->ioctx_mutex.unlock();
+
+    for (size_t i = 0; i < ioctx_ids.size(); i++)
+    {
+        watch_close_ioctx(ioctx_ids[i]);
+        journal_close_ioctx(ioctx_ids[i]);
+        ReadCache * cache = map_read_cache_remove(ioctx_ids[i]);
+        if (cache != NULL)
+            cache->release();
+        MetaCache * meta = map_meta_cache_remove(ioctx_ids[i]);
+        if (meta != NULL)
+            meta->release();
+        coalesce_forget(ioctx_ids[i]);
+    }
+    shm_cache_shutdown();
+    disk_cache_shutdown();
+
+    map_list_filter_mutex.lock();
+    for (map<uint64_t, ObjectFilter*>::iterator it = map_list_filter.begin(); it != map_list_filter.end(); it++)
+        it->second->release();
+    map_list_filter.clear();
+    map_list_filter_mutex.unlock();
+
+    // Wait for the writes in flight.
+    for (size_t i = 0; i < ioctxs.size(); i++)
+        rados_aio_flush(ioctxs[i]);
+
+    if (__sync_sub_and_fetch(&registry->users, 1) > 0)
+        return;
+
+    for (map<uint64_t, rados_xattrs_iter_t>::iterator it = registry->xattr_iters.begin();
+         it != registry->xattr_iters.end(); it++)
+    {
+        if (it->second != NULL)
+            rados_getxattrs_end(it->second);
+    }
+    for (map<uint64_t, rados_list_ctx_t>::iterator it = registry->list_ctxs.begin();
+         it != registry->list_ctxs.end(); it++)
+    {
+        if (it->second != NULL)
+            rados_nobjects_list_close(it->second);
+    }
+    for (size_t i = 0; i < ioctxs.size(); i++)
+        rados_ioctx_destroy(ioctxs[i]);
+    for (map<uint64_t, rados_t>::iterator it = registry->clusters.begin(); it != registry->clusters.end(); it++)
+    {
+        if (it->second != NULL)
+            rados_shutdown(it->second);
+    }
+
+    delete registry;
+    registry = NULL;
 }
 
 static void dtor_cluster_type(ErlNifEnv* env, void* obj)
@@ -105,18 +300,54 @@ static void dtor_ioctx_type(ErlNifEnv* env, void* obj)
 {
 }
 
+owner_monitor_t* owner_monitor_start(ErlNifEnv* env, const ErlNifPid* pid, int kind, uint64_t id)
+{
+    owner_monitor_t * mon = (owner_monitor_t *)enif_alloc_resource(owner_monitor_type_resource,
+                                                                   sizeof(owner_monitor_t));
+    mon->kind = kind;
+    mon->id = id;
+    if (enif_monitor_process(env, mon, pid, NULL) != 0)
+    {
+        enif_release_resource(mon);
+        return NULL;
+    }
+    return mon;
+}
+
+/*
+ * The owner of a job or a watch has exited.
+ */
+void down_owner_monitor(ErlNifEnv* env, void* obj, ErlNifPid* pid, ErlNifMonitor* mon)
+{
+    owner_monitor_t * m = (owner_monitor_t *)obj;
+    if (m->kind == OWNER_JOB)
+    {
+        RadosJob * job = map_job_get(m->id);
+        if (job != NULL)
+        {
+            XLOG_DEBUG(logger, MOD_NAME, "down_owner_monitor()", "owner of job %ld is gone", m->id);
+            job->cancel();
+            job->release();
+        }
+    }
+    else if (m->kind == OWNER_WATCH)
+    {
+        watch_owner_down(m->id);
+    }
+}
+
 /**
  * Generate a new ID
  */
 uint64_t new_id()
 {
-    id_mutex.lock();
+    registry->id_mutex.lock();
     uint64_t id = 0;
-    if (id_index == _UINT64_MAX)
-        id_index = 0;
-    id_index++;
-    id = id_index;
-    id_mutex.unlock();
+    if (registry->id_index == _UINT64_MAX)
+        registry->id_index = 0;
+    registry->id_index++;
+    id = registry->id_index;
+    registry->id_mutex.unlock();
     return id;
 }
 
@@ -126,27 +357,27 @@ uint64_t new_id()
 
 void map_cluster_add(uint64_t id, rados_t cluster)
 {
-    map_cluster_mutex.lock();
-    map_cluster[id] = cluster;
-    map_cluster_mutex.unlock();
+    registry->cluster_mutex.lock();
+    registry->clusters[id] = cluster;
+    registry->cluster_mutex.unlock();
 }
 
 rados_t map_cluster_get(uint64_t id)
 {
     rados_t cluster;
-    map_cluster_mutex.lock();
-    cluster = map_cluster[id];
-    map_cluster_mutex.unlock();
+    registry->cluster_mutex.lock();
+    cluster = registry->clusters[id];
+    registry->cluster_mutex.unlock();
     return cluster;
 }
 
 rados_t map_cluster_remove(uint64_t id)
 {
     rados_t cluster;
-    map_cluster_mutex.lock();
-    cluster = map_cluster[id];
-    map_cluster.erase(id);
-    map_cluster_mutex.unlock();
+    registry->cluster_mutex.lock();
+    cluster = registry->clusters[id];
+    registry->clusters.erase(id);
+    registry->cluster_mutex.unlock();
     return cluster;
 }
 
@@ -156,27 +387,27 @@ rados_t map_cluster_remove(uint64_t id)
 
 void map_ioctx_add(uint64_t id, rados_ioctx_t io)
 {
-    map_ioctx_mutex.lock();
-    map_ioctx[id] = io;
-    map_ioctx_mutex.unlock();
+    registry->ioctx_mutex.lock();
+    registry->ioctxs[id] = io;
+    registry->ioctx_mutex.unlock();
 }
 
 rados_ioctx_t map_ioctx_get(uint64_t id)
 {
     rados_ioctx_t io;
-    map_ioctx_mutex.lock();
-    io = map_ioctx[id];
-    map_ioctx_mutex.unlock();
+    registry->ioctx_mutex.lock();
+    io = registry->ioctxs[id];
+    registry->ioctx_mutex.unlock();
     return io;
 }
 
 rados_ioctx_t map_ioctx_remove(uint64_t id)
 {
     rados_ioctx_t io;
-    map_ioctx_mutex.lock();
-    io = map_ioctx[id];
-    map_ioctx.erase(id);
-    map_ioctx_mutex.unlock();
+    registry->ioctx_mutex.lock();
+    io = registry->ioctxs[id];
+    registry->ioctxs.erase(id);
+    registry->ioctx_mutex.unlock();
     return io;
 }
 
@@ -186,60 +417,424 @@ rados_ioctx_t map_ioctx_remove(uint64_t id)
 
 void map_list_ctx_add(uint64_t id, rados_list_ctx_t ctx)
 {
-    map_list_ctx_mutex.lock();
-    map_list_ctx[id] = ctx;
-    map_list_ctx_mutex.unlock();
+    registry->list_ctx_mutex.lock();
+    registry->list_ctxs[id] = ctx;
+    registry->list_ctx_mutex.unlock();
 }
 
 rados_list_ctx_t map_list_ctx_get(uint64_t id)
 {
     rados_list_ctx_t ctx;
-    map_list_ctx_mutex.lock();
-    ctx = map_list_ctx[id];
-    map_list_ctx_mutex.unlock();
+    registry->list_ctx_mutex.lock();
+    ctx = registry->list_ctxs[id];
+    registry->list_ctx_mutex.unlock();
     return ctx;
 }
 
 rados_list_ctx_t map_list_ctx_remove(uint64_t id)
 {
     rados_list_ctx_t ctx;
-    map_list_ctx_mutex.lock();
-    ctx = map_list_ctx[id];
-    map_list_ctx.erase(id);
-    map_list_ctx_mutex.unlock();
+    registry->list_ctx_mutex.lock();
+    ctx = registry->list_ctxs[id];
+    registry->list_ctxs.erase(id);
+    registry->list_ctx_mutex.unlock();
     return ctx;
 }
 
+/*
+ * List filters map manipulation functions, with the same reference
+ * handling as the read caches.
+ */
+
+void map_list_filter_add(uint64_t id, ObjectFilter* filter)
+{
+    map_list_filter_mutex.lock();
+    map_list_filter[id] = filter;
+    map_list_filter_mutex.unlock();
+}
+
+ObjectFilter* map_list_filter_get(uint64_t id)
+{
+    ObjectFilter * filter = NULL;
+    map_list_filter_mutex.lock();
+    map<uint64_t, ObjectFilter*>::iterator it = map_list_filter.find(id);
+    if (it != map_list_filter.end())
+    {
+        filter = it->second;
+        filter->keep();
+    }
+    map_list_filter_mutex.unlock();
+    return filter;
+}
+
+ObjectFilter* map_list_filter_remove(uint64_t id)
+{
+    ObjectFilter * filter = NULL;
+    map_list_filter_mutex.lock();
+    map<uint64_t, ObjectFilter*>::iterator it = map_list_filter.find(id);
+    if (it != map_list_filter.end())
+    {
+        filter = it->second;
+        map_list_filter.erase(it);
+    }
+    map_list_filter_mutex.unlock();
+    return filter;
+}
+
 /*
  * Xattr iterators map manipulation functions
  */
 
-void map_xattr_iter_add(uint64_t id, rados_xattrs_iter_t it)
+void map_xattr_iter_add(uint64_t id, rados_xattrs_iter_t it, uint64_t io_id)
 {
-    map_xattr_iter_mutex.lock();
-    map_xattr_iter[id] = it;
-    map_xattr_iter_mutex.unlock();
+    registry->xattr_iter_mutex.lock();
+    registry->xattr_iters[id] = it;
+    registry->xattr_iter_ioctxs[id] = io_id;
+    registry->xattr_iter_mutex.unlock();
 }
 
 rados_xattrs_iter_t map_xattr_iter_get(uint64_t id)
 {
     rados_xattrs_iter_t it;
-    map_xattr_iter_mutex.lock();
-    it = map_xattr_iter[id];
-    map_xattr_iter_mutex.unlock();
+    registry->xattr_iter_mutex.lock();
+    it = registry->xattr_iters[id];
+    registry->xattr_iter_mutex.unlock();
     return it;
 }
 
 rados_xattrs_iter_t map_xattr_iter_remove(uint64_t id)
 {
     rados_xattrs_iter_t it;
-    map_xattr_iter_mutex.lock();
-    it = map_xattr_iter[id];
-    map_xattr_iter.erase(id);
-    map_xattr_iter_mutex.unlock();
+    registry->xattr_iter_mutex.lock();
+    it = registry->xattr_iters[id];
+    registry->xattr_iters.erase(id);
+    registry->xattr_iter_ioctxs.erase(id);
+    registry->xattr_iter_mutex.unlock();
     return it;
 }
 
+/*
+ * Remove the iterators left open on an io context, which the caller must
+ * end before the io context is destroyed.
+ */
+void map_xattr_iter_remove_ioctx(uint64_t io_id, vector<rados_xattrs_iter_t>& iters)
+{
+    registry->xattr_iter_mutex.lock();
+    map<uint64_t, uint64_t>::iterator it = registry->xattr_iter_ioctxs.begin();
+    while (it != registry->xattr_iter_ioctxs.end())
+    {
+        if (it->second == io_id)
+        {
+            rados_xattrs_iter_t iter = registry->xattr_iters[it->first];
+            if (iter != NULL)
+                iters.push_back(iter);
+            registry->xattr_iters.erase(it->first);
+            registry->xattr_iter_ioctxs.erase(it++);
+        }
+        else
+            it++;
+    }
+    registry->xattr_iter_mutex.unlock();
+}
+
+/*
+ * Background jobs map manipulation functions
+ */
+
+void map_job_add(uint64_t id, RadosJob* job)
+{
+    job->keep();
+    map_job_mutex.lock();
+    map_job[id] = job;
+    map_job_mutex.unlock();
+}
+
+/*
+ * The job returned has been kept, the caller must release it.
+ */
+RadosJob* map_job_get(uint64_t id)
+{
+    RadosJob * job = NULL;
+    map_job_mutex.lock();
+    map<uint64_t, RadosJob*>::iterator it = map_job.find(id);
+    if (it != map_job.end())
+    {
+        job = it->second;
+        job->keep();
+    }
+    map_job_mutex.unlock();
+    return job;
+}
+
+/*
+ * The reference held by the map is passed on to the caller.
+ */
+RadosJob* map_job_remove(uint64_t id)
+{
+    RadosJob * job = NULL;
+    map_job_mutex.lock();
+    map<uint64_t, RadosJob*>::iterator it = map_job.find(id);
+    if (it != map_job.end())
+    {
+        job = it->second;
+        map_job.erase(it);
+    }
+    map_job_mutex.unlock();
+    return job;
+}
+
+/*
+ * Read caches map manipulation functions
+ */
+
+/*
+ * The map takes over the reference of the caller. The cache replaced,
+ * if any, is returned with the reference of the map.
+ */
+ReadCache* map_read_cache_add(uint64_t id, ReadCache* cache)
+{
+    ReadCache * old = NULL;
+    map_read_cache_mutex.lock();
+    map<uint64_t, ReadCache*>::iterator it = map_read_cache.find(id);
+    if (it != map_read_cache.end())
+        old = it->second;
+    map_read_cache[id] = cache;
+    map_read_cache_mutex.unlock();
+    return old;
+}
+
+/*
+ * The cache returned has been kept, the caller must release it.
+ */
+ReadCache* map_read_cache_get(uint64_t id)
+{
+    ReadCache * cache = NULL;
+    map_read_cache_mutex.lock();
+    map<uint64_t, ReadCache*>::iterator it = map_read_cache.find(id);
+    if (it != map_read_cache.end())
+    {
+        cache = it->second;
+        cache->keep();
+    }
+    map_read_cache_mutex.unlock();
+    return cache;
+}
+
+/*
+ * The reference held by the map is passed on to the caller.
+ */
+ReadCache* map_read_cache_remove(uint64_t id)
+{
+    ReadCache * cache = NULL;
+    map_read_cache_mutex.lock();
+    map<uint64_t, ReadCache*>::iterator it = map_read_cache.find(id);
+    if (it != map_read_cache.end())
+    {
+        cache = it->second;
+        map_read_cache.erase(it);
+    }
+    map_read_cache_mutex.unlock();
+    return cache;
+}
+
+/*
+ * Metadata caches map manipulation functions, with the same reference
+ * handling as the read caches.
+ */
+
+MetaCache* map_meta_cache_add(uint64_t id, MetaCache* cache)
+{
+    MetaCache * old = NULL;
+    map_meta_cache_mutex.lock();
+    map<uint64_t, MetaCache*>::iterator it = map_meta_cache.find(id);
+    if (it != map_meta_cache.end())
+        old = it->second;
+    map_meta_cache[id] = cache;
+    map_meta_cache_mutex.unlock();
+    return old;
+}
+
+MetaCache* map_meta_cache_get(uint64_t id)
+{
+    MetaCache * cache = NULL;
+    map_meta_cache_mutex.lock();
+    map<uint64_t, MetaCache*>::iterator it = map_meta_cache.find(id);
+    if (it != map_meta_cache.end())
+    {
+        cache = it->second;
+        cache->keep();
+    }
+    map_meta_cache_mutex.unlock();
+    return cache;
+}
+
+MetaCache* map_meta_cache_remove(uint64_t id)
+{
+    MetaCache * cache = NULL;
+    map_meta_cache_mutex.lock();
+    map<uint64_t, MetaCache*>::iterator it = map_meta_cache.find(id);
+    if (it != map_meta_cache.end())
+    {
+        cache = it->second;
+        map_meta_cache.erase(it);
+    }
+    map_meta_cache_mutex.unlock();
+    return cache;
+}
+
+/*
+ * Watches map manipulation functions
+ */
+
+void map_watch_add(uint64_t id, RadosWatch* w)
+{
+    map_watch_mutex.lock();
+    map_watch[id] = w;
+    map_watch_mutex.unlock();
+}
+
+RadosWatch* map_watch_remove(uint64_t id)
+{
+    RadosWatch * w = NULL;
+    map_watch_mutex.lock();
+    map<uint64_t, RadosWatch*>::iterator it = map_watch.find(id);
+    if (it != map_watch.end())
+    {
+        w = it->second;
+        map_watch.erase(it);
+    }
+    map_watch_mutex.unlock();
+    return w;
+}
+
+/*
+ * Remove all the watches of an io context.
+ */
+void map_watch_remove_ioctx(uint64_t io_id, vector<RadosWatch*>& watches)
+{
+    map_watch_mutex.lock();
+    map<uint64_t, RadosWatch*>::iterator it = map_watch.begin();
+    while (it != map_watch.end())
+    {
+        if (it->second->getIoCtxId() == io_id)
+        {
+            watches.push_back(it->second);
+            map_watch.erase(it++);
+        }
+        else
+            it++;
+    }
+    map_watch_mutex.unlock();
+}
+
+/*
+ * Journals map manipulation functions, with the same reference handling
+ * as the read caches.
+ */
+
+void map_journal_add(uint64_t id, WriteJournal* journal)
+{
+    map_journal_mutex.lock();
+    map_journal[id] = journal;
+    map_journal_mutex.unlock();
+    __sync_add_and_fetch(&registry->journals, 1);
+}
+
+WriteJournal* map_journal_get(uint64_t id)
+{
+    WriteJournal * journal = NULL;
+    map_journal_mutex.lock();
+    map<uint64_t, WriteJournal*>::iterator it = map_journal.find(id);
+    if (it != map_journal.end())
+    {
+        journal = it->second;
+        journal->keep();
+    }
+    map_journal_mutex.unlock();
+    return journal;
+}
+
+WriteJournal* map_journal_remove(uint64_t id)
+{
+    WriteJournal * journal = NULL;
+    map_journal_mutex.lock();
+    map<uint64_t, WriteJournal*>::iterator it = map_journal.find(id);
+    if (it != map_journal.end())
+    {
+        journal = it->second;
+        map_journal.erase(it);
+        __sync_sub_and_fetch(&registry->journals, 1);
+    }
+    map_journal_mutex.unlock();
+    return journal;
+}
+
+/*
+ * Read snapshots map manipulation functions. An io context not in the map
+ * reads the head.
+ */
+
+void map_read_snap_set(uint64_t id, uint64_t snap)
+{
+    registry->read_snap_mutex.lock();
+    if (snap == LIBRADOS_SNAP_HEAD)
+        registry->read_snaps.erase(id);
+    else
+        registry->read_snaps[id] = snap;
+    registry->read_snap_mutex.unlock();
+}
+
+uint64_t map_read_snap_get(uint64_t id)
+{
+    uint64_t snap = LIBRADOS_SNAP_HEAD;
+    registry->read_snap_mutex.lock();
+    map<uint64_t, uint64_t>::iterator it = registry->read_snaps.find(id);
+    if (it != registry->read_snaps.end())
+        snap = it->second;
+    registry->read_snap_mutex.unlock();
+    return snap;
+}
+
+void map_read_snap_remove(uint64_t id)
+{
+    registry->read_snap_mutex.lock();
+    registry->read_snaps.erase(id);
+    registry->read_snap_mutex.unlock();
+}
+
+/*
+ * Write contexts map manipulation functions. An io context not in the map
+ * writes with the snapshot context of its pool.
+ */
+
+void map_write_ctx_set(uint64_t id, const write_ctx_t& ctx)
+{
+    registry->write_ctx_mutex.lock();
+    registry->write_ctxs[id] = ctx;
+    registry->write_ctx_mutex.unlock();
+}
+
+bool map_write_ctx_get(uint64_t id, write_ctx_t* ctx)
+{
+    bool found = false;
+    registry->write_ctx_mutex.lock();
+    map<uint64_t, write_ctx_t>::iterator it = registry->write_ctxs.find(id);
+    if (it != registry->write_ctxs.end())
+    {
+        *ctx = it->second;
+        found = true;
+    }
+    registry->write_ctx_mutex.unlock();
+    return found;
+}
+
+void map_write_ctx_remove(uint64_t id)
+{
+    registry->write_ctx_mutex.lock();
+    registry->write_ctxs.erase(id);
+    registry->write_ctx_mutex.unlock();
+}
+
 
 ERL_NIF_TERM make_error_tuple(ErlNifEnv* env, int err)
 {
@@ -248,6 +843,46 @@ ERL_NIF_TERM make_error_tuple(ErlNifEnv* env, int err)
     return enif_make_tuple2(env, atom, reason);
 }
 
+/*
+ * Get a name argument, which can be given either as a string or as a
+ * binary. The result is always null-terminated.
+ */
+int get_name_arg(ErlNifEnv* env, ERL_NIF_TERM term, char* buf, unsigned len)
+{
+    ErlNifBinary bin;
+    if (enif_inspect_binary(env, term, &bin))
+    {
+        if (bin.size >= len || memchr(bin.data, 0, bin.size) != NULL)
+            return 0;
+        memcpy(buf, bin.data, bin.size);
+        buf[bin.size] = 0;
+        return 1;
+    }
+    return enif_get_string(env, term, buf, len, ERL_NIF_LATIN1) > 0;
+}
+
+/*
+ * Look up {Name, Value} in a proplist of options.
+ */
+int get_opt(ErlNifEnv* env, ERL_NIF_TERM opts, const char* name, ERL_NIF_TERM* value)
+{
+    char atom[MAX_NAME_LEN];
+    ERL_NIF_TERM head, tail = opts;
+    while (enif_get_list_cell(env, tail, &head, &tail))
+    {
+        int arity;
+        const ERL_NIF_TERM * tuple;
+        if (enif_get_tuple(env, head, &arity, &tuple) && arity == 2 &&
+            enif_get_atom(env, tuple[0], atom, MAX_NAME_LEN, ERL_NIF_LATIN1) &&
+            strcmp(atom, name) == 0)
+        {
+            *value = tuple[1];
+            return 1;
+        }
+    }
+    return 0;
+}
+
 ERL_NIF_TERM x_add_stderr_log_handler(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     XLogStderrHandler *log_handler = new XLogStderrHandler();
@@ -275,6 +910,49 @@ ERL_NIF_TERM x_add_file_log_handler(ErlNifEnv* env, int argc, const ERL_NIF_TERM
     return enif_make_atom(env, "ok");
 }
 
+#define LOG_FILE_MAX_SIZE   (64 * 1024 * 1024)
+#define LOG_FILE_KEEP       7
+
+// Erlang: add_rolling_file_log_handler(Filename, Opts)
+ERL_NIF_TERM x_add_rolling_file_log_handler(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    char log_file[MAX_FILE_NAME_LEN];
+    memset(log_file, 0, MAX_FILE_NAME_LEN);
+    if (!enif_get_string(env, argv[0], log_file, MAX_FILE_NAME_LEN, ERL_NIF_LATIN1) ||
+        !enif_is_list(env, argv[1]))
+    {
+        return enif_make_badarg(env);
+    }
+
+    long max_size = LOG_FILE_MAX_SIZE;
+    int max_age = 0;
+    int keep = LOG_FILE_KEEP;
+    bool compress = true;
+    char atom[8];
+    ERL_NIF_TERM opt;
+    if ((get_opt(env, argv[1], "max_size", &opt) &&
+         (!enif_get_long(env, opt, &max_size) || max_size < 0)) ||
+        (get_opt(env, argv[1], "max_age", &opt) &&
+         (!enif_get_int(env, opt, &max_age) || max_age < 0)) ||
+        (get_opt(env, argv[1], "keep", &opt) &&
+         (!enif_get_int(env, opt, &keep) || keep < 0)))
+    {
+        return enif_make_badarg(env);
+    }
+    if (get_opt(env, argv[1], "compress", &opt))
+    {
+        if (!enif_get_atom(env, opt, atom, sizeof(atom), ERL_NIF_LATIN1) ||
+            (strcmp(atom, "true") != 0 && strcmp(atom, "false") != 0))
+            return enif_make_badarg(env);
+        compress = strcmp(atom, "true") == 0;
+    }
+
+    XLogRollingFileHandler *log_handler =
+        new XLogRollingFileHandler(log_file, max_size, max_age, keep, compress);
+    logger.addHandler(*log_handler);
+    return enif_make_atom(env, "ok");
+}
+
 static LogLevel atom_to_level(char * level)
 {
     if (strcmp(level, "fatal") == 0)
@@ -304,18 +982,77 @@ ERL_NIF_TERM x_set_log_level(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]
     return enif_make_atom(env, "ok");
 }
 
+#define LOG_QUEUE_LEN       8192
+#define LOG_QUEUE_MAX_LEN   (1 << 20)
+
+// Erlang: log_async_enable(Opts)
+ERL_NIF_TERM x_log_async_enable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_log_async_enable()";
+
+    if (!enif_is_list(env, argv[0]))
+    {
+        return enif_make_badarg(env);
+    }
+
+    int len = LOG_QUEUE_LEN;
+    bool block = false;
+    char atom[8];
+    ERL_NIF_TERM opt;
+    if (get_opt(env, argv[0], "queue", &opt) &&
+        (!enif_get_int(env, opt, &len) || len <= 0 || len > LOG_QUEUE_MAX_LEN))
+    {
+        return enif_make_badarg(env);
+    }
+    if (get_opt(env, argv[0], "when_full", &opt))
+    {
+        if (!enif_get_atom(env, opt, atom, sizeof(atom), ERL_NIF_LATIN1))
+            return enif_make_badarg(env);
+        if (strcmp(atom, "block") == 0)
+            block = true;
+        else if (strcmp(atom, "drop") != 0)
+            return enif_make_badarg(env);
+    }
+
+    int err = logger.startAsync(len, block);
+    if (err != 0)
+    {
+        logger.error(MOD_NAME, func_name, "unable to start log writer: %s", strerror(err));
+        return make_error_tuple(env, err);
+    }
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: log_async_disable()
+ERL_NIF_TERM x_log_async_disable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    logger.stopAsync();
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: log_dropped()
+ERL_NIF_TERM x_log_dropped(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return enif_make_uint64(env, logger.getDropped());
+}
+
 ErlNifFunc nif_funcs[] =
 {
     {"add_stderr_log_handler", 0, x_add_stderr_log_handler},
     {"add_sys_log_handler", 0, x_add_sys_log_handler},
     {"add_file_log_handler", 1, x_add_file_log_handler},
+    {"add_rolling_file_log_handler", 2, x_add_rolling_file_log_handler},
     {"set_log_level", 1, x_set_log_level},
+    {"log_async_enable", 1, x_log_async_enable},
+    {"log_async_disable", 0, x_log_async_disable},
+    {"log_dropped", 0, x_log_dropped},
     {"create", 0, x_create},
     {"create", 1, x_create_with_user},
     {"conf_read_file", 1, x_conf_read_file},
     {"conf_read_file", 2, x_conf_read_file2},
     {"conf_set", 3, x_conf_set},
-    {"connect", 1, x_connect},
+    {"connect", 1, x_connect, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"connect_async", 3, x_connect_async},
     {"shutdown", 1, x_shutdown},
     {"get_instance_id", 1, x_get_instance_id},
     {"pool_list", 1, x_pool_list},
@@ -325,7 +1062,7 @@ ErlNifFunc nif_funcs[] =
     {"pool_create", 3, x_pool_create_for_user},
     {"pool_delete", 2, x_pool_delete},
     {"ioctx_create", 2, x_ioctx_create},
-    {"ioctx_destroy", 1, x_ioctx_destroy},
+    {"ioctx_destroy", 1, x_ioctx_destroy, ERL_NIF_DIRTY_JOB_IO_BOUND},
     {"ioctx_pool_stat", 1, x_ioctx_pool_stat},
     {"ioctx_pool_set_auid", 2, x_ioctx_pool_set_auid},
     {"ioctx_pool_get_auid", 1, x_ioctx_pool_get_auid},
@@ -334,11 +1071,50 @@ ErlNifFunc nif_funcs[] =
     {"ioctx_snap_create", 2, x_ioctx_snap_create},
     {"ioctx_snap_remove", 2, x_ioctx_snap_remove},
     {"rollback", 3, x_rollback},
+    {"rollback_many", 4, x_rollback_many},
     {"ioctx_snap_list", 1, x_ioctx_snap_list},
+    {"ioctx_snap_list_full", 1, x_ioctx_snap_list_full},
     {"ioctx_snap_lookup", 2, x_ioctx_snap_lookup},
     {"ioctx_snap_get_name", 2, x_ioctx_snap_get_name},
     {"ioctx_snap_get_stamp", 2, x_ioctx_snap_get_stamp},
+    {"ioctx_snap_set_read", 2, x_ioctx_snap_set_read},
+    {"ioctx_selfmanaged_snap_create", 1, x_ioctx_selfmanaged_snap_create},
+    {"ioctx_selfmanaged_snap_remove", 2, x_ioctx_selfmanaged_snap_remove},
+    {"ioctx_selfmanaged_snap_rollback", 3, x_ioctx_selfmanaged_snap_rollback},
+    {"ioctx_selfmanaged_snap_set_write_ctx", 3, x_ioctx_selfmanaged_snap_set_write_ctx},
     {"aio_flush", 1, x_aio_flush},
+    {"pool_scan", 4, x_pool_scan},
+    {"pool_changes", 4, x_pool_changes},
+    {"job_cancel", 1, x_job_cancel},
+    {"objects_list_stream", 3, x_objects_list_stream},
+    {"objects_list_stream_ack", 2, x_objects_list_stream_ack},
+    {"cache_enable", 2, x_cache_enable},
+    {"cache_disable", 1, x_cache_disable},
+    {"cache_stats", 1, x_cache_stats},
+    {"meta_cache_enable", 2, x_meta_cache_enable},
+    {"meta_cache_disable", 1, x_meta_cache_disable},
+    {"meta_cache_stats", 1, x_meta_cache_stats},
+    {"watch", 3, x_watch},
+    {"cache_watch", 2, x_cache_watch},
+    {"unwatch", 1, x_unwatch},
+    {"notify", 3, x_notify, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"shm_cache_open", 2, x_shm_cache_open},
+    {"shm_cache_close", 0, x_shm_cache_close},
+    {"shm_cache_enable", 1, x_shm_cache_enable},
+    {"shm_cache_disable", 1, x_shm_cache_disable},
+    {"shm_cache_stats", 0, x_shm_cache_stats},
+    {"disk_cache_open", 2, x_disk_cache_open, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"disk_cache_close", 0, x_disk_cache_close},
+    {"disk_cache_enable", 1, x_disk_cache_enable},
+    {"disk_cache_disable", 1, x_disk_cache_disable},
+    {"disk_cache_stats", 0, x_disk_cache_stats},
+    {"journal_enable", 3, x_journal_enable, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"journal_disable", 1, x_journal_disable, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"journal_flush", 1, x_journal_flush, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"journal_stats", 1, x_journal_stats},
+    {"coalesce_enable", 1, x_coalesce_enable},
+    {"coalesce_disable", 1, x_coalesce_disable},
+    {"coalesce_stats", 0, x_coalesce_stats},
     {"write", 4, x_write},
     {"write_full", 3, x_write_full},
     {"append", 3, x_append},
@@ -347,7 +1123,11 @@ ErlNifFunc nif_funcs[] =
     {"trunc", 3, x_trunc},
     {"stat", 2, x_stat},
     {"objects_list_open", 1, x_objects_list_open},
+    {"objects_list_open", 2, x_objects_list_open2},
     {"objects_list_next", 1, x_objects_list_next},
+    {"objects_list_next", 2, x_objects_list_next_batch},
+    {"objects_list_position", 1, x_objects_list_position},
+    {"objects_list_seek", 2, x_objects_list_seek},
     {"objects_list_close", 1, x_objects_list_close},
     {"getxattr", 3, x_getxattr},
     {"setxattr", 4, x_setxattr},
@@ -355,6 +1135,14 @@ ErlNifFunc nif_funcs[] =
     {"getxattrs", 2, x_getxattrs},
     {"getxattrs_next", 1, x_getxattrs_next},
     {"getxattrs_end", 1, x_getxattrs_end},
+    {"getxattrs_map", 2, x_getxattrs_map},
+    {"getxattr_many", 3, x_getxattr_many},
+    {"setxattr_many", 3, x_setxattr_many},
+    {"omap_set", 3, x_omap_set},
+    {"omap_rm_keys", 3, x_omap_rm_keys},
+    {"omap_get_vals", 4, x_omap_get_vals},
+    {"omap_get_keys", 4, x_omap_get_keys},
+    {"omap_get_vals_by_keys", 3, x_omap_get_vals_by_keys},
 };
 
 ERL_NIF_INIT(rados, nif_funcs, load, reload, upgrade, unload)
@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+#include <errno.h>
+#include <string>
+#include <vector>
+
+#include "rados_nif.h"
+#include "rados_cache.h"
+
+static const char* MOD_NAME = "rados_omap";
+
+/*
+ * Collect a list of keys from Erlang. Keys may be binaries or strings,
+ * and may contain any byte, so we keep their lengths along. Only the
+ * start key of the paging ops cannot contain a NUL byte.
+ */
+static int get_key_list(ErlNifEnv* env, ERL_NIF_TERM list,
+                        vector<const char*>& keys, vector<size_t>& lens)
+{
+    ERL_NIF_TERM head, tail = list;
+    while (enif_get_list_cell(env, tail, &head, &tail))
+    {
+        ErlNifBinary kbin;
+        if (!enif_inspect_iolist_as_binary(env, head, &kbin))
+            return 0;
+        keys.push_back((const char*)kbin.data);
+        lens.push_back(kbin.size);
+    }
+    return enif_is_empty_list(env, tail);
+}
+
+/*
+ * Drain an omap iterator into a list of {Key, Value} tuples, or a list
+ * of keys when with_vals is 0. The iterator is always closed.
+ */
+static int omap_iter_to_list(ErlNifEnv* env, rados_omap_iter_t iter, int with_vals, ERL_NIF_TERM* list)
+{
+    vector<ERL_NIF_TERM> items;
+    items.reserve(rados_omap_iter_size(iter));
+    while (1)
+    {
+        char * key = NULL;
+        char * val = NULL;
+        size_t key_len = 0;
+        size_t val_len = 0;
+        int err = rados_omap_get_next2(iter, &key, &val, &key_len, &val_len);
+        if (err < 0)
+        {
+            rados_omap_get_end(iter);
+            return err;
+        }
+        if (key == NULL)
+            break;
+
+        ERL_NIF_TERM k;
+        memcpy(enif_make_new_binary(env, key_len, &k), key, key_len);
+        if (with_vals)
+        {
+            ERL_NIF_TERM v;
+            memcpy(enif_make_new_binary(env, val_len, &v), val, val_len);
+            items.push_back(enif_make_tuple2(env, k, v));
+        }
+        else
+            items.push_back(k);
+    }
+    rados_omap_get_end(iter);
+
+    *list = enif_make_list_from_array(env, items.empty() ? NULL : &items[0], items.size());
+    return 0;
+}
+
+// Erlang: omap_set(IoCtx, Oid, KeyVals)
+ERL_NIF_TERM x_omap_set(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_omap_set()";
+
+    uint64_t id;
+    char oid[MAX_NAME_LEN];
+    memset(oid, 0, MAX_NAME_LEN);
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_get_string(env, argv[1], oid, MAX_NAME_LEN, ERL_NIF_LATIN1) ||
+        !enif_is_map(env, argv[2]))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    vector<const char*> keys;
+    vector<const char*> vals;
+    vector<size_t> key_lens;
+    vector<size_t> val_lens;
+    ErlNifMapIterator it;
+    enif_map_iterator_create(env, argv[2], &it, ERL_NIF_MAP_ITERATOR_FIRST);
+    ERL_NIF_TERM k, v;
+    while (enif_map_iterator_get_pair(env, &it, &k, &v))
+    {
+        ErlNifBinary kbin, vbin;
+        if (!enif_inspect_iolist_as_binary(env, k, &kbin) ||
+            !enif_inspect_binary(env, v, &vbin))
+        {
+            enif_map_iterator_destroy(env, &it);
+            logger.error(MOD_NAME, func_name, "invalid key or value");
+            return enif_make_badarg(env);
+        }
+        keys.push_back((const char*)kbin.data);
+        key_lens.push_back(kbin.size);
+        vals.push_back((const char*)vbin.data);
+        val_lens.push_back(vbin.size);
+        enif_map_iterator_next(env, &it);
+    }
+    enif_map_iterator_destroy(env, &it);
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    if (keys.empty())
+        return enif_make_atom(env, "ok");
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "io=%ld, oid=%s, keys=%d", id, oid, (int)keys.size());
+
+    rados_write_op_t op = rados_create_write_op();
+    rados_write_op_omap_set2(op, &keys[0], &vals[0], &key_lens[0], &val_lens[0], keys.size());
+    int err = rados_write_op_operate(op, io, oid, NULL, LIBRADOS_OPERATION_NOFLAG);
+    cache_invalidate(id, oid);
+    rados_release_write_op(op);
+    if (err < 0)
+    {
+        logger.error(MOD_NAME, func_name, "omap set failed: io=%ld, oid=%s: %s", id, oid, strerror(-err));
+        return make_error_tuple(env, -err);
+    }
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: omap_rm_keys(IoCtx, Oid, Keys)
+ERL_NIF_TERM x_omap_rm_keys(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_omap_rm_keys()";
+
+    uint64_t id;
+    char oid[MAX_NAME_LEN];
+    memset(oid, 0, MAX_NAME_LEN);
+    vector<const char*> keys;
+    vector<size_t> key_lens;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_get_string(env, argv[1], oid, MAX_NAME_LEN, ERL_NIF_LATIN1) ||
+        !get_key_list(env, argv[2], keys, key_lens))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    if (keys.empty())
+        return enif_make_atom(env, "ok");
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "io=%ld, oid=%s, keys=%d", id, oid, (int)keys.size());
+
+    rados_write_op_t op = rados_create_write_op();
+    rados_write_op_omap_rm_keys2(op, &keys[0], &key_lens[0], keys.size());
+    int err = rados_write_op_operate(op, io, oid, NULL, LIBRADOS_OPERATION_NOFLAG);
+    cache_invalidate(id, oid);
+    rados_release_write_op(op);
+    if (err < 0)
+    {
+        logger.error(MOD_NAME, func_name, "omap rm keys failed: io=%ld, oid=%s: %s", id, oid, strerror(-err));
+        return make_error_tuple(env, -err);
+    }
+
+    return enif_make_atom(env, "ok");
+}
+
+/*
+ * Common part of omap_get_vals and omap_get_keys, which are paginated
+ * by the start-after key and the maximum number of entries to return.
+ */
+static ERL_NIF_TERM omap_get_page(ErlNifEnv* env, const ERL_NIF_TERM argv[], int with_vals, const char * func_name)
+{
+    uint64_t id;
+    char oid[MAX_NAME_LEN];
+    memset(oid, 0, MAX_NAME_LEN);
+    ErlNifBinary start_bin;
+    uint64_t max_return;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_get_string(env, argv[1], oid, MAX_NAME_LEN, ERL_NIF_LATIN1) ||
+        !enif_inspect_iolist_as_binary(env, argv[2], &start_bin) ||
+        !enif_get_uint64(env, argv[3], &max_return))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    // The paging ops take the start key as a C string.
+    if (memchr(start_bin.data, 0, start_bin.size) != NULL)
+    {
+        logger.error(MOD_NAME, func_name, "start key with a NUL byte");
+        return enif_make_badarg(env);
+    }
+    string start_after((const char*)start_bin.data, start_bin.size);
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "io=%ld, oid=%s, max=%ld", id, oid, max_return);
+
+    rados_omap_iter_t iter = NULL;
+    unsigned char more = 0;
+    int rval = 0;
+    rados_read_op_t op = rados_create_read_op();
+    if (with_vals)
+        rados_read_op_omap_get_vals2(op, start_after.c_str(), NULL, max_return, &iter, &more, &rval);
+    else
+        rados_read_op_omap_get_keys2(op, start_after.c_str(), max_return, &iter, &more, &rval);
+    int err = rados_read_op_operate(op, io, oid, LIBRADOS_OPERATION_NOFLAG);
+    rados_release_read_op(op);
+    if (err < 0 || rval < 0)
+    {
+        err = (err < 0) ? err : rval;
+        logger.error(MOD_NAME, func_name, "omap read failed: io=%ld, oid=%s: %s", id, oid, strerror(-err));
+        // The iterator is set up even when the op fails
+        if (iter != NULL)
+            rados_omap_get_end(iter);
+        return make_error_tuple(env, -err);
+    }
+
+    ERL_NIF_TERM list;
+    err = omap_iter_to_list(env, iter, with_vals, &list);
+    if (err < 0)
+        return make_error_tuple(env, -err);
+
+    return enif_make_tuple3(env,
+                            enif_make_atom(env, "ok"),
+                            list,
+                            enif_make_atom(env, more ? "true" : "false"));
+}
+
+// Erlang: omap_get_vals(IoCtx, Oid, StartAfter, MaxReturn)
+ERL_NIF_TERM x_omap_get_vals(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return omap_get_page(env, argv, 1, "x_omap_get_vals()");
+}
+
+// Erlang: omap_get_keys(IoCtx, Oid, StartAfter, MaxReturn)
+ERL_NIF_TERM x_omap_get_keys(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return omap_get_page(env, argv, 0, "x_omap_get_keys()");
+}
+
+// Erlang: omap_get_vals_by_keys(IoCtx, Oid, Keys)
+ERL_NIF_TERM x_omap_get_vals_by_keys(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_omap_get_vals_by_keys()";
+
+    uint64_t id;
+    char oid[MAX_NAME_LEN];
+    memset(oid, 0, MAX_NAME_LEN);
+    vector<const char*> keys;
+    vector<size_t> key_lens;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_get_string(env, argv[1], oid, MAX_NAME_LEN, ERL_NIF_LATIN1) ||
+        !get_key_list(env, argv[2], keys, key_lens))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    if (keys.empty())
+        return enif_make_tuple2(env,
+                                enif_make_atom(env, "ok"),
+                                enif_make_list(env, 0));
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "io=%ld, oid=%s, keys=%d", id, oid, (int)keys.size());
+
+    // All the keys are looked up in a single read op.
+    rados_omap_iter_t iter = NULL;
+    int rval = 0;
+    rados_read_op_t op = rados_create_read_op();
+    rados_read_op_omap_get_vals_by_keys2(op, &keys[0], keys.size(), &key_lens[0], &iter, &rval);
+    int err = rados_read_op_operate(op, io, oid, LIBRADOS_OPERATION_NOFLAG);
+    rados_release_read_op(op);
+    if (err < 0 || rval < 0)
+    {
+        err = (err < 0) ? err : rval;
+        logger.error(MOD_NAME, func_name, "omap read failed: io=%ld, oid=%s: %s", id, oid, strerror(-err));
+        // The iterator is set up even when the op fails
+        if (iter != NULL)
+            rados_omap_get_end(iter);
+        return make_error_tuple(env, -err);
+    }
+
+    ERL_NIF_TERM list;
+    err = omap_iter_to_list(env, iter, 1, &list);
+    if (err < 0)
+        return make_error_tuple(env, -err);
+
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            list);
+}
@@ -0,0 +1,440 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+#include <errno.h>
+#include <deque>
+#include <vector>
+
+#include "rados_nif.h"
+#include "rados_cache.h"
+#include "rados_journal.h"
+
+static const char* MOD_NAME = "rados_rollback";
+
+#define ROLLBACK_PARALLEL        16
+#define ROLLBACK_MAX_PARALLEL    256
+#define ROLLBACK_PROGRESS_EVERY  1000
+#define ROLLBACK_LIST_BATCH      1000
+#define ROLLBACK_SLICE           64
+
+/*
+ * A rollback of many objects to a snapshot. The objects are either given
+ * or listed from the pool as the rollback goes. A single work item drives
+ * the rollback: it keeps a bounded number of asynchronous rollbacks in
+ * flight, and lists the pool when it runs out of objects, so that neither
+ * the listing nor the rollbacks hold threads of the work pool each.
+ *
+ * Messages sent to the owner process, tagged with rados_rollback:
+ *
+ *   {progress, Done, Failed}    objects rolled back and failed so far
+ *   {error, Oid, Reason}        an object could not be rolled back
+ *   {error, Reason}             the listing of the pool has failed
+ *   {done, Done, Failed}        all the objects are processed
+ */
+class RollbackJob : public RadosJob
+{
+public:
+    RollbackJob(const ErlNifPid& pid, uint64_t io_id, rados_ioctx_t io, rados_snap_t snap_id,
+                int parallel) :
+        RadosJob("rados_rollback", pid),
+        progress_every(ROLLBACK_PROGRESS_EVERY),
+        io_id(io_id),
+        io(io),
+        snap_id(snap_id),
+        parallel(parallel),
+        listing(false),
+        cursor(NULL),
+        finish(NULL),
+        done(0),
+        failed(0)
+    {
+    }
+
+    ~RollbackJob()
+    {
+        if (cursor != NULL)
+            rados_object_list_cursor_free(io, cursor);
+        if (finish != NULL)
+            rados_object_list_cursor_free(io, finish);
+        rados_ioctx_destroy(io);
+    }
+
+    void add(const char* oid)
+    {
+        oids.push_back(oid);
+    }
+
+    /*
+     * List the whole pool, instead of the objects added.
+     */
+    void listAll()
+    {
+        listing = true;
+        cursor = rados_object_list_begin(io);
+        finish = rados_object_list_end(io);
+    }
+
+    /*
+     * Get the next object to roll back. Returns 1, 0 when there is none
+     * left, or a negative error code if the listing failed. Only called
+     * by the work item of the job.
+     */
+    int next(string& oid)
+    {
+        while (oids.empty() && listing)
+        {
+            int err = list();
+            if (err < 0)
+            {
+                listing = false;
+                return err;
+            }
+        }
+        if (oids.empty())
+            return 0;
+        oid = oids.front();
+        oids.pop_front();
+        return 1;
+    }
+
+    /*
+     * Start the rollback of an object. Returns the completion, or NULL
+     * with the error code in err.
+     */
+    rados_completion_t start(const char* oid, int* err)
+    {
+        journal_drain(io_id, oid);
+        rados_completion_t c;
+        *err = rados_aio_create_completion(NULL, NULL, NULL, &c);
+        if (*err < 0)
+            return NULL;
+        rados_write_op_t op = rados_create_write_op();
+        rados_write_op_rollback(op, snap_id);
+        *err = rados_aio_write_op_operate(op, io, c, oid, NULL, 0);
+        rados_release_write_op(op);
+        if (*err < 0)
+        {
+            rados_aio_release(c);
+            return NULL;
+        }
+        return c;
+    }
+
+    /*
+     * Count an object processed. Returns true when a progress message is
+     * due.
+     */
+    bool count(const char* oid, bool ok)
+    {
+        cache_invalidate(io_id, oid);
+        if (ok)
+            done++;
+        else
+            failed++;
+        return (done + failed) % progress_every == 0;
+    }
+
+    uint64_t getDone() { return done; }
+    uint64_t getFailed() { return failed; }
+    int getParallel() { return parallel; }
+
+    uint64_t progress_every;
+
+private:
+    /*
+     * List the next batch of objects.
+     */
+    int list()
+    {
+        vector<rados_object_list_item> items(ROLLBACK_LIST_BATCH);
+        rados_object_list_cursor next = NULL;
+        int num = rados_object_list(io, cursor, finish, ROLLBACK_LIST_BATCH,
+                                    NULL, 0, &items[0], &next);
+        if (num < 0)
+            return num;
+
+        rados_object_list_cursor_free(io, cursor);
+        cursor = next;
+        for (int i = 0; i < num; i++)
+            oids.push_back(string(items[i].oid, items[i].oid_length));
+        if (num > 0)
+            rados_object_list_free(num, &items[0]);
+
+        if (rados_object_list_cursor_cmp(io, cursor, finish) >= 0)
+            listing = false;
+        return 0;
+    }
+
+    uint64_t io_id;             // Io context of the caller, for its caches
+    rados_ioctx_t io;
+    rados_snap_t snap_id;
+    int parallel;               // Rollbacks in flight at most
+
+    deque<string> oids;
+    bool listing;
+    rados_object_list_cursor cursor;
+    rados_object_list_cursor finish;
+
+    uint64_t done;
+    uint64_t failed;
+};
+
+class RollbackWorker : public XWorkItem
+{
+public:
+    RollbackWorker(RollbackJob* job) :
+        job(job),
+        more(true),
+        msg_env(enif_alloc_env())
+    {
+        job->keep();
+    }
+
+    ~RollbackWorker()
+    {
+        enif_free_env(msg_env);
+        job->release();
+    }
+
+    Status run()
+    {
+        for (int i = 0; i < ROLLBACK_SLICE; i++)
+        {
+            if (job->isCancelled())
+                more = false;
+
+            // Fill the window, then wait for a rollback to finish.
+            while (more && (int)in_flight.size() < job->getParallel())
+            {
+                string oid;
+                int err = job->next(oid);
+                if (err < 0)
+                {
+                    logger.error(MOD_NAME, "RollbackWorker::run()", "listing failed for job %ld: %s",
+                                 job->getId(), strerror(-err));
+                    job->send(msg_env,
+                              enif_make_tuple2(msg_env,
+                                               enif_make_atom(msg_env, "error"),
+                                               enif_make_string(msg_env, strerror(-err), ERL_NIF_LATIN1)));
+                    more = false;
+                    break;
+                }
+                if (err == 0)
+                {
+                    more = false;
+                    break;
+                }
+
+                rados_completion_t c = job->start(oid.c_str(), &err);
+                if (c == NULL)
+                    finishOne(oid, err);
+                else
+                    in_flight.push_back(Op(oid, c));
+            }
+            if (in_flight.empty())
+                return finishWorker();
+
+            reap();
+        }
+
+        // Give the other work items a turn.
+        return AGAIN;
+    }
+
+    void abort()
+    {
+        job->cancel();
+        while (!in_flight.empty())
+            reap();
+        finishWorker();
+    }
+
+private:
+    typedef pair<string, rados_completion_t> Op;
+
+    /*
+     * Process the rollbacks finished, waiting for the oldest one if none
+     * is.
+     */
+    void reap()
+    {
+        bool any = false;
+        for (size_t i = 0; i < in_flight.size(); )
+        {
+            if (!rados_aio_is_complete(in_flight[i].second))
+            {
+                i++;
+                continue;
+            }
+            complete(in_flight[i]);
+            in_flight.erase(in_flight.begin() + i);
+            any = true;
+        }
+        if (!any)
+        {
+            rados_aio_wait_for_complete(in_flight.front().second);
+            complete(in_flight.front());
+            in_flight.pop_front();
+        }
+    }
+
+    void complete(Op& op)
+    {
+        int err = rados_aio_get_return_value(op.second);
+        rados_aio_release(op.second);
+        finishOne(op.first, err);
+    }
+
+    void finishOne(const string& oid, int err)
+    {
+        if (err < 0)
+        {
+            ERL_NIF_TERM term;
+            memcpy(enif_make_new_binary(msg_env, oid.size(), &term), oid.data(), oid.size());
+            job->send(msg_env,
+                      enif_make_tuple3(msg_env,
+                                       enif_make_atom(msg_env, "error"),
+                                       term,
+                                       enif_make_string(msg_env, strerror(-err), ERL_NIF_LATIN1)));
+        }
+        if (job->count(oid.c_str(), err >= 0))
+            sendCounts("progress");
+    }
+
+    void sendCounts(const char * what)
+    {
+        job->send(msg_env,
+                  enif_make_tuple3(msg_env,
+                                   enif_make_atom(msg_env, what),
+                                   enif_make_uint64(msg_env, job->getDone()),
+                                   enif_make_uint64(msg_env, job->getFailed())));
+    }
+
+    Status finishWorker()
+    {
+        sendCounts("done");
+        RadosJob * j = map_job_remove(job->getId());
+        if (j != NULL)
+            j->release();
+        return DONE;
+    }
+
+    RollbackJob * job;
+    bool more;                  // Whether objects may be left to start
+    deque<Op> in_flight;
+    ErlNifEnv * msg_env;
+};
+
+// Erlang: rollback_many(IoCtx, Oids | all, Snap, Opts)
+ERL_NIF_TERM x_rollback_many(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_rollback_many()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_is_list(env, argv[3]))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    // A pool snapshot is given by name, a self-managed one by id.
+    char snap[MAX_NAME_LEN];
+    rados_snap_t snap_id = 0;
+    bool selfmanaged = enif_get_uint64(env, argv[2], &snap_id);
+    if (!selfmanaged && !get_name_arg(env, argv[2], snap, MAX_NAME_LEN))
+    {
+        logger.error(MOD_NAME, func_name, "invalid snapshot");
+        return enif_make_badarg(env);
+    }
+
+    char atom[8];
+    bool all = enif_get_atom(env, argv[1], atom, sizeof(atom), ERL_NIF_LATIN1) &&
+               strcmp(atom, "all") == 0;
+    if (!all && !enif_is_list(env, argv[1]))
+    {
+        logger.error(MOD_NAME, func_name, "invalid object list");
+        return enif_make_badarg(env);
+    }
+
+    int parallel = ROLLBACK_PARALLEL;
+    uint64_t progress_every = ROLLBACK_PROGRESS_EVERY;
+    ErlNifPid pid;
+    enif_self(env, &pid);
+    ERL_NIF_TERM opt;
+    if ((get_opt(env, argv[3], "parallel", &opt) &&
+         (!enif_get_int(env, opt, &parallel) || parallel <= 0 || parallel > ROLLBACK_MAX_PARALLEL)) ||
+        (get_opt(env, argv[3], "progress", &opt) &&
+         (!enif_get_uint64(env, opt, &progress_every) || progress_every == 0)) ||
+        (get_opt(env, argv[3], "pid", &opt) &&
+         !enif_get_local_pid(env, opt, &pid)))
+    {
+        logger.error(MOD_NAME, func_name, "invalid options");
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    // The rollbacks are made by snapshot id, whatever the snapshot.
+    int err;
+    if (!selfmanaged && (err = rados_ioctx_snap_lookup(io, snap, &snap_id)) < 0)
+    {
+        logger.error(MOD_NAME, func_name, "unable to find snapshot %s: %s", snap, strerror(-err));
+        return make_error_tuple(env, -err);
+    }
+
+    rados_ioctx_t job_io;
+    err = ioctx_dup(io, &job_io);
+    if (err < 0)
+    {
+        logger.error(MOD_NAME, func_name, "unable to create ioctx for rollback: %s", strerror(-err));
+        return make_error_tuple(env, -err);
+    }
+    write_ctx_t ctx;
+    if (map_write_ctx_get(id, &ctx) && (err = ioctx_set_write_ctx(job_io, ctx)) < 0)
+    {
+        logger.error(MOD_NAME, func_name, "unable to set write context for rollback: %s", strerror(-err));
+        rados_ioctx_destroy(job_io);
+        return make_error_tuple(env, -err);
+    }
+
+    RollbackJob * job = new RollbackJob(pid, id, job_io, snap_id, parallel);
+    job->progress_every = progress_every;
+    if (all)
+    {
+        job->listAll();
+    }
+    else
+    {
+        char oid[MAX_NAME_LEN];
+        ERL_NIF_TERM head, tail = argv[1];
+        while (enif_get_list_cell(env, tail, &head, &tail))
+        {
+            if (!get_name_arg(env, head, oid, MAX_NAME_LEN))
+            {
+                job->release();
+                logger.error(MOD_NAME, func_name, "invalid object name");
+                return enif_make_badarg(env);
+            }
+            job->add(oid);
+        }
+    }
+    map_job_add(job->getId(), job);
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx=%ld, job=%ld, parallel=%d", id, job->getId(), parallel);
+
+    work_pool->submit(new RollbackWorker(job));
+
+    ERL_NIF_TERM ret = enif_make_tuple2(env,
+                                        enif_make_atom(env, "ok"),
+                                        enif_make_uint64(env, job->getId()));
+    job->release();
+    return ret;
+}
@@ -0,0 +1,810 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+#include <errno.h>
+#include <vector>
+
+#include "rados_nif.h"
+
+static const char* MOD_NAME = "rados_scan";
+
+#define SCAN_BATCH_SIZE       1000
+#define SCAN_PROGRESS_EVERY   10000
+#define SCAN_MAX_SHARDS       1024
+#define SCAN_SLICE_BATCHES    4
+
+/*
+ * A parallel scan of a whole pool. The object namespace of the pool is
+ * split into shards with rados_object_list_slice(), and each shard is
+ * listed by its own work item on the work pool.
+ *
+ * Messages sent to the owner process, tagged with rados_scan:
+ *
+ *   {objects, Shard, [Oid|...]}     a batch of object names
+ *   {progress, Shard, Scanned}      objects listed so far in the shard,
+ *                                   including those filtered out
+ *   {error, Shard, Reason}          the shard has stopped on an error
+ *   {shard_done, Shard, Scanned}    the shard is finished
+ *   done                            all the shards are finished
+ */
+class ScanJob : public RadosJob
+{
+public:
+    ScanJob(const ErlNifPid& pid, rados_ioctx_t io, int shards,
+            const char* tag = "rados_scan") :
+        RadosJob(tag, pid),
+        io(io),
+        batch_size(SCAN_BATCH_SIZE),
+        progress_every(SCAN_PROGRESS_EVERY),
+        shards_left(shards)
+    {
+    }
+
+    ~ScanJob()
+    {
+        rados_ioctx_destroy(io);
+    }
+
+    /*
+     * Make the term sent for an object listed, or return false to leave
+     * the object out.
+     */
+    virtual bool report(ErlNifEnv* msg_env, const char* oid, size_t len, ERL_NIF_TERM* term)
+    {
+        if (!filter.match(oid, len))
+            return false;
+        memcpy(enif_make_new_binary(msg_env, len, term), oid, len);
+        return true;
+    }
+
+    /*
+     * Called when a shard is finished. Returns true for the last one.
+     */
+    bool shardDone()
+    {
+        return __sync_sub_and_fetch(&shards_left, 1) == 0;
+    }
+
+    rados_ioctx_t io;
+    size_t batch_size;
+    uint64_t progress_every;
+    ObjectFilter filter;
+
+private:
+    volatile int shards_left;
+};
+
+class ScanShard : public XWorkItem
+{
+public:
+    ScanShard(ScanJob* job, int shard,
+              rados_object_list_cursor start, rados_object_list_cursor finish) :
+        job(job),
+        shard(shard),
+        cursor(start),
+        finish(finish),
+        scanned(0),
+        msg_env(enif_alloc_env())
+    {
+        job->keep();
+    }
+
+    ~ScanShard()
+    {
+        rados_object_list_cursor_free(job->io, cursor);
+        rados_object_list_cursor_free(job->io, finish);
+        enif_free_env(msg_env);
+        job->release();
+    }
+
+    Status run()
+    {
+        vector<rados_object_list_item> items(job->batch_size);
+        for (int i = 0; i < SCAN_SLICE_BATCHES; i++)
+        {
+            if (job->isCancelled())
+                return finishShard();
+
+            rados_object_list_cursor next = NULL;
+            int num = rados_object_list(job->io, cursor, finish, job->batch_size,
+                                        NULL, 0, &items[0], &next);
+            if (num < 0)
+            {
+                logger.error(MOD_NAME, "ScanShard::run()", "listing failed for shard %d of job %ld: %s",
+                             shard, job->getId(), strerror(-num));
+                job->send(msg_env,
+                          enif_make_tuple3(msg_env,
+                                           enif_make_atom(msg_env, "error"),
+                                           enif_make_int(msg_env, shard),
+                                           enif_make_string(msg_env, strerror(-num), ERL_NIF_LATIN1)));
+                return finishShard();
+            }
+
+            rados_object_list_cursor_free(job->io, cursor);
+            cursor = next;
+
+            if (num > 0)
+            {
+                ERL_NIF_TERM term_list = enif_make_list(msg_env, 0);
+                int matched = 0;
+                for (int j = num - 1; j >= 0; j--)
+                {
+                    ERL_NIF_TERM t;
+                    if (!job->report(msg_env, items[j].oid, items[j].oid_length, &t))
+                        continue;
+                    matched++;
+                    term_list = enif_make_list_cell(msg_env, t, term_list);
+                }
+                rados_object_list_free(num, &items[0]);
+
+                if (matched > 0)
+                    job->send(msg_env,
+                              enif_make_tuple3(msg_env,
+                                               enif_make_atom(msg_env, "objects"),
+                                               enif_make_int(msg_env, shard),
+                                               term_list));
+                else
+                    enif_clear_env(msg_env);
+
+                uint64_t before = scanned;
+                scanned += num;
+                if (scanned / job->progress_every != before / job->progress_every)
+                    sendCount("progress");
+            }
+
+            if (rados_object_list_cursor_cmp(job->io, cursor, finish) >= 0)
+                return finishShard();
+        }
+
+        // Give the other work items a turn.
+        return AGAIN;
+    }
+
+    /*
+     * The shard is counted as finished, so that the job is removed and
+     * its owner told once the last shard is done.
+     */
+    void abort()
+    {
+        job->cancel();
+        finishShard();
+    }
+
+private:
+    void sendCount(const char * what)
+    {
+        job->send(msg_env,
+                  enif_make_tuple3(msg_env,
+                                   enif_make_atom(msg_env, what),
+                                   enif_make_int(msg_env, shard),
+                                   enif_make_uint64(msg_env, scanned)));
+    }
+
+    Status finishShard()
+    {
+        sendCount("shard_done");
+        if (job->shardDone())
+        {
+            job->send(msg_env, enif_make_atom(msg_env, "done"));
+            RadosJob * j = map_job_remove(job->getId());
+            if (j != NULL)
+                j->release();
+        }
+        return DONE;
+    }
+
+    ScanJob * job;
+    int shard;
+    rados_object_list_cursor cursor;
+    rados_object_list_cursor finish;
+    uint64_t scanned;
+    ErlNifEnv * msg_env;
+};
+
+/*
+ * Split the pool of a job into shards, and submit a work item per shard.
+ */
+static void scan_start(ScanJob* job, int shards)
+{
+    rados_object_list_cursor begin = rados_object_list_begin(job->io);
+    rados_object_list_cursor end = rados_object_list_end(job->io);
+    for (int i = 0; i < shards; i++)
+    {
+        rados_object_list_cursor start;
+        rados_object_list_cursor finish;
+        rados_object_list_slice(job->io, begin, end, i, shards, &start, &finish);
+        work_pool->submit(new ScanShard(job, i, start, finish));
+    }
+    rados_object_list_cursor_free(job->io, begin);
+    rados_object_list_cursor_free(job->io, end);
+}
+
+// Erlang: pool_scan(IoCtx, Pid, Shards, Opts)
+ERL_NIF_TERM x_pool_scan(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_pool_scan()";
+
+    uint64_t id;
+    ErlNifPid pid;
+    int shards;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_get_local_pid(env, argv[1], &pid) ||
+        !enif_get_int(env, argv[2], &shards) ||
+        shards <= 0 || shards > SCAN_MAX_SHARDS ||
+        !enif_is_list(env, argv[3]))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    unsigned batch_size = SCAN_BATCH_SIZE;
+    uint64_t progress_every = SCAN_PROGRESS_EVERY;
+    ERL_NIF_TERM opt;
+    if ((get_opt(env, argv[3], "batch", &opt) &&
+         (!enif_get_uint(env, opt, &batch_size) || batch_size == 0)) ||
+        (get_opt(env, argv[3], "progress", &opt) &&
+         (!enif_get_uint64(env, opt, &progress_every) || progress_every == 0)))
+    {
+        logger.error(MOD_NAME, func_name, "invalid options");
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t scan_io;
+    int err = ioctx_dup(io, &scan_io);
+    if (err < 0)
+    {
+        logger.error(MOD_NAME, func_name, "unable to create ioctx for scan: %s", strerror(-err));
+        return make_error_tuple(env, -err);
+    }
+
+    ScanJob * job = new ScanJob(pid, scan_io, shards);
+    job->batch_size = batch_size;
+    job->progress_every = progress_every;
+    if (!job->filter.parse(env, argv[3]))
+    {
+        job->release();
+        logger.error(MOD_NAME, func_name, "invalid filter");
+        return enif_make_badarg(env);
+    }
+    map_job_add(job->getId(), job);
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx=%ld, job=%ld, shards=%d", id, job->getId(), shards);
+
+    scan_start(job, shards);
+
+    ERL_NIF_TERM ret = enif_make_tuple2(env,
+                                        enif_make_atom(env, "ok"),
+                                        enif_make_uint64(env, job->getId()));
+    job->release();
+    return ret;
+}
+
+#define CHANGES_SHARDS        16
+
+/*
+ * A scan of the objects changed since a snapshot. The pool is scanned as
+ * by pool_scan(), and each object is compared with its state in the
+ * snapshot, as read through a second io context.
+ *
+ * With CHANGES_COMPARE_STAT, an object is new if it is not in the
+ * snapshot, and changed if its size or mtime differ. librados does not
+ * tell which extents of an object changed, so the whole object is
+ * reported. With CHANGES_COMPARE_MTIME, an object is changed if it was
+ * modified in the second of the snapshot or after, which takes a single
+ * stat but does not tell new objects apart. The objects removed since the
+ * snapshot are not listed, so they are not reported.
+ *
+ * The objects are sent as {Oid, new | changed, Size}, or {error, Oid,
+ * Reason} when they cannot be compared, and the messages are tagged with
+ * rados_changes instead of rados_scan.
+ */
+#define CHANGES_COMPARE_STAT  0
+#define CHANGES_COMPARE_MTIME 1
+
+class ChangeJob : public ScanJob
+{
+public:
+    ChangeJob(const ErlNifPid& pid, rados_ioctx_t io, rados_ioctx_t snap_io,
+              int shards, int compare, time_t since) :
+        ScanJob(pid, io, shards, "rados_changes"),
+        snap_io(snap_io),
+        compare(compare),
+        since(since)
+    {
+    }
+
+    ~ChangeJob()
+    {
+        rados_ioctx_destroy(snap_io);
+    }
+
+    bool report(ErlNifEnv* msg_env, const char* oid, size_t len, ERL_NIF_TERM* term)
+    {
+        if (!filter.match(oid, len))
+            return false;
+
+        string name(oid, len);
+        uint64_t size;
+        time_t mtime;
+        int err = rados_stat(io, name.c_str(), &size, &mtime);
+        if (err == -ENOENT)
+            return false;       // Removed since it was listed
+        if (err < 0)
+            return error(msg_env, oid, len, err, term);
+
+        const char * what = "changed";
+        if (compare == CHANGES_COMPARE_MTIME)
+        {
+            // The mtime has a one second resolution, a change made in the
+            // second of the snapshot may be after it.
+            if (mtime < since)
+                return false;
+        }
+        else
+        {
+            uint64_t snap_size;
+            time_t snap_mtime;
+            err = rados_stat(snap_io, name.c_str(), &snap_size, &snap_mtime);
+            if (err == -ENOENT)
+                what = "new";
+            else if (err < 0)
+                return error(msg_env, oid, len, err, term);
+            else if (snap_size == size && snap_mtime == mtime)
+                return false;
+        }
+
+        ERL_NIF_TERM bin;
+        memcpy(enif_make_new_binary(msg_env, len, &bin), oid, len);
+        *term = enif_make_tuple3(msg_env,
+                                 bin,
+                                 enif_make_atom(msg_env, what),
+                                 enif_make_uint64(msg_env, size));
+        return true;
+    }
+
+private:
+    bool error(ErlNifEnv* msg_env, const char* oid, size_t len, int err, ERL_NIF_TERM* term)
+    {
+        logger.error(MOD_NAME, "ChangeJob::report()", "unable to stat %.*s: %s",
+                     (int)len, oid, strerror(-err));
+        ERL_NIF_TERM bin;
+        memcpy(enif_make_new_binary(msg_env, len, &bin), oid, len);
+        *term = enif_make_tuple3(msg_env,
+                                 enif_make_atom(msg_env, "error"),
+                                 bin,
+                                 enif_make_string(msg_env, strerror(-err), ERL_NIF_LATIN1));
+        return true;
+    }
+
+    rados_ioctx_t snap_io;
+    int compare;
+    time_t since;
+};
+
+// Erlang: pool_changes(IoCtx, Pid, Snap, Opts)
+ERL_NIF_TERM x_pool_changes(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_pool_changes()";
+
+    uint64_t id;
+    ErlNifPid pid;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_get_local_pid(env, argv[1], &pid) ||
+        !enif_is_list(env, argv[3]))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    // A pool snapshot is given by name, a self-managed one by id.
+    char snap[MAX_NAME_LEN];
+    rados_snap_t snap_id;
+    bool selfmanaged = enif_get_uint64(env, argv[2], &snap_id);
+    if (!selfmanaged && !get_name_arg(env, argv[2], snap, MAX_NAME_LEN))
+    {
+        logger.error(MOD_NAME, func_name, "invalid snapshot");
+        return enif_make_badarg(env);
+    }
+
+    int shards = CHANGES_SHARDS;
+    unsigned batch_size = SCAN_BATCH_SIZE;
+    uint64_t progress_every = SCAN_PROGRESS_EVERY;
+    int compare = CHANGES_COMPARE_STAT;
+    char atom[MAX_NAME_LEN];
+    ERL_NIF_TERM opt;
+    if ((get_opt(env, argv[3], "shards", &opt) &&
+         (!enif_get_int(env, opt, &shards) || shards <= 0 || shards > SCAN_MAX_SHARDS)) ||
+        (get_opt(env, argv[3], "batch", &opt) &&
+         (!enif_get_uint(env, opt, &batch_size) || batch_size == 0)) ||
+        (get_opt(env, argv[3], "progress", &opt) &&
+         (!enif_get_uint64(env, opt, &progress_every) || progress_every == 0)))
+    {
+        logger.error(MOD_NAME, func_name, "invalid options");
+        return enif_make_badarg(env);
+    }
+    if (get_opt(env, argv[3], "compare", &opt))
+    {
+        if (!enif_get_atom(env, opt, atom, MAX_NAME_LEN, ERL_NIF_LATIN1))
+            return enif_make_badarg(env);
+        // Self-managed snapshots have no timestamp.
+        if (strcmp(atom, "mtime") == 0 && !selfmanaged)
+            compare = CHANGES_COMPARE_MTIME;
+        else if (strcmp(atom, "stat") != 0)
+        {
+            logger.error(MOD_NAME, func_name, "invalid compare mode: %s", atom);
+            return enif_make_badarg(env);
+        }
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    time_t since = 0;
+    int err = 0;
+    if (!selfmanaged)
+        err = rados_ioctx_snap_lookup(io, snap, &snap_id);
+    if (err == 0 && compare == CHANGES_COMPARE_MTIME)
+        err = rados_ioctx_snap_get_stamp(io, snap_id, &since);
+    if (err < 0)
+    {
+        logger.error(MOD_NAME, func_name, "snapshot lookup failed: %s", strerror(-err));
+        return make_error_tuple(env, -err);
+    }
+
+    rados_ioctx_t scan_io;
+    rados_ioctx_t snap_io;
+    err = ioctx_dup(io, &scan_io);
+    if (err < 0)
+    {
+        logger.error(MOD_NAME, func_name, "unable to create ioctx for scan: %s", strerror(-err));
+        return make_error_tuple(env, -err);
+    }
+    err = ioctx_dup(io, &snap_io);
+    if (err < 0)
+    {
+        rados_ioctx_destroy(scan_io);
+        logger.error(MOD_NAME, func_name, "unable to create ioctx for scan: %s", strerror(-err));
+        return make_error_tuple(env, -err);
+    }
+    rados_ioctx_snap_set_read(snap_io, snap_id);
+
+    ChangeJob * job = new ChangeJob(pid, scan_io, snap_io, shards, compare, since);
+    job->batch_size = batch_size;
+    job->progress_every = progress_every;
+    if (!job->filter.parse(env, argv[3]))
+    {
+        job->release();
+        logger.error(MOD_NAME, func_name, "invalid filter");
+        return enif_make_badarg(env);
+    }
+    map_job_add(job->getId(), job);
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx=%ld, job=%ld, snap=%ld, shards=%d",
+                 id, job->getId(), snap_id, shards);
+
+    scan_start(job, shards);
+
+    ERL_NIF_TERM ret = enif_make_tuple2(env,
+                                        enif_make_atom(env, "ok"),
+                                        enif_make_uint64(env, job->getId()));
+    job->release();
+    return ret;
+}
+
+#define STREAM_WINDOW         2
+
+class StreamWalker;
+
+/*
+ * A listing of a pool pushed to an Erlang process, with credit-based
+ * flow control. Each batch sent uses one credit, and the walk pauses,
+ * without holding a worker thread, when the credits are used up. The
+ * receiver grants more credits with objects_list_stream_ack/2.
+ *
+ * Messages sent to the owner process, tagged with rados_list:
+ *
+ *   {objects, [Oid|...]}     a batch of object names
+ *   {error, Reason}          the listing has stopped on an error
+ *   done                     the listing is finished
+ */
+class StreamJob : public RadosJob
+{
+public:
+    StreamJob(const ErlNifPid& pid, rados_ioctx_t io, unsigned window) :
+        RadosJob("rados_list", pid),
+        io(io),
+        batch_size(SCAN_BATCH_SIZE),
+        credits(window),
+        walker(NULL),
+        parked(false)
+    {
+    }
+
+    ~StreamJob()
+    {
+        rados_ioctx_destroy(io);
+    }
+
+    void cancel()
+    {
+        RadosJob::cancel();
+        grant(0);
+    }
+
+    /*
+     * Add credits, and resume the walk if it was paused.
+     */
+    void grant(unsigned n)
+    {
+        mutex.lock();
+        credits += n;
+        XWorkItem * w = NULL;
+        if (parked)
+        {
+            parked = false;
+            w = walker;
+        }
+        mutex.unlock();
+        if (w != NULL)
+            work_pool->submit(w);
+    }
+
+    /*
+     * Take a credit. When there is none left, the walker is parked and
+     * false is returned. A cancelled job is never parked, so that the
+     * walker gets to finish.
+     */
+    bool takeCredit(XWorkItem * w)
+    {
+        bool ok = true;
+        mutex.lock();
+        if (isCancelled())
+            ok = true;
+        else if (credits > 0)
+            credits--;
+        else
+        {
+            walker = w;
+            parked = true;
+            ok = false;
+        }
+        mutex.unlock();
+        return ok;
+    }
+
+    rados_ioctx_t io;
+    size_t batch_size;
+    ObjectFilter filter;
+
+private:
+    XMutex mutex;
+    uint64_t credits;
+    XWorkItem * walker;
+    bool parked;
+};
+
+class StreamWalker : public XWorkItem
+{
+public:
+    StreamWalker(StreamJob* job) :
+        job(job),
+        cursor(rados_object_list_begin(job->io)),
+        finish(rados_object_list_end(job->io)),
+        has_credit(false),
+        msg_env(enif_alloc_env())
+    {
+        job->keep();
+    }
+
+    ~StreamWalker()
+    {
+        rados_object_list_cursor_free(job->io, cursor);
+        rados_object_list_cursor_free(job->io, finish);
+        enif_free_env(msg_env);
+        job->release();
+    }
+
+    Status run()
+    {
+        vector<rados_object_list_item> items(job->batch_size);
+        for (int i = 0; i < SCAN_SLICE_BATCHES; i++)
+        {
+            if (job->isCancelled())
+                return finishWalk();
+            if (rados_object_list_cursor_cmp(job->io, cursor, finish) >= 0)
+                return finishWalk();
+
+            // The credit is kept over the batches that match nothing, so
+            // that it is only used by a batch that is actually sent.
+            if (!has_credit)
+            {
+                if (!job->takeCredit(this))
+                    return WAIT;
+                has_credit = true;
+            }
+
+            rados_object_list_cursor next = NULL;
+            int num = rados_object_list(job->io, cursor, finish, job->batch_size,
+                                        NULL, 0, &items[0], &next);
+            if (num < 0)
+            {
+                logger.error(MOD_NAME, "StreamWalker::run()", "listing failed for job %ld: %s",
+                             job->getId(), strerror(-num));
+                job->send(msg_env,
+                          enif_make_tuple2(msg_env,
+                                           enif_make_atom(msg_env, "error"),
+                                           enif_make_string(msg_env, strerror(-num), ERL_NIF_LATIN1)));
+                return finishWalk(false);
+            }
+            rados_object_list_cursor_free(job->io, cursor);
+            cursor = next;
+
+            ERL_NIF_TERM term_list = enif_make_list(msg_env, 0);
+            int matched = 0;
+            for (int j = num - 1; j >= 0; j--)
+            {
+                if (!job->filter.match(items[j].oid, items[j].oid_length))
+                    continue;
+                matched++;
+                ERL_NIF_TERM oid;
+                memcpy(enif_make_new_binary(msg_env, items[j].oid_length, &oid),
+                       items[j].oid, items[j].oid_length);
+                term_list = enif_make_list_cell(msg_env, oid, term_list);
+            }
+            if (num > 0)
+                rados_object_list_free(num, &items[0]);
+
+            if (matched > 0)
+            {
+                job->send(msg_env,
+                          enif_make_tuple2(msg_env,
+                                           enif_make_atom(msg_env, "objects"),
+                                           term_list));
+                has_credit = false;
+            }
+            else
+                enif_clear_env(msg_env);
+        }
+
+        // Give the other work items a turn.
+        return AGAIN;
+    }
+
+    void abort()
+    {
+        job->cancel();
+        finishWalk();
+    }
+
+private:
+    Status finishWalk(bool done = true)
+    {
+        if (done)
+            job->send(msg_env, enif_make_atom(msg_env, "done"));
+        RadosJob * j = map_job_remove(job->getId());
+        if (j != NULL)
+            j->release();
+        return DONE;
+    }
+
+    StreamJob * job;
+    rados_object_list_cursor cursor;
+    rados_object_list_cursor finish;
+    bool has_credit;
+    ErlNifEnv * msg_env;
+};
+
+// Erlang: objects_list_stream(IoCtx, Pid, Opts)
+ERL_NIF_TERM x_objects_list_stream(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_objects_list_stream()";
+
+    uint64_t id;
+    ErlNifPid pid;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_get_local_pid(env, argv[1], &pid) ||
+        !enif_is_list(env, argv[2]))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    unsigned batch_size = SCAN_BATCH_SIZE;
+    unsigned window = STREAM_WINDOW;
+    ERL_NIF_TERM opt;
+    if ((get_opt(env, argv[2], "batch", &opt) &&
+         (!enif_get_uint(env, opt, &batch_size) || batch_size == 0)) ||
+        (get_opt(env, argv[2], "window", &opt) &&
+         (!enif_get_uint(env, opt, &window) || window == 0)))
+    {
+        logger.error(MOD_NAME, func_name, "invalid options");
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t stream_io;
+    int err = ioctx_dup(io, &stream_io);
+    if (err < 0)
+    {
+        logger.error(MOD_NAME, func_name, "unable to create ioctx for stream: %s", strerror(-err));
+        return make_error_tuple(env, -err);
+    }
+
+    StreamJob * job = new StreamJob(pid, stream_io, window);
+    job->batch_size = batch_size;
+    if (!job->filter.parse(env, argv[2]))
+    {
+        job->release();
+        logger.error(MOD_NAME, func_name, "invalid filter");
+        return enif_make_badarg(env);
+    }
+    map_job_add(job->getId(), job);
+
+    // A walk parked for lack of credits waits on the owner, which may
+    // exit without a word. The walker finishes at once if it is gone.
+    job->monitor(env);
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx=%ld, job=%ld, window=%d", id, job->getId(), window);
+
+    work_pool->submit(new StreamWalker(job));
+
+    ERL_NIF_TERM ret = enif_make_tuple2(env,
+                                        enif_make_atom(env, "ok"),
+                                        enif_make_uint64(env, job->getId()));
+    job->release();
+    return ret;
+}
+
+// Erlang: objects_list_stream_ack(StreamId, N)
+ERL_NIF_TERM x_objects_list_stream_ack(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_objects_list_stream_ack()";
+
+    uint64_t id;
+    unsigned n;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_get_uint(env, argv[1], &n))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    RadosJob * job = map_job_get(id);
+    if (job == NULL)
+    {
+        // The stream is already finished, late acks are fine.
+        return enif_make_atom(env, "ok");
+    }
+
+    StreamJob * stream = dynamic_cast<StreamJob*>(job);
+    if (stream == NULL)
+    {
+        job->release();
+        logger.error(MOD_NAME, func_name, "job %ld is not a stream", id);
+        return enif_make_badarg(env);
+    }
+
+    stream->grant(n);
+    job->release();
+
+    return enif_make_atom(env, "ok");
+}
@@ -0,0 +1,817 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <set>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rados_shm.h"
+
+static const char* MOD_NAME = "rados_shm";
+
+#define SHM_SIZE           (256 * 1024 * 1024)
+#define SHM_MIN_SIZE       (16 * 1024 * 1024)
+#define SHM_BYTES_PER_SLOT (64 * 1024)
+#define SHM_SPIN           1000
+#define SHM_CLAIM_TRIES    64
+#define SHM_READY_WAIT_MS  1000
+
+static const uint32_t class_sizes[SHM_CLASSES] =
+{
+    4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024
+};
+
+/*
+ * A binary pointing into the segment holds a reference on the chunk, and
+ * on the cache so that the segment stays mapped.
+ */
+struct shm_ref_t
+{
+    ShmCache * cache;
+    shm_chunk_t * chunk;
+};
+
+ErlNifResourceType * shm_ref_type_resource = NULL;
+
+void dtor_shm_ref_type(ErlNifEnv* env, void* obj)
+{
+    shm_ref_t * ref = (shm_ref_t *)obj;
+    ShmCache::unpin(ref->chunk);
+    ref->cache->release();
+}
+
+/*
+ * The host cache of this instance, and the io contexts using it.
+ */
+static ShmCache *         shm_cache = NULL;
+static set<uint64_t>      shm_ioctx;
+static XMutex             shm_mutex;
+
+static uint64_t fnv_hash(const char* data, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * The key of an object is made of the fsid of the cluster, as the pool ids
+ * of the clusters used on the host collide, the pool id, the snapshot read
+ * and the object name. Returns 0 if the name is too long to be cached.
+ */
+static size_t make_key(rados_ioctx_t io, uint64_t snap, const char* oid, char* key)
+{
+    char fsid[64];
+    if (rados_cluster_fsid(rados_ioctx_get_cluster(io), fsid, sizeof(fsid)) < 0)
+        return 0;
+    int n = snprintf(key, SHM_KEY_LEN, "%s:%lld:%llu:%s",
+                     fsid, (long long)rados_ioctx_get_id(io), (unsigned long long)snap, oid);
+    if (n < 0 || n >= SHM_KEY_LEN)
+        return 0;
+    return n;
+}
+
+ShmCache::ShmCache() :
+    base(NULL),
+    header(NULL),
+    size(0),
+    validate(true),
+    hits(0),
+    misses(0),
+    evictions(0),
+    bypassed(0),
+    refs(1)
+{
+}
+
+ShmCache::~ShmCache()
+{
+    if (base != NULL)
+        munmap(base, size);
+}
+
+void ShmCache::keep()
+{
+    __sync_add_and_fetch(&refs, 1);
+}
+
+void ShmCache::release()
+{
+    if (__sync_sub_and_fetch(&refs, 1) == 0)
+        delete this;
+}
+
+/*
+ * Lay out a new segment: one slot per SHM_BYTES_PER_SLOT, the rest shared
+ * equally between the size classes.
+ */
+void ShmCache::layout(uint64_t size)
+{
+    uint32_t nslots = 1024;
+    while ((uint64_t)nslots * 2 * SHM_BYTES_PER_SLOT <= size)
+        nslots *= 2;
+
+    header->version = SHM_VERSION;
+    header->nslots = nslots;
+    header->size = size;
+
+    uint64_t offset = sizeof(shm_header_t) + (uint64_t)nslots * sizeof(shm_slot_t);
+    uint64_t class_bytes = (size - offset) / SHM_CLASSES;
+    for (int i = 0; i < SHM_CLASSES; i++)
+    {
+        shm_class_t & cls = header->classes[i];
+        cls.chunk_size = class_sizes[i];
+        cls.nchunks = class_bytes / (sizeof(shm_chunk_t) + class_sizes[i]);
+        cls.offset = offset;
+        cls.clock = 0;
+        for (uint32_t j = 0; j < cls.nchunks; j++)
+        {
+            shm_chunk_t * c = (shm_chunk_t *)(base + offset + (uint64_t)j * (sizeof(shm_chunk_t) + cls.chunk_size));
+            c->refs = 0;
+            c->gen = 0;
+            c->slot = SHM_NO_SLOT;
+            c->len = 0;
+        }
+        offset += class_bytes;
+    }
+
+    // Slots are zeroed by ftruncate.
+    __sync_synchronize();
+    header->magic = SHM_MAGIC;
+    __sync_synchronize();
+    header->ready = 1;
+}
+
+int ShmCache::open(const char* name, uint64_t size, bool validate)
+{
+    const char * func_name = "ShmCache::open()";
+
+    this->validate = validate;
+
+    bool created = true;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST)
+    {
+        created = false;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd < 0)
+    {
+        int err = errno;
+        logger.error(MOD_NAME, func_name, "unable to open %s: %s", name, strerror(err));
+        return -err;
+    }
+
+    if (created)
+    {
+        if (ftruncate(fd, size) < 0)
+        {
+            int err = errno;
+            close(fd);
+            shm_unlink(name);
+            return -err;
+        }
+    }
+    else
+    {
+        // The creator sets the size, which prevails over ours.
+        struct stat st;
+        int waited = 0;
+        while (fstat(fd, &st) == 0 && st.st_size == 0 && waited++ < SHM_READY_WAIT_MS)
+            usleep(1000);
+        if (st.st_size < (off_t)SHM_MIN_SIZE)
+        {
+            close(fd);
+            return -EINVAL;
+        }
+        size = st.st_size;
+    }
+
+    void * p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        int err = errno;
+        logger.error(MOD_NAME, func_name, "unable to map %s: %s", name, strerror(err));
+        return -err;
+    }
+    base = (char *)p;
+    this->size = size;
+    header = (shm_header_t *)base;
+
+    if (created)
+    {
+        layout(size);
+        XLOG_INFO(logger, MOD_NAME, func_name, "created %s, %ld bytes, %d slots", name, size, header->nslots);
+        return 0;
+    }
+
+    int waited = 0;
+    while (!header->ready && waited++ < SHM_READY_WAIT_MS)
+        usleep(1000);
+    __sync_synchronize();
+    if (!header->ready || header->magic != SHM_MAGIC ||
+        header->version != SHM_VERSION || header->size != size)
+    {
+        logger.error(MOD_NAME, func_name, "%s is not a valid cache segment", name);
+        return -EINVAL;
+    }
+
+    XLOG_INFO(logger, MOD_NAME, func_name, "attached to %s, %ld bytes", name, size);
+    return 0;
+}
+
+shm_slot_t* ShmCache::slot(uint32_t i)
+{
+    return (shm_slot_t *)(base + sizeof(shm_header_t)) + i;
+}
+
+/*
+ * The id of a chunk has the size class in the upper byte, and the index
+ * of the chunk in the class in the lower bytes.
+ */
+shm_chunk_t* ShmCache::chunk(uint32_t id)
+{
+    shm_class_t & cls = header->classes[id >> 24];
+    uint32_t index = id & 0xffffff;
+    return (shm_chunk_t *)(base + cls.offset + (uint64_t)index * (sizeof(shm_chunk_t) + cls.chunk_size));
+}
+
+uint32_t ShmCache::bucket(const char* key, size_t key_len)
+{
+    return fnv_hash(key, key_len) & (header->nslots - 1);
+}
+
+/*
+ * Take the seqlock of a slot for writing. Gives up after a while, in case
+ * a process died holding it.
+ */
+bool ShmCache::lockSlot(shm_slot_t* s)
+{
+    for (int i = 0; i < SHM_SPIN; i++)
+    {
+        uint32_t seq = s->seq;
+        if ((seq & 1) == 0 && __sync_bool_compare_and_swap(&s->seq, seq, seq + 1))
+            return true;
+    }
+    return false;
+}
+
+void ShmCache::unlockSlot(shm_slot_t* s)
+{
+    __sync_synchronize();
+    s->seq++;
+}
+
+void ShmCache::unpin(shm_chunk_t* c)
+{
+    __sync_sub_and_fetch(&c->refs, 1);
+}
+
+/*
+ * Find a chunk holding the range, and pin it. Same range semantics as the
+ * process read cache.
+ */
+shm_chunk_t* ShmCache::lookup(const char* key, size_t key_len, size_t len, uint64_t offset,
+                              size_t* buf_offset, size_t* buf_len)
+{
+    uint32_t b = bucket(key, key_len);
+    for (int i = 0; i < SHM_PROBE_LEN; i++)
+    {
+        shm_slot_t * s = slot((b + i) & (header->nslots - 1));
+
+        uint32_t id = 0;
+        uint32_t gen = 0;
+        uint64_t s_offset = 0;
+        for (int spin = 0; spin < SHM_SPIN; spin++)
+        {
+            uint32_t seq = s->seq;
+            if (seq & 1)
+                continue;
+            __sync_synchronize();
+            id = s->chunk;
+            gen = s->gen;
+            s_offset = s->offset;
+            bool match = (id != 0 && s->key_len == key_len &&
+                          memcmp(s->key, key, key_len) == 0 &&
+                          offset >= s_offset && offset + len <= s_offset + s->len);
+            __sync_synchronize();
+            if (s->seq != seq)
+                continue;
+            if (!match)
+                id = 0;
+            break;
+        }
+        if (id == 0)
+            continue;
+
+        // Pin the chunk, unless it is being reused.
+        shm_chunk_t * c = chunk(id - 1);
+        int32_t r = c->refs;
+        while (r >= 0 && !__sync_bool_compare_and_swap(&c->refs, r, r + 1))
+            r = c->refs;
+        if (r < 0)
+            continue;
+        __sync_synchronize();
+        if (c->gen != gen)
+        {
+            unpin(c);
+            continue;
+        }
+
+        size_t start = offset - s_offset;
+        *buf_offset = (start < c->len) ? start : c->len;
+        *buf_len = (start + len <= c->len) ? len : c->len - *buf_offset;
+        return c;
+    }
+    return NULL;
+}
+
+/*
+ * Claim a chunk large enough for len bytes, evicting the data it holds.
+ * The chunk returned has a reference count of -1.
+ */
+shm_chunk_t* ShmCache::claim(size_t len, uint32_t* id)
+{
+    int c_idx = 0;
+    while (c_idx < SHM_CLASSES && header->classes[c_idx].chunk_size < len)
+        c_idx++;
+    if (c_idx == SHM_CLASSES)
+        return NULL;
+
+    shm_class_t & cls = header->classes[c_idx];
+    if (cls.nchunks == 0)
+        return NULL;
+
+    for (int i = 0; i < SHM_CLAIM_TRIES; i++)
+    {
+        uint32_t index = __sync_fetch_and_add(&cls.clock, 1) % cls.nchunks;
+        uint32_t cid = ((uint32_t)c_idx << 24) | index;
+        shm_chunk_t * c = chunk(cid);
+        if (!__sync_bool_compare_and_swap(&c->refs, 0, -1))
+            continue;
+
+        // Remove the chunk from the index, if it is still there.
+        if (c->slot != SHM_NO_SLOT)
+        {
+            shm_slot_t * s = slot(c->slot);
+            if (lockSlot(s))
+            {
+                if (s->chunk == cid + 1 && s->gen == c->gen)
+                    s->chunk = 0;
+                unlockSlot(s);
+            }
+            __sync_add_and_fetch(&header->evictions, 1);
+            __sync_add_and_fetch(&evictions, 1);
+        }
+        c->gen++;
+        c->slot = SHM_NO_SLOT;
+        c->len = 0;
+        __sync_synchronize();
+        *id = cid;
+        return c;
+    }
+    return NULL;
+}
+
+/*
+ * Index a chunk just filled. The slot is taken among the slots following
+ * the bucket of the object: the slot of the same range, else an empty
+ * slot, else the slot under the clock hand of the bucket. The chunk is not
+ * indexed if the bucket was invalidated since the fill started, as the
+ * data may predate the change.
+ */
+void ShmCache::publish(const char* key, size_t key_len, size_t len, uint64_t offset,
+                       shm_chunk_t* c, uint32_t id, uint32_t inval)
+{
+    uint32_t b = bucket(key, key_len);
+    shm_slot_t * home = slot(b);
+    if (home->inval != inval)
+        return;
+    int target = -1;
+    for (int i = 0; i < SHM_PROBE_LEN; i++)
+    {
+        shm_slot_t * s = slot((b + i) & (header->nslots - 1));
+        if (s->chunk != 0 && s->key_len == key_len && s->offset == offset &&
+            s->len == len && memcmp(s->key, key, key_len) == 0)
+        {
+            target = i;
+            break;
+        }
+        if (s->chunk == 0 && target < 0)
+            target = i;
+    }
+    if (target < 0)
+        target = c->gen % SHM_PROBE_LEN;
+
+    uint32_t index = (b + target) & (header->nslots - 1);
+    shm_slot_t * s = slot(index);
+    if (!lockSlot(s))
+        return;
+    s->chunk = id + 1;
+    s->gen = c->gen;
+    s->key_len = key_len;
+    s->offset = offset;
+    s->len = len;
+    memcpy(s->key, key, key_len);
+    c->slot = index;
+    unlockSlot(s);
+
+    // An invalidation that came while indexing may have missed the slot.
+    __sync_synchronize();
+    if (home->inval != inval)
+        drop(c, c->gen);
+}
+
+/*
+ * Remove a stale chunk from the index.
+ */
+void ShmCache::drop(shm_chunk_t* c, uint32_t gen)
+{
+    uint32_t index = c->slot;
+    if (index == SHM_NO_SLOT)
+        return;
+    shm_slot_t * s = slot(index);
+    if (lockSlot(s))
+    {
+        if (s->chunk != 0 && chunk(s->chunk - 1) == c && s->gen == gen)
+            s->chunk = 0;
+        unlockSlot(s);
+    }
+}
+
+ERL_NIF_TERM ShmCache::makeBinary(ErlNifEnv* env, shm_chunk_t* c, size_t offset, size_t len)
+{
+    shm_ref_t * ref = (shm_ref_t *)enif_alloc_resource(shm_ref_type_resource, sizeof(shm_ref_t));
+    keep();
+    ref->cache = this;
+    ref->chunk = c;
+    ERL_NIF_TERM bin = enif_make_resource_binary(env, ref, c->data + offset, len);
+    enif_release_resource(ref);
+    return bin;
+}
+
+void ShmCache::invalidate(rados_ioctx_t io, uint64_t snap, const char* oid)
+{
+    char key[SHM_KEY_LEN];
+    size_t key_len = make_key(io, snap, oid, key);
+    if (key_len == 0)
+        return;
+
+    uint32_t b = bucket(key, key_len);
+    __sync_add_and_fetch(&slot(b)->inval, 1);
+    for (int i = 0; i < SHM_PROBE_LEN; i++)
+    {
+        shm_slot_t * s = slot((b + i) & (header->nslots - 1));
+        if (s->chunk == 0 || s->key_len != key_len)
+            continue;
+        if (lockSlot(s))
+        {
+            if (s->chunk != 0 && s->key_len == key_len && memcmp(s->key, key, key_len) == 0)
+                s->chunk = 0;
+            unlockSlot(s);
+        }
+    }
+}
+
+ERL_NIF_TERM ShmCache::read(ErlNifEnv* env, rados_ioctx_t io, uint64_t snap,
+                            const char* oid, size_t len, uint64_t offset)
+{
+    const char * func_name = "ShmCache::read()";
+
+    char key[SHM_KEY_LEN];
+    size_t key_len = make_key(io, snap, oid, key);
+
+    size_t buf_offset;
+    size_t buf_len;
+    shm_chunk_t * c = NULL;
+    if (key_len > 0)
+        c = lookup(key, key_len, len, offset, &buf_offset, &buf_len);
+    if (c != NULL && validate)
+    {
+        rados_read_op_t op = rados_create_read_op();
+        rados_read_op_assert_version(op, c->version);
+        int err = rados_read_op_operate(op, io, oid, LIBRADOS_OPERATION_NOFLAG);
+        rados_release_read_op(op);
+        if (err < 0)
+        {
+            XLOG_DEBUG(logger, MOD_NAME, func_name, "stale chunk for %s: %s", oid, strerror(-err));
+            drop(c, c->gen);
+            unpin(c);
+            c = NULL;
+        }
+    }
+
+    if (c != NULL)
+    {
+        __sync_add_and_fetch(&header->hits, 1);
+        __sync_add_and_fetch(&hits, 1);
+        if (buf_len == 0)
+        {
+            unpin(c);
+            return enif_make_atom(env, "eof");
+        }
+        return enif_make_tuple2(env,
+                                enif_make_atom(env, "ok"),
+                                makeBinary(env, c, buf_offset, buf_len));
+    }
+
+    __sync_add_and_fetch(&header->misses, 1);
+    __sync_add_and_fetch(&misses, 1);
+
+    uint32_t id;
+    c = (key_len > 0) ? claim(len, &id) : NULL;
+    if (c == NULL)
+    {
+        // Too large, or everything is in use: read into a binary.
+        __sync_add_and_fetch(&bypassed, 1);
+        ErlNifBinary obin;
+        if (!enif_alloc_binary(len, &obin))
+            return make_error_tuple(env, ENOMEM);
+        int err = rados_read(io, oid, (char *)obin.data, len, offset);
+        if (err <= 0)
+        {
+            enif_release_binary(&obin);
+            if (err < 0)
+                return make_error_tuple(env, -err);
+            return enif_make_atom(env, "eof");
+        }
+        if ((size_t)err < len)
+            enif_realloc_binary(&obin, err);
+        return enif_make_tuple2(env,
+                                enif_make_atom(env, "ok"),
+                                enif_make_binary(env, &obin));
+    }
+
+    // The invalidations of the object are counted from here.
+    uint32_t inval = slot(bucket(key, key_len))->inval;
+    __sync_synchronize();
+
+    uint64_t version = 0;
+    int err = read_versioned(io, oid, c->data, len, offset, &version);
+    c->version = version;
+    if (err < 0)
+    {
+        __sync_synchronize();
+        c->refs = 0;
+        logger.error(MOD_NAME, func_name, "read failed for %s: %s", oid, strerror(-err));
+        return make_error_tuple(env, -err);
+    }
+
+    c->len = err;
+    publish(key, key_len, len, offset, c, id, inval);
+
+    // Keep a reference for the binary returned.
+    __sync_synchronize();
+    c->refs = 1;
+
+    if (err == 0)
+    {
+        unpin(c);
+        return enif_make_atom(env, "eof");
+    }
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            makeBinary(env, c, 0, err));
+}
+
+ERL_NIF_TERM ShmCache::stats(ErlNifEnv* env)
+{
+    uint64_t h = hits;
+    uint64_t m = misses;
+    double ratio = (h + m > 0) ? (double)h / (double)(h + m) : 0.0;
+
+    ERL_NIF_TERM term_list = enif_make_list(env, 0);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "size"),
+                                                     enif_make_uint64(env, size)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "host_evictions"),
+                                                     enif_make_uint64(env, header->evictions)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "host_misses"),
+                                                     enif_make_uint64(env, header->misses)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "host_hits"),
+                                                     enif_make_uint64(env, header->hits)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "bypassed"),
+                                                     enif_make_uint64(env, bypassed)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "evictions"),
+                                                     enif_make_uint64(env, evictions)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "hit_ratio"),
+                                                     enif_make_double(env, ratio)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "misses"),
+                                                     enif_make_uint64(env, m)),
+                                    term_list);
+    term_list = enif_make_list_cell(env,
+                                    enif_make_tuple2(env,
+                                                     enif_make_atom(env, "hits"),
+                                                     enif_make_uint64(env, h)),
+                                    term_list);
+    return term_list;
+}
+
+ShmCache* shm_cache_get()
+{
+    shm_mutex.lock();
+    ShmCache * cache = shm_cache;
+    if (cache != NULL)
+        cache->keep();
+    shm_mutex.unlock();
+    return cache;
+}
+
+bool shm_cache_enabled(uint64_t id)
+{
+    shm_mutex.lock();
+    bool enabled = shm_cache != NULL && shm_ioctx.count(id) > 0;
+    shm_mutex.unlock();
+    return enabled;
+}
+
+void shm_cache_invalidate(uint64_t id, const char* oid)
+{
+    if (!shm_cache_enabled(id))
+        return;
+    rados_ioctx_t io = map_ioctx_get(id);
+    ShmCache * cache = shm_cache_get();
+    if (cache != NULL && io != NULL)
+        cache->invalidate(io, LIBRADOS_SNAP_HEAD, oid);
+    if (cache != NULL)
+        cache->release();
+}
+
+void shm_cache_forget(uint64_t id)
+{
+    shm_mutex.lock();
+    shm_ioctx.erase(id);
+    shm_mutex.unlock();
+}
+
+/********************************************************************************
+ * NIF functions
+ ********************************************************************************/
+
+// Erlang: shm_cache_open(Name, Opts)
+ERL_NIF_TERM x_shm_cache_open(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_shm_cache_open()";
+
+    char name[MAX_NAME_LEN];
+    memset(name, 0, MAX_NAME_LEN);
+    if (!get_name_arg(env, argv[0], name, MAX_NAME_LEN) ||
+        !enif_is_list(env, argv[1]))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    uint64_t size = SHM_SIZE;
+    char validate[MAX_NAME_LEN];
+    strcpy(validate, "true");
+    ERL_NIF_TERM opt;
+    if ((get_opt(env, argv[1], "size", &opt) &&
+         (!enif_get_uint64(env, opt, &size) || size < SHM_MIN_SIZE)) ||
+        (get_opt(env, argv[1], "validate", &opt) &&
+         !enif_get_atom(env, opt, validate, MAX_NAME_LEN, ERL_NIF_LATIN1)))
+    {
+        logger.error(MOD_NAME, func_name, "invalid options");
+        return enif_make_badarg(env);
+    }
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "name=%s, size=%ld, validate=%s", name, size, validate);
+
+    ShmCache * cache = new ShmCache();
+    int err = cache->open(name, size, strcmp(validate, "true") == 0);
+    if (err < 0)
+    {
+        cache->release();
+        return make_error_tuple(env, -err);
+    }
+
+    shm_mutex.lock();
+    ShmCache * old = shm_cache;
+    shm_cache = cache;
+    shm_mutex.unlock();
+    if (old != NULL)
+        old->release();
+
+    return enif_make_atom(env, "ok");
+}
+
+void shm_cache_shutdown()
+{
+    shm_mutex.lock();
+    ShmCache * cache = shm_cache;
+    shm_cache = NULL;
+    shm_ioctx.clear();
+    shm_mutex.unlock();
+
+    // The segment stays mapped until the last binary pointing to it is
+    // garbage collected.
+    if (cache != NULL)
+        cache->release();
+}
+
+// Erlang: shm_cache_close()
+ERL_NIF_TERM x_shm_cache_close(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    shm_cache_shutdown();
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: shm_cache_enable(IoCtx)
+ERL_NIF_TERM x_shm_cache_enable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_shm_cache_enable()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    if (map_ioctx_get(id) == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    shm_mutex.lock();
+    bool open = shm_cache != NULL;
+    if (open)
+        shm_ioctx.insert(id);
+    shm_mutex.unlock();
+
+    if (!open)
+        return make_error_tuple(env, ENOENT);
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: shm_cache_disable(IoCtx)
+ERL_NIF_TERM x_shm_cache_disable(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_shm_cache_disable()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    shm_mutex.lock();
+    shm_ioctx.erase(id);
+    shm_mutex.unlock();
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: shm_cache_stats()
+ERL_NIF_TERM x_shm_cache_stats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    ShmCache * cache = shm_cache_get();
+    if (cache == NULL)
+    {
+        return make_error_tuple(env, ENOENT);
+    }
+
+    ERL_NIF_TERM stats = cache->stats(env);
+    cache->release();
+
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            stats);
+}
@@ -5,8 +5,11 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <vector>
 
 #include "rados_nif.h"
+#include "rados_cache.h"
+#include "rados_journal.h"
 
 
 ERL_NIF_TERM x_ioctx_snap_create(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
@@ -61,7 +64,9 @@ ERL_NIF_TERM x_ioctx_snap_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM ar
     return enif_make_atom(env, "ok");
 }
 
-ERL_NIF_TERM x_rollback(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+static ERL_NIF_TERM x_rollback_dirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+static ERL_NIF_TERM do_rollback(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[], bool dirty)
 {
     uint64_t id;
     char oid[MAX_NAME_LEN];
@@ -80,7 +85,12 @@ ERL_NIF_TERM x_rollback(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_badarg(env);
     }
 
+    if (!dirty && journal_enabled(id))
+        return enif_schedule_nif(env, "rollback", ERL_NIF_DIRTY_JOB_IO_BOUND, x_rollback_dirty, argc, argv);
+
+    journal_drain(id, oid);
     int err = rados_rollback(io, oid, snap);
+    cache_invalidate(id, oid);
     if (err < 0) 
     {
         return make_error_tuple(env, -err);
@@ -89,6 +99,38 @@ ERL_NIF_TERM x_rollback(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
     return enif_make_atom(env, "ok");
 }
 
+static ERL_NIF_TERM x_rollback_dirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return do_rollback(env, argc, argv, true);
+}
+
+ERL_NIF_TERM x_rollback(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return do_rollback(env, argc, argv, false);
+}
+
+/*
+ * Get the ids of the snapshots of a pool, growing the buffer until they
+ * all fit. Returns 0 or a negative error code.
+ */
+static int snap_list(rados_ioctx_t io, vector<rados_snap_t>& snaps)
+{
+    int max = 256;
+    while (true)
+    {
+        snaps.resize(max);
+        int num = rados_ioctx_snap_list(io, &snaps[0], max);
+        if (num >= 0)
+        {
+            snaps.resize(num);
+            return 0;
+        }
+        if (num != -ERANGE)
+            return num;
+        max *= 2;
+    }
+}
+
 ERL_NIF_TERM x_ioctx_snap_list(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     uint64_t id;
@@ -103,33 +145,72 @@ ERL_NIF_TERM x_ioctx_snap_list(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
         return enif_make_badarg(env);
     }
 
-    rados_snap_t snaps[2000];
-    int num = rados_ioctx_snap_list(io, snaps, 2000);
-    if ((num < 0) && (num != -ERANGE))
+    vector<rados_snap_t> snaps;
+    int err = snap_list(io, snaps);
+    if (err < 0)
     {
-        return make_error_tuple(env, -num);
+        return make_error_tuple(env, -err);
     }
 
-    if (num > 0)
+    ERL_NIF_TERM term_list = enif_make_list(env, 0);
+    for (int i = (int)snaps.size() - 1; i >= 0; i--)
     {
-        ERL_NIF_TERM term_list = enif_make_list(env, 0);
-        for (int i = num - 1; i >= 0; i--)
-        {
-            ERL_NIF_TERM t = enif_make_uint64(env, snaps[i]);
-            term_list = enif_make_list_cell(env, t, term_list);
-        }
+        ERL_NIF_TERM t = enif_make_uint64(env, snaps[i]);
+        term_list = enif_make_list_cell(env, t, term_list);
+    }
+
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            term_list);
+}
+
+ERL_NIF_TERM x_ioctx_snap_list_full(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        return enif_make_badarg(env);
+    }
 
-        return enif_make_tuple2(env,
-                                enif_make_atom(env, "ok"),
-                                term_list);
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        return enif_make_badarg(env);
     }
-    else
+
+    vector<rados_snap_t> snaps;
+    int err = snap_list(io, snaps);
+    if (err < 0)
     {
-        return enif_make_tuple2(env,
-                                enif_make_atom(env, "ok"),
-                                enif_make_list(env, 0));    // empty list
+        return make_error_tuple(env, -err);
     }
+
+    char snap[MAX_NAME_LEN];
+    ERL_NIF_TERM term_list = enif_make_list(env, 0);
+    for (int i = (int)snaps.size() - 1; i >= 0; i--)
+    {
+        memset(snap, 0, MAX_NAME_LEN);
+        err = rados_ioctx_snap_get_name(io, snaps[i], snap, MAX_NAME_LEN);
+        time_t tm = 0;
+        if (err >= 0)
+            err = rados_ioctx_snap_get_stamp(io, snaps[i], &tm);
+        if (err == -ENOENT)
+            continue;           // Removed since it was listed
+        if (err < 0)
+            return make_error_tuple(env, -err);
+
+        ERL_NIF_TERM t = enif_make_tuple3(env,
+                                          enif_make_uint64(env, snaps[i]),
+                                          enif_make_string(env, snap, ERL_NIF_LATIN1),
+                                          enif_make_uint64(env, tm));
+        term_list = enif_make_list_cell(env, t, term_list);
+    }
+
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            term_list);
 }
+
 ERL_NIF_TERM x_ioctx_snap_lookup(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     uint64_t id;
@@ -209,3 +290,184 @@ ERL_NIF_TERM x_ioctx_snap_get_stamp(ErlNifEnv* env, int argc, const ERL_NIF_TERM
                             enif_make_uint64(env, tm));
 }
 
+
+/*
+ * Get a snapshot argument, either a snapshot id or 'head'.
+ */
+static int get_snap_arg(ErlNifEnv* env, ERL_NIF_TERM term, rados_snap_t* snapid)
+{
+    if (enif_get_uint64(env, term, snapid))
+        return 1;
+
+    char atom[8];
+    if (enif_get_atom(env, term, atom, sizeof(atom), ERL_NIF_LATIN1) &&
+        strcmp(atom, "head") == 0)
+    {
+        *snapid = LIBRADOS_SNAP_HEAD;
+        return 1;
+    }
+    return 0;
+}
+
+ERL_NIF_TERM x_ioctx_snap_set_read(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    uint64_t id;
+    rados_snap_t snapid;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !get_snap_arg(env, argv[1], &snapid))
+    {
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_snap_set_read(io, snapid);
+
+    // The read and metadata caches of the io context only hold one
+    // version of an object, drop it.
+    if (map_read_snap_get(id) != snapid)
+    {
+        map_read_snap_set(id, snapid);
+        cache_clear(id);
+    }
+
+    return enif_make_atom(env, "ok");
+}
+
+ERL_NIF_TERM x_ioctx_selfmanaged_snap_create(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        return enif_make_badarg(env);
+    }
+
+    rados_snap_t snapid;
+    int err = rados_ioctx_selfmanaged_snap_create(io, &snapid);
+    if (err < 0)
+        return make_error_tuple(env, -err);
+
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            enif_make_uint64(env, snapid));
+}
+
+ERL_NIF_TERM x_ioctx_selfmanaged_snap_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    uint64_t id;
+    rados_snap_t snapid;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_get_uint64(env, argv[1], &snapid))
+    {
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        return enif_make_badarg(env);
+    }
+
+    int err = rados_ioctx_selfmanaged_snap_remove(io, snapid);
+    if (err < 0)
+        return make_error_tuple(env, -err);
+
+    return enif_make_atom(env, "ok");
+}
+
+static ERL_NIF_TERM x_ioctx_selfmanaged_snap_rollback_dirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+static ERL_NIF_TERM do_ioctx_selfmanaged_snap_rollback(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[], bool dirty)
+{
+    uint64_t id;
+    char oid[MAX_NAME_LEN];
+    rados_snap_t snapid;
+    memset(oid, 0, MAX_NAME_LEN);
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_get_string(env, argv[1], oid, MAX_NAME_LEN, ERL_NIF_LATIN1) ||
+        !enif_get_uint64(env, argv[2], &snapid))
+    {
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        return enif_make_badarg(env);
+    }
+
+    if (!dirty && journal_enabled(id))
+        return enif_schedule_nif(env, "ioctx_selfmanaged_snap_rollback", ERL_NIF_DIRTY_JOB_IO_BOUND, x_ioctx_selfmanaged_snap_rollback_dirty, argc, argv);
+
+    journal_drain(id, oid);
+    int err = rados_ioctx_selfmanaged_snap_rollback(io, oid, snapid);
+    cache_invalidate(id, oid);
+    if (err < 0)
+        return make_error_tuple(env, -err);
+
+    return enif_make_atom(env, "ok");
+}
+
+static ERL_NIF_TERM x_ioctx_selfmanaged_snap_rollback_dirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return do_ioctx_selfmanaged_snap_rollback(env, argc, argv, true);
+}
+
+ERL_NIF_TERM x_ioctx_selfmanaged_snap_rollback(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return do_ioctx_selfmanaged_snap_rollback(env, argc, argv, false);
+}
+
+ERL_NIF_TERM x_ioctx_selfmanaged_snap_set_write_ctx(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    uint64_t id;
+    rados_snap_t seq;
+    unsigned len;
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_get_uint64(env, argv[1], &seq) ||
+        !enif_get_list_length(env, argv[2], &len))
+    {
+        return enif_make_badarg(env);
+    }
+
+    vector<rados_snap_t> snaps(len);
+    ERL_NIF_TERM head;
+    ERL_NIF_TERM tail = argv[2];
+    for (unsigned i = 0; i < len; i++)
+    {
+        if (!enif_get_list_cell(env, tail, &head, &tail) ||
+            !enif_get_uint64(env, head, &snaps[i]))
+        {
+            return enif_make_badarg(env);
+        }
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        return enif_make_badarg(env);
+    }
+
+    int err = rados_ioctx_selfmanaged_snap_set_write_ctx(io, seq,
+                                                         len > 0 ? &snaps[0] : NULL, len);
+    if (err < 0)
+        return make_error_tuple(env, -err);
+
+    // The journal and the rollbacks write with io contexts of their own.
+    write_ctx_t ctx;
+    ctx.seq = seq;
+    ctx.snaps.assign(snaps.begin(), snaps.end());
+    map_write_ctx_set(id, ctx);
+
+    return enif_make_atom(env, "ok");
+}
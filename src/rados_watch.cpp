@@ -0,0 +1,369 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+#include <errno.h>
+#include <map>
+#include <vector>
+
+#include "rados_nif.h"
+#include "rados_cache.h"
+
+static const char* MOD_NAME = "rados_watch";
+
+// Watches being stopped on the work pool, by io context
+static XMutex closing_mutex;
+static XCondition closing_cond;
+static map<uint64_t, int> closing;
+
+RadosWatch::RadosWatch(uint64_t io_id, rados_ioctx_t io, const char* oid, const ErlNifPid* pid) :
+    id(new_id()),
+    io_id(io_id),
+    io(io),
+    oid(oid),
+    has_pid(pid != NULL),
+    cookie(0),
+    owner_monitor(NULL)
+{
+    if (pid != NULL)
+        this->pid = *pid;
+}
+
+RadosWatch::~RadosWatch()
+{
+    if (owner_monitor != NULL)
+        enif_release_resource(owner_monitor);
+}
+
+bool RadosWatch::monitor(ErlNifEnv* env, const ErlNifPid* owner)
+{
+    owner_monitor = owner_monitor_start(env, owner, OWNER_WATCH, id);
+    return owner_monitor != NULL;
+}
+
+/*
+ * Called from a librados thread for each notification. The notification
+ * is acked right away, the notifier is not kept waiting on Erlang.
+ */
+void RadosWatch::notifyCallback(void* arg, uint64_t notify_id, uint64_t handle,
+                                uint64_t notifier_id, void* data, size_t data_len)
+{
+    RadosWatch * w = (RadosWatch *)arg;
+
+    // Caches are invalidated before the ack, so that the notifier knows
+    // that they are clean once the notify returns.
+    cache_invalidate(w->io_id, w->oid.c_str());
+
+    if (w->has_pid)
+    {
+        ErlNifEnv * msg_env = enif_alloc_env();
+        ErlNifBinary bin;
+        ERL_NIF_TERM payload;
+        if (enif_alloc_binary(data_len, &bin))
+        {
+            memcpy(bin.data, data, data_len);
+            payload = enif_make_binary(msg_env, &bin);
+        }
+        else
+            payload = enif_make_atom(msg_env, "undefined");
+        w->send(msg_env,
+                enif_make_tuple4(msg_env,
+                                 enif_make_atom(msg_env, "notify"),
+                                 enif_make_uint64(msg_env, notify_id),
+                                 enif_make_uint64(msg_env, notifier_id),
+                                 payload));
+        enif_free_env(msg_env);
+    }
+
+    int err = rados_notify_ack(w->io, w->oid.c_str(), notify_id, handle, NULL, 0);
+    if (err < 0)
+        logger.error(MOD_NAME, "RadosWatch::notifyCallback()", "ack failed for %s: %s",
+                     w->oid.c_str(), strerror(-err));
+}
+
+/*
+ * Called from a librados thread when the watch is lost, e.g. after a
+ * disconnection. Notifications may have been missed, so the caches of
+ * the io context are flushed entirely.
+ */
+void RadosWatch::errorCallback(void* arg, uint64_t cookie, int err)
+{
+    RadosWatch * w = (RadosWatch *)arg;
+
+    logger.error(MOD_NAME, "RadosWatch::errorCallback()", "watch on %s lost: %s",
+                 w->oid.c_str(), strerror(-err));
+
+    cache_clear(w->io_id);
+
+    if (w->has_pid)
+    {
+        ErlNifEnv * msg_env = enif_alloc_env();
+        w->send(msg_env,
+                enif_make_tuple2(msg_env,
+                                 enif_make_atom(msg_env, "error"),
+                                 enif_make_string(msg_env, strerror(-err), ERL_NIF_LATIN1)));
+        enif_free_env(msg_env);
+    }
+}
+
+void RadosWatch::send(ErlNifEnv* msg_env, ERL_NIF_TERM payload)
+{
+    ERL_NIF_TERM msg = enif_make_tuple3(msg_env,
+                                        enif_make_atom(msg_env, "rados_watch"),
+                                        enif_make_uint64(msg_env, id),
+                                        payload);
+    enif_send(NULL, &pid, msg_env, msg);
+}
+
+int RadosWatch::watch()
+{
+    return rados_watch2(io, oid.c_str(), &cookie, notifyCallback, errorCallback, this);
+}
+
+/*
+ * Stop watching. No callback is running or pending when this returns,
+ * so the watch can be deleted.
+ */
+void RadosWatch::unwatch()
+{
+    int err = rados_unwatch2(io, cookie);
+    if (err < 0)
+        logger.error(MOD_NAME, "RadosWatch::unwatch()", "unwatch failed for %s: %s",
+                     oid.c_str(), strerror(-err));
+    rados_watch_flush(rados_ioctx_get_cluster(io));
+}
+
+/*
+ * Stop all the watches of an io context, before it is destroyed, and
+ * wait for the ones being stopped on the work pool.
+ */
+void watch_close_ioctx(uint64_t io_id)
+{
+    vector<RadosWatch*> watches;
+    map_watch_remove_ioctx(io_id, watches);
+    for (size_t i = 0; i < watches.size(); i++)
+    {
+        watches[i]->unwatch();
+        delete watches[i];
+    }
+
+    closing_mutex.lock();
+    while (closing.count(io_id) > 0)
+        closing_cond.wait(closing_mutex);
+    closing_mutex.unlock();
+}
+
+/*
+ * Stop a watch on the work pool, as unwatching takes a round trip and a
+ * flush of the callbacks of the cluster.
+ */
+class UnwatchItem : public XWorkItem
+{
+public:
+    UnwatchItem(RadosWatch* w) : w(w)
+    {
+        closing_mutex.lock();
+        closing[w->getIoCtxId()]++;
+        closing_mutex.unlock();
+    }
+
+    Status run()
+    {
+        w->unwatch();
+        return DONE;
+    }
+
+    void abort()
+    {
+        w->unwatch();
+    }
+
+    void release()
+    {
+        uint64_t io_id = w->getIoCtxId();
+        delete w;
+
+        closing_mutex.lock();
+        map<uint64_t, int>::iterator it = closing.find(io_id);
+        if (--it->second == 0)
+        {
+            closing.erase(it);
+            closing_cond.broadcast();
+        }
+        closing_mutex.unlock();
+        delete this;
+    }
+
+private:
+    RadosWatch * w;
+};
+
+/*
+ * The owner of a watch has exited. Called on a scheduler thread, so the
+ * watch is stopped on the work pool. Its io context is not destroyed
+ * until it is.
+ */
+void watch_owner_down(uint64_t id)
+{
+    RadosWatch * w = map_watch_remove(id);
+    if (w == NULL)
+        return;
+    XLOG_DEBUG(logger, MOD_NAME, "watch_owner_down()", "owner of watch %ld is gone", id);
+    if (work_pool == NULL)
+    {
+        w->unwatch();
+        delete w;
+        return;
+    }
+    work_pool->submit(new UnwatchItem(w));
+}
+
+static ERL_NIF_TERM start_watch(ErlNifEnv* env, const char* func_name,
+                                uint64_t id, const char* oid, const ErlNifPid* pid)
+{
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx=%ld, oid=%s", id, oid);
+
+    RadosWatch * w = new RadosWatch(id, io, oid, pid);
+    int err = w->watch();
+    if (err < 0)
+    {
+        logger.error(MOD_NAME, func_name, "watch failed for %s: %s", oid, strerror(-err));
+        delete w;
+        return make_error_tuple(env, -err);
+    }
+
+    // The watch is owned by the process notified, or by the caller for
+    // a cache watch.
+    ErlNifPid owner;
+    if (pid != NULL)
+        owner = *pid;
+    else
+        enif_self(env, &owner);
+    map_watch_add(w->getId(), w);
+    if (!w->monitor(env, &owner))
+    {
+        map_watch_remove(w->getId());
+        w->unwatch();
+        delete w;
+        logger.error(MOD_NAME, func_name, "owner of the watch on %s is gone", oid);
+        return make_error_tuple(env, ESRCH);
+    }
+
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            enif_make_uint64(env, w->getId()));
+}
+
+// Erlang: watch(IoCtx, Oid, Pid)
+ERL_NIF_TERM x_watch(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_watch()";
+
+    uint64_t id;
+    char oid[MAX_NAME_LEN];
+    ErlNifPid pid;
+    memset(oid, 0, MAX_NAME_LEN);
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !get_name_arg(env, argv[1], oid, MAX_NAME_LEN) ||
+        !enif_get_local_pid(env, argv[2], &pid))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    return start_watch(env, func_name, id, oid, &pid);
+}
+
+// Erlang: cache_watch(IoCtx, Oid)
+ERL_NIF_TERM x_cache_watch(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_cache_watch()";
+
+    uint64_t id;
+    char oid[MAX_NAME_LEN];
+    memset(oid, 0, MAX_NAME_LEN);
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !get_name_arg(env, argv[1], oid, MAX_NAME_LEN))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    return start_watch(env, func_name, id, oid, NULL);
+}
+
+// Erlang: unwatch(WatchId)
+ERL_NIF_TERM x_unwatch(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_unwatch()";
+
+    uint64_t id;
+    if (!enif_get_uint64(env, argv[0], &id))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    RadosWatch * w = map_watch_remove(id);
+    if (w == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "watch non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "watch : %ld", id);
+
+    w->unwatch();
+    delete w;
+
+    return enif_make_atom(env, "ok");
+}
+
+// Erlang: notify(IoCtx, Oid, Payload)
+ERL_NIF_TERM x_notify(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    const char * func_name = "x_notify()";
+
+    uint64_t id;
+    char oid[MAX_NAME_LEN];
+    ErlNifBinary ibin;
+    memset(oid, 0, MAX_NAME_LEN);
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !get_name_arg(env, argv[1], oid, MAX_NAME_LEN) ||
+        !enif_inspect_binary(env, argv[2], &ibin))
+    {
+        logger.error(MOD_NAME, func_name, "enif get params failed");
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        logger.error(MOD_NAME, func_name, "ioctx non-existing : %ld", id);
+        return enif_make_badarg(env);
+    }
+
+    XLOG_DEBUG(logger, MOD_NAME, func_name, "ioctx=%ld, oid=%s, len=%ld", id, oid, ibin.size);
+
+    // The replies of the watchers are not used.
+    char * reply = NULL;
+    size_t reply_len = 0;
+    int err = rados_notify2(io, oid, (const char*)ibin.data, ibin.size, 0, &reply, &reply_len);
+    if (reply != NULL)
+        rados_buffer_free(reply);
+    if (err < 0)
+    {
+        logger.error(MOD_NAME, func_name, "notify failed for %s: %s", oid, strerror(-err));
+        return make_error_tuple(env, -err);
+    }
+
+    return enif_make_atom(env, "ok");
+}
@@ -4,10 +4,77 @@
  */
 
 #include <errno.h>
+#include <set>
+#include <string>
+#include <vector>
+#include <rados/librados.hpp>
 
 #include "rados_nif.h"
+#include "rados_cache.h"
 
 
+/*
+ * Read the value of an xattr straight into a binary. The first attempt
+ * uses a buffer of MAX_BUF_LEN bytes, which fits most values. When the
+ * value is larger, librados returns -ERANGE, and we grow the binary and
+ * try again. On success, the binary is shrunk to the exact value length.
+ */
+static int read_xattr(rados_ioctx_t io, const char * oid, const char * xattr, ErlNifBinary * bin)
+{
+    size_t size = MAX_BUF_LEN;
+    if (!enif_alloc_binary(size, bin))
+        return -ENOMEM;
+
+    int err;
+    while ((err = rados_getxattr(io, oid, xattr, (char *)bin->data, size)) == -ERANGE)
+    {
+        if (size >= MAX_XATTR_LEN)
+            break;
+        size *= 4;
+        if (!enif_realloc_binary(bin, size))
+        {
+            enif_release_binary(bin);
+            return -ENOMEM;
+        }
+    }
+    if (err < 0)
+    {
+        enif_release_binary(bin);
+        return err;
+    }
+
+    // On success, returned value from rados_getxattr() is the length
+    enif_realloc_binary(bin, err);
+    return err;
+}
+
+/*
+ * Read an xattr, and store the result in the metadata cache if one is
+ * given. Only the results that do not depend on the call are stored:
+ * the value, a missing object and a missing xattr.
+ */
+static ERL_NIF_TERM get_xattr(ErlNifEnv* env, rados_ioctx_t io, const char* oid, const char* xattr,
+                              MetaCache* meta)
+{
+    uint64_t gen = (meta != NULL) ? meta->getGeneration() : 0;
+
+    ErlNifBinary obin;
+    int err = read_xattr(io, oid, xattr, &obin);
+    if (err < 0) 
+    {
+        if (meta != NULL && (err == -ENOENT || err == -ENODATA))
+            meta->putXattr(oid, xattr, err, NULL, 0, gen);
+        return make_error_tuple(env, -err);
+    }
+
+    if (meta != NULL)
+        meta->putXattr(oid, xattr, 0, (const char*)obin.data, obin.size, gen);
+
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            enif_make_binary(env, &obin));
+}
+
 ERL_NIF_TERM x_getxattr(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     uint64_t id;
@@ -26,19 +93,35 @@ ERL_NIF_TERM x_getxattr(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_badarg(env);
     }
 
-    char val[MAX_BUF_LEN];
-    int err = rados_getxattr(io, oid, xattr, val, MAX_BUF_LEN);
-    if (err < 0) 
+    MetaCache * meta = map_meta_cache_get(id);
+    if (meta == NULL)
+        return get_xattr(env, io, oid, xattr, NULL);
+
+    int err;
+    string value;
+    ERL_NIF_TERM ret;
+    if (meta->getXattr(oid, xattr, &err, &value))
     {
-        return make_error_tuple(env, -err);
+        if (err < 0)
+            ret = make_error_tuple(env, -err);
+        else
+        {
+            ErlNifBinary obin;
+            if (!enif_alloc_binary(value.size(), &obin))
+                ret = make_error_tuple(env, ENOMEM);
+            else
+            {
+                memcpy(obin.data, value.data(), value.size());
+                ret = enif_make_tuple2(env,
+                                       enif_make_atom(env, "ok"),
+                                       enif_make_binary(env, &obin));
+            }
+        }
     }
-
-    ErlNifBinary obin;
-    enif_alloc_binary(err, &obin);  // On success, returned value from rados_getxattr() is the length
-    memcpy(obin.data, val, err);
-    return enif_make_tuple2(env,
-                            enif_make_atom(env, "ok"),
-                            enif_make_binary(env, &obin));
+    else
+        ret = get_xattr(env, io, oid, xattr, meta);
+    meta->release();
+    return ret;
 }
 
 ERL_NIF_TERM x_setxattr(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
@@ -64,6 +147,7 @@ ERL_NIF_TERM x_setxattr(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
     enif_inspect_binary(env, argv[3], &ibin);
 
     int err = rados_setxattr(io, oid, xattr, (const char*)ibin.data, ibin.size);
+    cache_invalidate(id, oid);
     if (err < 0) 
     {
         return make_error_tuple(env, -err);
@@ -90,6 +174,7 @@ ERL_NIF_TERM x_rmxattr(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
     }
     
     int err = rados_rmxattr(io, oid, xattr);
+    cache_invalidate(id, oid);
     if (err < 0) 
     {
         return make_error_tuple(env, -err);
@@ -122,7 +207,7 @@ ERL_NIF_TERM x_getxattrs(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
     }
 
     uint64_t iter_id = new_id();
-    map_xattr_iter_add(iter_id, iter);
+    map_xattr_iter_add(iter_id, iter, id);
     return enif_make_tuple2(env,
                             enif_make_atom(env, "ok"),
                             enif_make_uint64(env, iter_id));
@@ -201,3 +286,173 @@ ERL_NIF_TERM x_getxattrs_end(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]
 
     return enif_make_atom(env, "ok");
 }
+
+ERL_NIF_TERM x_getxattrs_map(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    uint64_t id;
+    char oid[MAX_NAME_LEN];
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_get_string(env, argv[1], oid, MAX_NAME_LEN, ERL_NIF_LATIN1))
+    {
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        return enif_make_badarg(env);
+    }
+
+    rados_xattrs_iter_t iter;
+    int err = rados_getxattrs(io, oid, &iter);
+    if (err < 0) 
+    {
+        return make_error_tuple(env, -err);
+    }
+
+    // Drain the iterator here, so that it never outlives this call.
+    ERL_NIF_TERM xattrs = enif_make_new_map(env);
+    while (1)
+    {
+        const char * name[1];
+        const char * val[1];
+        size_t len = 0;
+        err = rados_getxattrs_next(iter, name, val, &len);
+        if (err < 0)
+        {
+            rados_getxattrs_end(iter);
+            return make_error_tuple(env, -err);
+        }
+        if (name[0] == NULL)
+            break;
+
+        ERL_NIF_TERM k, v;
+        size_t name_len = strlen(name[0]);
+        memcpy(enif_make_new_binary(env, name_len, &k), name[0], name_len);
+        memcpy(enif_make_new_binary(env, len, &v), val[0], len);
+        enif_make_map_put(env, xattrs, k, v, &xattrs);
+    }
+    rados_getxattrs_end(iter);
+
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            xattrs);
+}
+
+ERL_NIF_TERM x_getxattr_many(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    uint64_t id;
+    char oid[MAX_NAME_LEN];
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_get_string(env, argv[1], oid, MAX_NAME_LEN, ERL_NIF_LATIN1) ||
+        !enif_is_list(env, argv[2]))
+    {
+        return enif_make_badarg(env);
+    }
+
+    set<string> names;
+    char xattr[MAX_NAME_LEN];
+    ERL_NIF_TERM head, tail = argv[2];
+    while (enif_get_list_cell(env, tail, &head, &tail))
+    {
+        if (!get_name_arg(env, head, xattr, MAX_NAME_LEN))
+            return enif_make_badarg(env);
+        names.insert(xattr);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        return enif_make_badarg(env);
+    }
+
+    // One read op with a getxattr per name, so that only the values asked
+    // for are transferred, in one round trip. The C API has no getxattr
+    // op, hence the C++ one. A missing xattr does not fail the others.
+    vector<string> keys(names.begin(), names.end());
+    vector<librados::bufferlist> vals(keys.size());
+    vector<int> rvals(keys.size(), 0);
+    librados::ObjectReadOperation op;
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        op.getxattr(keys[i].c_str(), &vals[i], &rvals[i]);
+        op.set_op_flags2(LIBRADOS_OP_FLAG_FAILOK);
+    }
+
+    librados::IoCtx ioctx;
+    librados::IoCtx::from_rados_ioctx_t(io, ioctx);
+    int err = ioctx.operate(oid, &op, NULL);
+    if (err < 0)
+    {
+        return make_error_tuple(env, -err);
+    }
+
+    ERL_NIF_TERM xattrs = enif_make_new_map(env);
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        if (rvals[i] == -ENODATA)
+            continue;
+        if (rvals[i] < 0)
+            return make_error_tuple(env, -rvals[i]);
+
+        ERL_NIF_TERM k, v;
+        memcpy(enif_make_new_binary(env, keys[i].size(), &k), keys[i].data(), keys[i].size());
+        unsigned char * data = enif_make_new_binary(env, vals[i].length(), &v);
+        if (vals[i].length() > 0)
+            vals[i].copy(0, vals[i].length(), (char *)data);
+        enif_make_map_put(env, xattrs, k, v, &xattrs);
+    }
+
+    return enif_make_tuple2(env,
+                            enif_make_atom(env, "ok"),
+                            xattrs);
+}
+
+ERL_NIF_TERM x_setxattr_many(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    uint64_t id;
+    char oid[MAX_NAME_LEN];
+    if (!enif_get_uint64(env, argv[0], &id) ||
+        !enif_get_string(env, argv[1], oid, MAX_NAME_LEN, ERL_NIF_LATIN1) ||
+        !enif_is_map(env, argv[2]))
+    {
+        return enif_make_badarg(env);
+    }
+
+    rados_ioctx_t io = map_ioctx_get(id);
+    if (io == NULL)
+    {
+        return enif_make_badarg(env);
+    }
+
+    // All the xattrs go into one write op, so they are set atomically.
+    rados_write_op_t op = rados_create_write_op();
+    ErlNifMapIterator it;
+    enif_map_iterator_create(env, argv[2], &it, ERL_NIF_MAP_ITERATOR_FIRST);
+    ERL_NIF_TERM k, v;
+    char xattr[MAX_NAME_LEN];
+    while (enif_map_iterator_get_pair(env, &it, &k, &v))
+    {
+        ErlNifBinary ibin;
+        if (!get_name_arg(env, k, xattr, MAX_NAME_LEN) ||
+            !enif_inspect_binary(env, v, &ibin))
+        {
+            enif_map_iterator_destroy(env, &it);
+            rados_release_write_op(op);
+            return enif_make_badarg(env);
+        }
+        rados_write_op_setxattr(op, xattr, (const char*)ibin.data, ibin.size);
+        enif_map_iterator_next(env, &it);
+    }
+    enif_map_iterator_destroy(env, &it);
+
+    int err = rados_write_op_operate(op, io, oid, NULL, LIBRADOS_OPERATION_NOFLAG);
+    cache_invalidate(id, oid);
+    rados_release_write_op(op);
+    if (err < 0) 
+    {
+        return make_error_tuple(env, -err);
+    }
+
+    return enif_make_atom(env, "ok");
+}
@@ -17,37 +17,69 @@
 
 #include "tmutil.hpp"
 
+#if __unix__
+#ifdef CLOCK_REALTIME_COARSE
+#define XTIME_CLOCK     CLOCK_REALTIME_COARSE
+#else
+#define XTIME_CLOCK     CLOCK_REALTIME
+#endif
+
+// Local time of the last second seen by the thread
+static __thread time_t cached_sec = (time_t)-1;
+static __thread struct tm cached_tm;
+#endif
+
+// Date and time up to the second last formatted by the thread
+static __thread long cached_key = -1;
+static __thread char cached_prefix[XTIME_STR_LEN];
+
 void TMUtil::getCurrentTime(struct XTime& currTime)
 {
 #if __WIN32__ || _MSC_VER
-    static SYSTEMTIME st;
+    SYSTEMTIME st;
     GetSystemTime(&st);
     currTime.weekday = st.wDayOfWeek;
-    currTime.month = st.wMonth;
+    currTime.month = st.wMonth - 1;     // wMonth is 1..12
     currTime.day = st.wDay;
     currTime.year = st.wYear;
     currTime.hour = st.wHour;
     currTime.min = st.wMinute;
     currTime.second = st.wSecond;
-    currime.millisecond = st.wMilliseconds;
+    currTime.millisecond = st.wMilliseconds;
 #elif __unix__
-    static struct timeval tv;
-    static struct tm* ptm;
-    static int milliseconds;
-
-    // obtain time of day and convert to a tm struct
-    gettimeofday(&tv, NULL);
-    ptm = localtime((const time_t*)&tv.tv_sec);
-    // Convert microseconds to milliseconds
-    milliseconds = tv.tv_usec / 1000;
-
-    currTime.weekday = ptm->tm_wday;
-    currTime.month = ptm->tm_mon;
-    currTime.day = ptm->tm_mday;
-    currTime.year = 1900 + ptm->tm_year;
-    currTime.hour = ptm->tm_hour;
-    currTime.min = ptm->tm_min;
-    currTime.second = ptm->tm_sec;
-    currTime.millisecond = milliseconds;
+    struct timespec ts;
+    clock_gettime(XTIME_CLOCK, &ts);
+    if (ts.tv_sec != cached_sec) {
+        localtime_r(&ts.tv_sec, &cached_tm);
+        cached_sec = ts.tv_sec;
+    }
+
+    currTime.weekday = cached_tm.tm_wday;
+    currTime.month = cached_tm.tm_mon;
+    currTime.day = cached_tm.tm_mday;
+    currTime.year = 1900 + cached_tm.tm_year;
+    currTime.hour = cached_tm.tm_hour;
+    currTime.min = cached_tm.tm_min;
+    currTime.second = cached_tm.tm_sec;
+    currTime.millisecond = ts.tv_nsec / 1000000;
 #endif
 }
+
+void TMUtil::formatTime(const struct XTime& tm, char* buf)
+{
+    long key = ((((((long)tm.year * 16 + tm.month) * 32 + tm.day) * 32 + tm.hour) * 64 +
+                 tm.min) * 64) + tm.second;
+    if (key != cached_key) {
+        snprintf(cached_prefix, XTIME_STR_LEN, "%d-%02d-%02d %02d:%02d:%02d.",
+                 tm.year, tm.month + 1, tm.day, tm.hour, tm.min, tm.second);
+        cached_key = key;
+    }
+
+    size_t len = strlen(cached_prefix);
+    memcpy(buf, cached_prefix, len);
+    int ms = tm.millisecond;
+    buf[len++] = '0' + ms / 100;
+    buf[len++] = '0' + ms / 10 % 10;
+    buf[len++] = '0' + ms % 10;
+    buf[len] = '\0';
+}
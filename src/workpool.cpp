@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2012, xp@renzhi.ca
+ * All rights reserved.
+ */
+
+#include "workpool.hpp"
+
+XWorkPool::XWorkPool(int max_threads) :
+    max_threads(max_threads),
+    idle_threads(0),
+    stopping(false)
+{
+}
+
+XWorkPool::~XWorkPool()
+{
+    stop();
+}
+
+void XWorkPool::submit(XWorkItem* item)
+{
+    mutex.lock();
+    if (stopping) {
+        mutex.unlock();
+        item->abort();
+        item->release();
+        return;
+    }
+    queue.push_back(item);
+    if (idle_threads == 0 && (int)threads.size() < max_threads) {
+        ErlNifTid tid;
+        if (enif_thread_create((char *)"rados_work", &tid, threadMain, this, NULL) == 0)
+            threads.push_back(tid);
+    }
+    cond.signal();
+    mutex.unlock();
+}
+
+void XWorkPool::stop()
+{
+    mutex.lock();
+    stopping = true;
+    cond.broadcast();
+    vector<ErlNifTid> to_join;
+    to_join.swap(threads);
+    mutex.unlock();
+
+    for (size_t i = 0; i < to_join.size(); i++)
+        enif_thread_join(to_join[i], NULL);
+
+    mutex.lock();
+    deque<XWorkItem*> aborted;
+    aborted.swap(queue);
+    mutex.unlock();
+
+    while (!aborted.empty()) {
+        XWorkItem * item = aborted.front();
+        aborted.pop_front();
+        item->abort();
+        item->release();
+    }
+}
+
+int XWorkPool::pending()
+{
+    mutex.lock();
+    int n = queue.size();
+    mutex.unlock();
+    return n;
+}
+
+void* XWorkPool::threadMain(void* arg)
+{
+    ((XWorkPool*)arg)->work();
+    return NULL;
+}
+
+void XWorkPool::work()
+{
+    mutex.lock();
+    while (!stopping) {
+        if (queue.empty()) {
+            idle_threads++;
+            cond.wait(mutex);
+            idle_threads--;
+            continue;
+        }
+
+        XWorkItem * item = queue.front();
+        queue.pop_front();
+        mutex.unlock();
+
+        XWorkItem::Status status = item->run();
+
+        mutex.lock();
+        if (status == XWorkItem::AGAIN) {
+            queue.push_back(item);
+        }
+        else if (status == XWorkItem::DONE) {
+            mutex.unlock();
+            item->release();
+            mutex.lock();
+        }
+    }
+    mutex.unlock();
+}
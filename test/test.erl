@@ -233,6 +233,35 @@ create_cluster_list(Num) ->
     io:format("Total time = ~p (~p) microseconds~n", [U1, U2]),
     L.
 
+%% Connect Num clusters in parallel, each with a connect timeout of
+%% Timeout seconds.
+create_connect_async(Num, Timeout) ->
+    Clusters = [begin
+                    {ok, Cluster} = rados:create(),
+                    rados:conf_read_file(Cluster, "./etc/ceph.conf"),
+                    {ok, ConnId} = rados:connect_async(Cluster, self(), [{timeout, Timeout}]),
+                    {ConnId, Cluster}
+                end || _ <- lists:seq(1, Num)],
+    [receive
+         {rados_connect, ConnId, ok} ->
+             Cluster;
+         {rados_connect, ConnId, {error, Reason}} ->
+             io:format("Cluster ~p failed to connect: ~p~n", [Cluster, Reason]),
+             rados:shutdown(Cluster),
+             failed
+     end || {ConnId, Cluster} <- Clusters].
+
+create_cluster_list_async(Num, Timeout) ->
+    statistics(runtime),
+    statistics(wall_clock),
+    L = create_connect_async(Num, Timeout),
+    {_, Time1} = statistics(runtime),
+    {_, Time2} = statistics(wall_clock),
+    U1 = Time1 * 1000,
+    U2 = Time2 * 1000,
+    io:format("Total time = ~p (~p) microseconds~n", [U1, U2]),
+    [C || C <- L, C =/= failed].
+
 shutdown_cluster(C) ->
     rados:shutdown(C),
     io:format("Cluster : ~p~n", [C]).
@@ -323,3 +352,117 @@ test_load_files(Folder, Pool) ->
     rados:shutdown(Cluster),
     ok.
         
+
+%% Benchmark of the disk cache with a skewed access pattern: NumReads reads
+%% among NumObjects objects of Size bytes, the object of rank I being read
+%% with a probability proportional to 1/I^S (Zipf). The reads are run
+%% without the cache, then with the cache once warmed up, and the latencies
+%% are printed in microseconds.
+bench_disk_cache(Pool, Dir, NumObjects, Size, NumReads) ->
+    bench_disk_cache(Pool, Dir, NumObjects, Size, NumReads, 1.0).
+
+bench_disk_cache(Pool, Dir, NumObjects, Size, NumReads, S) ->
+    Cluster = create_and_connect_cluster(),
+    Io = create_ioctx(Cluster, Pool),
+    Data = list_to_binary(lists:duplicate(Size, $x)),
+    Oids = list_to_tuple([bench_oid(I) || I <- lists:seq(1, NumObjects)]),
+    [ok = rados:write_full(Io, Oid, Data) || Oid <- tuple_to_list(Oids)],
+    Cdf = zipf_cdf(NumObjects, S),
+    Seq = [element(zipf_sample(Cdf), Oids) || _ <- lists:seq(1, NumReads)],
+
+    Uncached = bench_reads(Io, Seq, Size),
+    ok = rados:disk_cache_open(Dir, []),
+    ok = rados:disk_cache_enable(Io),
+    bench_reads(Io, Seq, Size),
+    wait_disk_stores(),
+    Cached = bench_reads(Io, Seq, Size),
+    {ok, Stats} = rados:disk_cache_stats(),
+    ok = rados:disk_cache_close(),
+
+    print_latencies("uncached", Uncached),
+    print_latencies("cached", Cached),
+    io:format("cache: ~p~n", [Stats]),
+
+    [rados:remove(Io, Oid) || Oid <- tuple_to_list(Oids)],
+    rados:ioctx_destroy(Io),
+    rados:shutdown(Cluster),
+    ok.
+
+%% The ranges of the warm-up pass are written to the cache directory in
+%% the background, wait for them before measuring.
+wait_disk_stores() ->
+    {ok, Stats} = rados:disk_cache_stats(),
+    case proplists:get_value(pending_stores, Stats) of
+        0 ->
+            ok;
+        _ ->
+            timer:sleep(10),
+            wait_disk_stores()
+    end.
+
+bench_oid(I) ->
+    "bench_" ++ integer_to_list(I).
+
+bench_reads(Io, Seq, Size) ->
+    Times = [begin
+                 {T, {ok, _}} = timer:tc(rados, read, [Io, Oid, Size, 0]),
+                 T
+             end || Oid <- Seq],
+    lists:sort(Times).
+
+print_latencies(Name, Sorted) ->
+    N = length(Sorted),
+    Avg = lists:sum(Sorted) / N,
+    P50 = lists:nth(max(1, N * 50 div 100), Sorted),
+    P99 = lists:nth(max(1, N * 99 div 100), Sorted),
+    io:format("~s: avg=~.1f p50=~p p99=~p~n", [Name, Avg, P50, P99]).
+
+%% Benchmark of the cost of the log entries of a NIF call: NumReads reads
+%% of a small object, all served by the read cache, with the log level at
+%% none then at debug. No log handler is added, so that only the log calls
+%% are measured, not the output. Run it against a build made with
+%% "make NO_DEBUG_LOG=1", and a build of the previous version, to compare.
+bench_log_overhead(Pool, NumReads) ->
+    Cluster = create_and_connect_cluster(),
+    Io = create_ioctx(Cluster, Pool),
+    Oid = bench_oid(0),
+    ok = rados:write_full(Io, Oid, <<"log overhead">>),
+    ok = rados:cache_enable(Io, [{validate, false}]),
+    Seq = lists:duplicate(NumReads, Oid),
+    bench_reads(Io, Seq, 16),
+
+    ok = rados:set_log_level(none),
+    Disabled = bench_reads(Io, Seq, 16),
+    ok = rados:set_log_level(debug),
+    Enabled = bench_reads(Io, Seq, 16),
+    ok = rados:set_log_level(none),
+
+    print_latencies("log none", Disabled),
+    print_latencies("log debug", Enabled),
+
+    rados:cache_disable(Io),
+    rados:remove(Io, Oid),
+    rados:ioctx_destroy(Io),
+    rados:shutdown(Cluster),
+    ok.
+
+%% Cumulative distribution of Zipf(N, S), as a tuple.
+zipf_cdf(N, S) ->
+    Weights = [1 / math:pow(I, S) || I <- lists:seq(1, N)],
+    Total = lists:sum(Weights),
+    {Cdf, _} = lists:mapfoldl(fun(W, Acc) -> {Acc + W / Total, Acc + W / Total} end,
+                              0, Weights),
+    list_to_tuple(Cdf).
+
+%% Rank of a random sample, found by bisection of the distribution.
+zipf_sample(Cdf) ->
+    zipf_search(Cdf, rand:uniform(), 1, tuple_size(Cdf)).
+
+zipf_search(_Cdf, _U, Lo, Lo) ->
+    Lo;
+zipf_search(Cdf, U, Lo, Hi) ->
+    Mid = (Lo + Hi) div 2,
+    case element(Mid, Cdf) < U of
+        true -> zipf_search(Cdf, U, Mid + 1, Hi);
+        false -> zipf_search(Cdf, U, Lo, Mid)
+    end.